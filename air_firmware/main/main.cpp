@@ -858,14 +858,15 @@ static void handle_ground2air_config_packet(Ground2Air_Config_Packet& src)
         LOG("Wifi power changed from %d to %d\n", (int)dst.wifi_power, (int)src.wifi_power);
         ESP_ERROR_CHECK(set_wlan_power_dBm(src.wifi_power));
     }
-    if (dst.fec_codec_k != src.fec_codec_k || dst.fec_codec_n != src.fec_codec_n || dst.fec_codec_mtu != src.fec_codec_mtu)
+    if (dst.fec_codec_k != src.fec_codec_k || dst.fec_codec_n != src.fec_codec_n || dst.fec_codec_mtu != src.fec_codec_mtu || dst.fec_codec_type != src.fec_codec_type)
     {
-        LOG("FEC codec changed from %d/%d/%d to %d/%d/%d\n", (int)dst.fec_codec_k, (int)dst.fec_codec_n, (int)dst.fec_codec_mtu, (int)src.fec_codec_k, (int)src.fec_codec_n, (int)src.fec_codec_mtu);
+        LOG("FEC codec changed from %d/%d/%d/%d to %d/%d/%d/%d\n", (int)dst.fec_codec_type, (int)dst.fec_codec_k, (int)dst.fec_codec_n, (int)dst.fec_codec_mtu, (int)src.fec_codec_type, (int)src.fec_codec_k, (int)src.fec_codec_n, (int)src.fec_codec_mtu);
         {
             //binary semaphores have to be given first
             xSemaphoreGive(s_fec_encoder_mux);
 
             Fec_Codec::Descriptor descriptor;
+            descriptor.codec = (Fec_Codec::Codec)src.fec_codec_type;
             descriptor.coding_k = src.fec_codec_k;
             descriptor.coding_n = src.fec_codec_n;
             descriptor.mtu = src.fec_codec_mtu;
@@ -1086,8 +1087,6 @@ IRAM_ATTR static void wifi_rx_proc(void *)
 
 void setup_wifi()
 {
-    init_crc8_table();
-
     init_fec();
     initialize_status_led();
 
@@ -1096,6 +1095,7 @@ void setup_wifi()
         xSemaphoreGive(s_fec_encoder_mux);
 
         Fec_Codec::Descriptor descriptor;
+        descriptor.codec = (Fec_Codec::Codec)s_ground2air_config_packet.fec_codec_type;
         descriptor.coding_k = s_ground2air_config_packet.fec_codec_k;
         descriptor.coding_n = s_ground2air_config_packet.fec_codec_n;
         descriptor.mtu = s_ground2air_config_packet.fec_codec_mtu;
@@ -1195,7 +1195,8 @@ IRAM_ATTR void send_air2ground_video_packet(bool last)
     packet.pong = s_ground2air_config_packet.ping;
     packet.crc = 0;
     packet.crc = crc8(0, &packet, sizeof(Air2Ground_Video_Packet));
-    if (!s_fec_encoder.flush_encode_packet(true))
+    //close the block on the last packet of the frame so the ground can recover the frame without waiting for the next one
+    if (!s_fec_encoder.flush_encode_packet(true, last))
     {
         LOG("Fec codec busy\n");
         s_stats.wlan_error_count++;
@@ -1,18 +1,27 @@
 #include "crc.h"
 
-static uint8_t s_crc8_table[256]; /* 8-bit table */
-void init_crc8_table()
+struct Crc8_Table
 {
-    static constexpr uint8_t DI = 0x07;
+    uint8_t data[256] = {};
+};
+
+static constexpr Crc8_Table make_crc8_table()
+{
+    constexpr uint8_t DI = 0x07;
+    Crc8_Table t;
     for (uint16_t i = 0; i < 256; i++)
     {
         uint8_t crc = (uint8_t)i;
         for (uint8_t j = 0; j < 8; j++)
-            crc = (crc << 1) ^ ((crc & 0x80) ? DI : 0);
-        s_crc8_table[i] = crc & 0xFF;
+            crc = (uint8_t)(crc << 1) ^ ((crc & 0x80) ? DI : 0);
+        t.data[i] = crc;
     }
+    return t;
 }
 
+//generated at compile time. Kept in DRAM on the ESP as crc8 can run with the flash cache disabled
+alignas(64) static constexpr DRAM_ATTR Crc8_Table s_crc8_table = make_crc8_table();
+
 IRAM_ATTR uint8_t crc8(uint8_t crc, const void *c_ptr, size_t len)
 {
     const uint8_t *c = reinterpret_cast<const uint8_t *>(c_ptr);
@@ -22,22 +31,54 @@ IRAM_ATTR uint8_t crc8(uint8_t crc, const void *c_ptr, size_t len)
     case 0:
         do
         {
-            crc = s_crc8_table[crc ^ (*c++)];
+            crc = s_crc8_table.data[crc ^ (*c++)];
         case 7:
-            crc = s_crc8_table[crc ^ (*c++)];
+            crc = s_crc8_table.data[crc ^ (*c++)];
         case 6:
-            crc = s_crc8_table[crc ^ (*c++)];
+            crc = s_crc8_table.data[crc ^ (*c++)];
         case 5:
-            crc = s_crc8_table[crc ^ (*c++)];
+            crc = s_crc8_table.data[crc ^ (*c++)];
         case 4:
-            crc = s_crc8_table[crc ^ (*c++)];
+            crc = s_crc8_table.data[crc ^ (*c++)];
         case 3:
-            crc = s_crc8_table[crc ^ (*c++)];
+            crc = s_crc8_table.data[crc ^ (*c++)];
         case 2:
-            crc = s_crc8_table[crc ^ (*c++)];
+            crc = s_crc8_table.data[crc ^ (*c++)];
         case 1:
-            crc = s_crc8_table[crc ^ (*c++)];
+            crc = s_crc8_table.data[crc ^ (*c++)];
         } while (--n > 0);
     }
     return crc;
-}
\ No newline at end of file
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Crc32_Table
+{
+    uint32_t data[256] = {};
+};
+
+static constexpr Crc32_Table make_crc32_table()
+{
+    constexpr uint32_t POLY = 0xEDB88320; //reflected 0x04C11DB7
+    Crc32_Table t;
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (uint8_t j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ ((crc & 1) ? POLY : 0);
+        t.data[i] = crc;
+    }
+    return t;
+}
+
+alignas(64) static constexpr Crc32_Table s_crc32_table = make_crc32_table();
+
+uint32_t crc32_fcs(uint32_t crc, const void *c_ptr, size_t len)
+{
+    const uint8_t *c = reinterpret_cast<const uint8_t *>(c_ptr);
+    crc = ~crc;
+    while (len-- > 0)
+        crc = (crc >> 8) ^ s_crc32_table.data[(crc ^ *c++) & 0xFF];
+    return ~crc;
+}
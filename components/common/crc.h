@@ -7,7 +7,10 @@
 #   include "esp_task_wdt.h"
 #else
 #   define IRAM_ATTR
+#   define DRAM_ATTR
 #endif
 
-void init_crc8_table();
 IRAM_ATTR uint8_t crc8(uint8_t crc, const void *c_ptr, size_t len);
+
+//The CRC-32 of ethernet and of the 802.11 FCS. Pass the previous result to continue a crc, 0 to start one
+uint32_t crc32_fcs(uint32_t crc, const void *c_ptr, size_t len);
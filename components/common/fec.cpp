@@ -3,21 +3,40 @@
  */
 
 #include "fec.h"
+#include "fec_tables.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
-#ifdef ESP_PLATFORM
-#include "esp_heap_caps.h"
+#ifndef ESP_PLATFORM
+#include <chrono>
+#include <vector>
 #endif
 
 /*
- * Primitive polynomials - see Lin & Costello, Appendix A,
- * and  Lee & Messerschmitt, p. 453.
+ * FEC_SWAR_ADDMUL=1 picks the 32 bit split-nibble kernel (_addmul_swar) instead of
+ * the 64K table / SIMD ones. It's the default on the ESP where the big table is
+ * too slow to reach, build with -DFEC_SWAR_ADDMUL=0 to go back to the table.
  */
-static const char*const Pp="101110001";
+#if !defined(FEC_SWAR_ADDMUL)
+#if defined(ESP_PLATFORM)
+#define FEC_SWAR_ADDMUL 1
+#else
+#define FEC_SWAR_ADDMUL 0
+#endif
+#endif
 
+#if FEC_SWAR_ADDMUL
+/* no SIMD kernels */
+#elif !defined(ESP_PLATFORM) && (defined(__x86_64__) || defined(__i386__))
+#define FEC_X86_SIMD
+#include <immintrin.h>
+#elif !defined(ESP_PLATFORM) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define FEC_NEON_SIMD
+#include <arm_neon.h>
+#endif
 
 /*
  * To speed up computations, we have tables for logarithm, exponent and
@@ -26,11 +45,12 @@ static const char*const Pp="101110001";
  * pre-initialized an put into a ROM!), otherwhise we use a table of
  * logarithms. In any case the macro gf_mul(x,y) takes care of
  * multiplications.
+ * All of them are generated at compile time (see fec_tables.h) so they end up
+ * in flash on the ESP and in .rodata otherwise.
  */
 
-static gf gf_exp[510];  /* index->poly form conversion table    */
-static int gf_log[256]; /* Poly->index form conversion table    */
-static gf inverse[256]; /* inverse of field elem.               */
+static const gf*const gf_exp = fec_tables::GF_TABLES.exp;      /* index->poly form conversion table    */
+static const gf*const inverse = fec_tables::GF_TABLES.inverse; /* inverse of field elem.               */
                                 /* inv[\alpha**i]=\alpha**(GF_SIZE-i-1) */
 
 /*
@@ -58,106 +78,12 @@ modnn(int x) {
  * multiplication is held in a local variable declared with USE_GF_MULC . See
  * usage in _addmul1().
  */
-static gf* gf_mul_table[256];
-
-/*
- * Generate GF(2**m) from the irreducible polynomial p(X) in p[0]..p[m]
- * Lookup tables:
- *     index->polynomial form		gf_exp[] contains j= \alpha^i;
- *     polynomial form -> index form	gf_log[ j = \alpha^i ] = i
- * \alpha=x is the primitive element of GF(2^m)
- *
- * For efficiency, gf_exp[] has size 2*GF_SIZE, so that a simple
- * multiplication of two numbers can be resolved without calling modnn
- */
-static void
-_init_mul_table(void) {
-  int i, j;
-  for (i = 0; i < 256; i++)
-  {
-#ifdef ESP_PLATFORM      
-      gf_mul_table[i] = (gf*)heap_caps_malloc(256, MALLOC_CAP_SPIRAM);
-      if (!gf_mul_table[i])
-        gf_mul_table[i] = new gf[256];
-#else
-      gf_mul_table[i] = new gf[256];
-#endif
-      
-      for (j = 0; j < 256; j++)
-          gf_mul_table[i][j] = gf_exp[modnn (gf_log[i] + gf_log[j])];
-  }
-
-  for (j = 0; j < 256; j++)
-      gf_mul_table[0][j] = gf_mul_table[j][0] = 0;
-}
+alignas(64) static constexpr fec_tables::Gf_Mul_Table s_gf_mul_table = fec_tables::make_gf_mul_table();
+static const gf (*const gf_mul_table)[256] = s_gf_mul_table.data;
 
 #define NEW_GF_MATRIX(rows, cols) \
     (gf*)malloc(rows * cols)
 
-/*
- * initialize the data structures used for computations in GF.
- */
-static void
-generate_gf (void) {
-    int i;
-    gf mask;
-
-    mask = 1;                     /* x ** 0 = 1 */
-    gf_exp[8] = 0;          /* will be updated at the end of the 1st loop */
-    /*
-     * first, generate the (polynomial representation of) powers of \alpha,
-     * which are stored in gf_exp[i] = \alpha ** i .
-     * At the same time build gf_log[gf_exp[i]] = i .
-     * The first 8 powers are simply bits shifted to the left.
-     */
-    for (i = 0; i < 8; i++, mask <<= 1) {
-        gf_exp[i] = mask;
-        gf_log[gf_exp[i]] = i;
-        /*
-         * If Pp[i] == 1 then \alpha ** i occurs in poly-repr
-         * gf_exp[8] = \alpha ** 8
-         */
-        if (Pp[i] == '1')
-            gf_exp[8] ^= mask;
-    }
-    /*
-     * now gf_exp[8] = \alpha ** 8 is complete, so can also
-     * compute its inverse.
-     */
-    gf_log[gf_exp[8]] = 8;
-    /*
-     * Poly-repr of \alpha ** (i+1) is given by poly-repr of
-     * \alpha ** i shifted left one-bit and accounting for any
-     * \alpha ** 8 term that may occur when poly-repr of
-     * \alpha ** i is shifted.
-     */
-    mask = 1 << 7;
-    for (i = 9; i < 255; i++) {
-        if (gf_exp[i - 1] >= mask)
-            gf_exp[i] = gf_exp[8] ^ ((gf_exp[i - 1] ^ mask) << 1);
-        else
-            gf_exp[i] = gf_exp[i - 1] << 1;
-        gf_log[gf_exp[i]] = i;
-    }
-    /*
-     * log(0) is not defined, so use a special value
-     */
-    gf_log[0] = 255;
-    /* set the extended gf_exp values for fast multiply */
-    for (i = 0; i < 255; i++)
-        gf_exp[i + 255] = gf_exp[i];
-
-    /*
-     * again special cases. 0 has no inverse. This used to
-     * be initialized to 255, but it should make no difference
-     * since noone is supposed to read from here.
-     */
-    inverse[0] = 0;
-    inverse[1] = 1;
-    for (i = 2; i <= 255; i++)
-        inverse[i] = gf_exp[255 - gf_log[i]];
-}
-
 /*
  * Various linear algebra operations that i use often.
  */
@@ -165,7 +91,7 @@ generate_gf (void) {
 
 #define gf_mul(x,y) gf_mul_table[x][y]
 
-#define USE_GF_MULC register gf * __gf_mulc_
+#define USE_GF_MULC const gf * __gf_mulc_
 
 #define GF_MULC0(c) __gf_mulc_ = gf_mul_table[c]
 #define GF_ADDMULC(dst, x) dst ^= __gf_mulc_[x]
@@ -176,13 +102,16 @@ generate_gf (void) {
  * unrolled 16 times, a good value for 486 and pentium-class machines.
  * The case c=0 is also optimized, whereas c=1 is not. These
  * calls are unfrequent in my typical apps so I did not bother.
+ *
+ * The actual kernel is picked by init_fec() based on what the cpu supports,
+ * all of them produce exactly the same bytes as _addmul1.
  */
 #define addmul(dst, src, c, sz)                 \
-    if (c != 0) _addmul1(dst, src, c, sz)
+    if (c != 0) s_addmul_kernel(dst, src, c, sz)
 
 #define UNROLL 16               /* 1, 4, 8, 16 */
 static void
-_addmul1(register gf*restrict dst, const register gf*restrict src, gf c, size_t sz) {
+_addmul1(gf*restrict dst, const gf*restrict src, gf c, size_t sz) {
     USE_GF_MULC;
     const gf* lim = &dst[sz - UNROLL + 1];
 
@@ -217,6 +146,149 @@ _addmul1(register gf*restrict dst, const register gf*restrict src, gf c, size_t
         GF_ADDMULC (*dst, *src);
 }
 
+typedef void (*addmul_kernel_t)(gf*restrict dst, const gf*restrict src, gf c, size_t sz);
+static addmul_kernel_t s_addmul_kernel = _addmul1;
+static const char* s_addmul_kernel_name = "scalar";
+
+/*
+ * Split-nibble tables: c * x = lo[x & 15] ^ hi[x >> 4]
+ * where lo = gf_mul_nibble_table[c][0..15] and hi = gf_mul_nibble_table[c][16..31].
+ * A 16 entry table fits in one vector register so the multiplication becomes
+ * 2 byte shuffles instead of one table lookup per byte.
+ */
+alignas(64) static constexpr fec_tables::Gf_Mul_Nibble_Table s_gf_mul_nibble_table = fec_tables::make_gf_mul_nibble_table();
+static const gf (*const gf_mul_nibble_table)[32] = s_gf_mul_nibble_table.data;
+
+/*
+ * The same split-nibble multiplication for cores without SIMD, 4 bytes at a time.
+ * The 32 bytes of tables of c are copied on the stack first so all the lookups
+ * hit internal RAM instead of the 64K table in flash/PSRAM.
+ * dst and src need the same alignment (mod 4) for the word loop, which is the
+ * case for the packets of Fec_Codec, otherwise it goes byte by byte.
+ */
+static void
+_addmul_swar(gf*restrict dst, const gf*restrict src, gf c, size_t sz) {
+    gf lo[16], hi[16];
+    memcpy(lo, gf_mul_nibble_table[c], 16);
+    memcpy(hi, gf_mul_nibble_table[c] + 16, 16);
+
+    size_t i = 0;
+    if ((((uintptr_t)dst ^ (uintptr_t)src) & 3) == 0) {
+        for (; i < sz && ((uintptr_t)(dst + i) & 3) != 0; i++)
+            dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+
+        for (; i + 4 <= sz; i += 4) {
+            uint32_t s, d;
+            memcpy(&s, __builtin_assume_aligned(src + i, 4), 4);
+            memcpy(&d, __builtin_assume_aligned(dst + i, 4), 4);
+            uint32_t p = (uint32_t)(lo[s & 15] ^ hi[(s >> 4) & 15]) |
+                         (uint32_t)(lo[(s >> 8) & 15] ^ hi[(s >> 12) & 15]) << 8 |
+                         (uint32_t)(lo[(s >> 16) & 15] ^ hi[(s >> 20) & 15]) << 16 |
+                         (uint32_t)(lo[(s >> 24) & 15] ^ hi[s >> 28]) << 24;
+            d ^= p;
+            memcpy(__builtin_assume_aligned(dst + i, 4), &d, 4);
+        }
+    }
+    for (; i < sz; i++)
+        dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+
+#if defined(FEC_X86_SIMD) || defined(FEC_NEON_SIMD)
+/* the SIMD kernels leave the last (sz % vector size) bytes to this */
+static inline void
+_addmul_tail(gf*restrict dst, const gf*restrict src, gf c, size_t sz) {
+    const gf* mulc = gf_mul_table[c];
+    for (size_t i = 0; i < sz; i++)
+        dst[i] ^= mulc[src[i]];
+}
+#endif
+
+#if defined(FEC_X86_SIMD)
+__attribute__((target("ssse3"))) static void
+_addmul_ssse3(gf*restrict dst, const gf*restrict src, gf c, size_t sz) {
+    const __m128i lo = _mm_loadu_si128((const __m128i*)gf_mul_nibble_table[c]);
+    const __m128i hi = _mm_loadu_si128((const __m128i*)(gf_mul_nibble_table[c] + 16));
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 16 <= sz; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    _addmul_tail(dst + i, src + i, c, sz - i);
+}
+
+__attribute__((target("avx2"))) static void
+_addmul_avx2(gf*restrict dst, const gf*restrict src, gf c, size_t sz) {
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)gf_mul_nibble_table[c]));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(gf_mul_nibble_table[c] + 16)));
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 32 <= sz; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+        __m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+    _addmul_tail(dst + i, src + i, c, sz - i);
+}
+#endif
+
+#if defined(FEC_NEON_SIMD)
+static void
+_addmul_neon(gf*restrict dst, const gf*restrict src, gf c, size_t sz) {
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+#if defined(__aarch64__)
+    const uint8x16_t lo = vld1q_u8(gf_mul_nibble_table[c]);
+    const uint8x16_t hi = vld1q_u8(gf_mul_nibble_table[c] + 16);
+#else
+    uint8x8x2_t lo, hi;
+    lo.val[0] = vld1_u8(gf_mul_nibble_table[c]);
+    lo.val[1] = vld1_u8(gf_mul_nibble_table[c] + 8);
+    hi.val[0] = vld1_u8(gf_mul_nibble_table[c] + 16);
+    hi.val[1] = vld1_u8(gf_mul_nibble_table[c] + 24);
+#endif
+    size_t i = 0;
+    for (; i + 16 <= sz; i += 16) {
+        uint8x16_t s = vld1q_u8(src + i);
+        uint8x16_t d = vld1q_u8(dst + i);
+        uint8x16_t sl = vandq_u8(s, mask);
+        uint8x16_t sh = vshrq_n_u8(s, 4);
+#if defined(__aarch64__)
+        uint8x16_t p = veorq_u8(vqtbl1q_u8(lo, sl), vqtbl1q_u8(hi, sh));
+#else
+        uint8x16_t p = vcombine_u8(veor_u8(vtbl2_u8(lo, vget_low_u8(sl)), vtbl2_u8(hi, vget_low_u8(sh))),
+                                   veor_u8(vtbl2_u8(lo, vget_high_u8(sl)), vtbl2_u8(hi, vget_high_u8(sh))));
+#endif
+        vst1q_u8(dst + i, veorq_u8(d, p));
+    }
+    _addmul_tail(dst + i, src + i, c, sz - i);
+}
+#endif
+
+static void
+_select_addmul_kernel(void) {
+#if FEC_SWAR_ADDMUL
+    s_addmul_kernel = _addmul_swar;
+    s_addmul_kernel_name = "swar";
+#elif defined(FEC_X86_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        s_addmul_kernel = _addmul_avx2;
+        s_addmul_kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        s_addmul_kernel = _addmul_ssse3;
+        s_addmul_kernel_name = "ssse3";
+    }
+#elif defined(FEC_NEON_SIMD)
+    s_addmul_kernel = _addmul_neon;
+    s_addmul_kernel_name = "neon";
+#endif
+}
+
 /*
  * computes C = AB where A is n*k, B is k*m, C is n*m
  */
@@ -406,8 +478,7 @@ _invert_vdm (gf* src, unsigned k) {
 static int fec_initialized = 0;
 void init_fec (void) {
   if (fec_initialized == 0) {
-    generate_gf();
-    _init_mul_table();
+    _select_addmul_kernel();
     fec_initialized = 1;
   }
 }
@@ -420,9 +491,48 @@ void init_fec (void) {
 
 #define FEC_MAGIC	0xFECC0DEC
 
+/*
+ * Number of inverted decode matrices kept per code. With k <= 16 and a
+ * few fec packets per block, the loss patterns seen in practice are
+ * very few so this is plenty.
+ */
+#ifndef FEC_DECODE_CACHE_SIZE
+#define FEC_DECODE_CACHE_SIZE 16
+#endif
+
+struct fec_decode_cache_entry_t {
+    unsigned long long present;     /* bitmap of the block numbers in index[], 0 if the entry is empty */
+    unsigned long last_used;
+    unsigned* index;                /* k entries */
+    gf* matrix;                     /* k*k entries */
+};
+
+static fec_decode_cache_entry_t*
+_new_decode_cache(unsigned k) {
+    fec_decode_cache_entry_t* cache = (fec_decode_cache_entry_t*) malloc (FEC_DECODE_CACHE_SIZE * sizeof (fec_decode_cache_entry_t));
+    unsigned* indices = (unsigned*) malloc (FEC_DECODE_CACHE_SIZE * k * sizeof (unsigned));
+    gf* matrices = NEW_GF_MATRIX (FEC_DECODE_CACHE_SIZE * k, k);
+    for (unsigned i = 0; i < FEC_DECODE_CACHE_SIZE; i++) {
+        cache[i].present = 0;
+        cache[i].last_used = 0;
+        cache[i].index = indices + i * k;
+        cache[i].matrix = matrices + i * k * k;
+    }
+    return cache;
+}
+
+static void
+_free_decode_cache(fec_decode_cache_entry_t* cache) {
+    free (cache[0].index);
+    free (cache[0].matrix);
+    free (cache);
+}
+
 void
 fec_free (fec_t *p) {
     assert (p != NULL && p->magic == (((FEC_MAGIC ^ p->k) ^ p->n) ^ (unsigned long) (p->enc_matrix)));
+    if (p->decode_cache)
+        _free_decode_cache (p->decode_cache);
     free (p->enc_matrix);
     free (p);
 }
@@ -442,6 +552,11 @@ fec_new(unsigned short k, unsigned short n) {
     retval->n = n;
     retval->enc_matrix = NEW_GF_MATRIX (n, k);
     retval->magic = ((FEC_MAGIC ^ k) ^ n) ^ (unsigned long) (retval->enc_matrix);
+    /* the cache key is a 64 bit bitmap of block numbers, bigger codes are not cached */
+    retval->decode_cache = n <= 64 ? _new_decode_cache (k) : NULL;
+    retval->decode_cache_tick = 0;
+    retval->decode_cache_hits = 0;
+    retval->decode_cache_misses = 0;
     tmp_m = NEW_GF_MATRIX (n, k);
     /*
      * fill the matrix with powers of field elements, starting from 0.
@@ -498,6 +613,23 @@ fec_encode(const fec_t* code, const gf*restrict const*restrict const src, gf*res
     }
 }
 
+void
+fec_encode_add(const fec_t* code, const gf*restrict const src, unsigned src_index, gf*restrict const*restrict const fecs, const unsigned*restrict const block_nums, size_t num_block_nums, size_t sz) {
+    size_t i;
+    unsigned fecnum;
+    gf c;
+
+    assert (src_index < code->k);
+    for (i=0; i<num_block_nums; i++) {
+        fecnum=block_nums[i];
+        assert (fecnum >= code->k);
+        if (src_index == 0)
+            bzero(fecs[i], sz);
+        c = code->enc_matrix[fecnum * code->k + src_index];
+        addmul(fecs[i], src, c, sz);
+    }
+}
+
 /**
  * Build decode matrix into some memory space.
  *
@@ -518,13 +650,11 @@ build_decode_matrix_into_space(const fec_t*restrict const code, const unsigned*c
     _invert_mat (matrix, k);
 }
 
-void
-fec_decode(const fec_t* code, const gf*restrict const*restrict const inpkts, gf*restrict const*restrict const outpkts, const unsigned*restrict const index, size_t sz) {
-    gf* m_dec = (gf*)alloca(code->k * code->k);
+static void
+_decode_with_matrix(const fec_t* code, const gf* m_dec, const gf*restrict const*restrict const inpkts, gf*restrict const*restrict const outpkts, const unsigned*restrict const index, size_t sz) {
     unsigned char outix=0;
     unsigned char row=0;
     unsigned char col=0;
-    build_decode_matrix_into_space(code, index, code->k, m_dec);
 
     for (row=0; row<code->k; row++) {
         assert ((index[row] >= code->k) || (index[row] == row)); /* If the block whose number is i is present, then it is required to be in the i'th element. */
@@ -537,6 +667,221 @@ fec_decode(const fec_t* code, const gf*restrict const*restrict const inpkts, gf*
     }
 }
 
+void
+fec_decode(const fec_t* code, const gf*restrict const*restrict const inpkts, gf*restrict const*restrict const outpkts, const unsigned*restrict const index, size_t sz) {
+    gf* m_dec = (gf*)alloca(code->k * code->k);
+    build_decode_matrix_into_space(code, index, code->k, m_dec);
+    _decode_with_matrix(code, m_dec, inpkts, outpkts, index, sz);
+}
+
+void
+fec_decode_cached(fec_t* code, const gf*restrict const*restrict const inpkts, gf*restrict const*restrict const outpkts, const unsigned*restrict const index, size_t sz) {
+    fec_decode_cache_entry_t* cache = code->decode_cache;
+    if (!cache) {
+        fec_decode(code, inpkts, outpkts, index, sz);
+        return;
+    }
+
+    unsigned i;
+    unsigned long long present = 0;
+    for (i = 0; i < code->k; i++)
+        present |= 1ULL << index[i];
+
+    /* look for the erasure pattern, remembering the least recently used entry in case it's not there */
+    fec_decode_cache_entry_t* entry = NULL;
+    fec_decode_cache_entry_t* lru = &cache[0];
+    for (i = 0; i < FEC_DECODE_CACHE_SIZE; i++) {
+        fec_decode_cache_entry_t* e = &cache[i];
+        if (e->present == present && memcmp(e->index, index, code->k * sizeof (unsigned)) == 0) {
+            entry = e;
+            break;
+        }
+        if (e->last_used < lru->last_used)
+            lru = e;
+    }
+
+    if (entry)
+        code->decode_cache_hits++;
+    else {
+        code->decode_cache_misses++;
+        entry = lru;
+        entry->present = present;
+        memcpy(entry->index, index, code->k * sizeof (unsigned));
+        build_decode_matrix_into_space(code, index, code->k, entry->matrix);
+    }
+    entry->last_used = ++code->decode_cache_tick;
+
+    _decode_with_matrix(code, entry->matrix, inpkts, outpkts, index, sz);
+}
+
+void
+fec_get_decode_cache_stats(const fec_t* code, unsigned long* hits, unsigned long* misses) {
+    if (hits)
+        *hits = code->decode_cache_hits;
+    if (misses)
+        *misses = code->decode_cache_misses;
+}
+
+void
+fec_addmul(gf*restrict dst, const gf*restrict src, gf c, size_t sz) {
+    addmul(dst, src, c, sz);
+}
+
+const char*
+fec_get_kernel_name(void) {
+    if (fec_initialized == 0)
+        init_fec ();
+    return s_addmul_kernel_name;
+}
+
+#ifndef ESP_PLATFORM
+
+/*
+ * Runs fec_encode/fec_decode on random data with the scalar kernel and with
+ * the kernel selected by init_fec(), checks that both produce the same bytes
+ * and prints the throughput in MB/s of source data.
+ */
+static double
+_benchmark_kernel(addmul_kernel_t kernel, fec_t* code, const gf*const* src, gf*const* fecs, const unsigned* block_nums,
+                  const gf*const* dec_src, gf*const* dec_dst, const unsigned* dec_index, size_t sz, int mode) {
+    addmul_kernel_t old_kernel = s_addmul_kernel;
+    s_addmul_kernel = kernel;
+
+    using clock = std::chrono::steady_clock;
+    size_t iterations = 0;
+    clock::time_point start = clock::now();
+    clock::duration elapsed;
+    do {
+        for (size_t i = 0; i < 16; i++) {
+            if (mode == 0)
+                fec_encode(code, src, fecs, block_nums, code->n - code->k, sz);
+            else if (mode == 1)
+                fec_decode(code, dec_src, dec_dst, dec_index, sz);
+            else
+                fec_decode_cached(code, dec_src, dec_dst, dec_index, sz);
+        }
+        iterations += 16;
+        elapsed = clock::now() - start;
+    } while (elapsed < std::chrono::milliseconds(250));
+
+    s_addmul_kernel = old_kernel;
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    return (double)(iterations * code->k * sz) / seconds / (1024.0 * 1024.0);
+}
+
+/*
+ * Compares a kernel with _addmul1 for all the coefficients, with odd sizes and
+ * misaligned buffers so the head/tail paths of the kernel are covered too.
+ */
+static int
+_check_addmul_kernel(addmul_kernel_t kernel) {
+    gf src[96 + 4];
+    gf dst[96 + 4];
+    gf ref[96 + 4];
+    for (size_t i = 0; i < sizeof(src); i++)
+        src[i] = (gf)rand();
+
+    for (unsigned c = 1; c < 256; c++) {
+        for (size_t sz = 0; sz <= 96; sz += 1 + c % 7) {
+            size_t src_offset = c & 3;
+            size_t dst_offset = (c >> 2) & 3;
+            for (size_t i = 0; i < sizeof(dst); i++)
+                dst[i] = ref[i] = (gf)(i * 7 + c);
+            _addmul1(ref + dst_offset, src + src_offset, (gf)c, sz);
+            kernel(dst + dst_offset, src + src_offset, (gf)c, sz);
+            if (memcmp(dst, ref, sizeof(dst)) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int
+fec_benchmark(unsigned short k, unsigned short n, size_t sz) {
+    if (fec_initialized == 0)
+        init_fec ();
+
+    fec_t* code = fec_new(k, n);
+    unsigned fec_count = n - k;
+    unsigned lost_count = fec_count < k ? fec_count : k;
+
+    std::vector<gf> data((size_t)n * sz);
+    std::vector<gf> ref_fecs((size_t)fec_count * sz);
+    std::vector<gf> decoded((size_t)lost_count * sz);
+    std::vector<gf> ref_decoded((size_t)lost_count * sz);
+    for (size_t i = 0; i < k * sz; i++)
+        data[i] = (gf)rand();
+
+    std::vector<const gf*> src(k);
+    std::vector<gf*> fecs(fec_count);
+    std::vector<gf*> ref_fecs_ptrs(fec_count);
+    std::vector<unsigned> block_nums(fec_count);
+    for (unsigned i = 0; i < k; i++)
+        src[i] = &data[i * sz];
+    for (unsigned i = 0; i < fec_count; i++) {
+        fecs[i] = &data[(k + i) * sz];
+        ref_fecs_ptrs[i] = &ref_fecs[i * sz];
+        block_nums[i] = k + i;
+    }
+
+    //worst case decode: the first lost_count primary packets are replaced by fec packets
+    std::vector<const gf*> dec_src(k);
+    std::vector<gf*> dec_dst(lost_count);
+    std::vector<gf*> ref_dec_dst(lost_count);
+    std::vector<unsigned> dec_index(k);
+    for (unsigned i = 0; i < k; i++) {
+        dec_src[i] = i < lost_count ? fecs[i] : src[i];
+        dec_index[i] = i < lost_count ? k + i : i;
+    }
+    for (unsigned i = 0; i < lost_count; i++) {
+        dec_dst[i] = &decoded[i * sz];
+        ref_dec_dst[i] = &ref_decoded[i * sz];
+    }
+
+    //correctness first: the selected kernel has to match the scalar one byte for byte
+    addmul_kernel_t kernel = s_addmul_kernel;
+    s_addmul_kernel = _addmul1;
+    fec_encode(code, src.data(), ref_fecs_ptrs.data(), block_nums.data(), fec_count, sz);
+    s_addmul_kernel = kernel;
+    fec_encode(code, src.data(), fecs.data(), block_nums.data(), fec_count, sz);
+
+    s_addmul_kernel = _addmul1;
+    fec_decode(code, dec_src.data(), ref_dec_dst.data(), dec_index.data(), sz);
+    s_addmul_kernel = kernel;
+    fec_decode(code, dec_src.data(), dec_dst.data(), dec_index.data(), sz);
+
+    int result = 0;
+    if (_check_addmul_kernel(kernel) != 0 ||
+        memcmp(ref_fecs.data(), &data[k * sz], ref_fecs.size()) != 0 ||
+        memcmp(ref_decoded.data(), decoded.data(), decoded.size()) != 0 ||
+        memcmp(decoded.data(), data.data(), decoded.size()) != 0) {
+        printf("FEC %u/%u/%zu: %s kernel MISMATCH\n", k, n, sz, s_addmul_kernel_name);
+        result = -1;
+    }
+
+    //the swar kernel is the default on the ESP, so check it here as well even if it's not used on this cpu
+    if (_check_addmul_kernel(_addmul_swar) != 0) {
+        printf("FEC %u/%u/%zu: swar kernel MISMATCH\n", k, n, sz);
+        result = -1;
+    }
+
+    double scalar_enc = _benchmark_kernel(_addmul1, code, src.data(), fecs.data(), block_nums.data(), dec_src.data(), dec_dst.data(), dec_index.data(), sz, 0);
+    double scalar_dec = _benchmark_kernel(_addmul1, code, src.data(), fecs.data(), block_nums.data(), dec_src.data(), dec_dst.data(), dec_index.data(), sz, 1);
+    double enc = _benchmark_kernel(kernel, code, src.data(), fecs.data(), block_nums.data(), dec_src.data(), dec_dst.data(), dec_index.data(), sz, 0);
+    double dec = _benchmark_kernel(kernel, code, src.data(), fecs.data(), block_nums.data(), dec_src.data(), dec_dst.data(), dec_index.data(), sz, 1);
+    double dec_cached = _benchmark_kernel(kernel, code, src.data(), fecs.data(), block_nums.data(), dec_src.data(), dec_dst.data(), dec_index.data(), sz, 2);
+    double swar_enc = _benchmark_kernel(_addmul_swar, code, src.data(), fecs.data(), block_nums.data(), dec_src.data(), dec_dst.data(), dec_index.data(), sz, 0);
+
+    printf("FEC %u/%u/%zu: encode %.1f MB/s (scalar %.1f MB/s, swar %.1f MB/s), decode %.1f MB/s (scalar %.1f MB/s, cached matrix %.1f MB/s), kernel %s\n",
+           k, n, sz, enc, scalar_enc, swar_enc, dec, scalar_dec, dec_cached, s_addmul_kernel_name);
+
+    fec_free(code);
+    return result;
+}
+
+#endif
+
 /**
  * zfec -- fast forward error correction library with Python interface
  *
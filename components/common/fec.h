@@ -4,14 +4,24 @@
  * See README.rst for documentation.
  */
 
+#pragma once
+
 #include <stddef.h>
 
 typedef unsigned char gf;
 
+struct fec_decode_cache_entry_t;
+
 struct fec_t {
   unsigned long magic;
   unsigned short k, n;                     /* parameters of the code */
   gf* enc_matrix;
+
+  /* LRU cache of inverted decode matrices, used by fec_decode_cached() */
+  fec_decode_cache_entry_t* decode_cache;
+  unsigned long decode_cache_tick;
+  unsigned long decode_cache_hits;
+  unsigned long decode_cache_misses;
 };
 
 #if defined(_MSC_VER)
@@ -38,6 +48,19 @@ void fec_free(fec_t* p);
  */
 void fec_encode(const fec_t* code, const gf*restrict const*restrict const src, gf*restrict const*restrict const fecs, const unsigned*restrict const block_nums, size_t num_block_nums, size_t sz);
 
+/**
+ * Incremental fec_encode: folds one primary block into the secondary blocks as soon as it's available, so the secondary blocks are ready
+ * right when the last primary block arrives instead of being computed in one burst.
+ * The primary blocks have to be added in order, starting with 0. Adding block 0 overwrites the secondary blocks, the others accumulate.
+ * @param src the primary block
+ * @param src_index the number of the primary block (< k)
+ * @param fecs buffers into which the secondary blocks are accumulated
+ * @param block_nums the numbers of the desired check blocks (the id >= k)
+ * @param num_block_nums the length of the block_nums array
+ * @param sz size of a packet in bytes
+ */
+void fec_encode_add(const fec_t* code, const gf*restrict const src, unsigned src_index, gf*restrict const*restrict const fecs, const unsigned*restrict const block_nums, size_t num_block_nums, size_t sz);
+
 /**
  * @param inpkts an array of packets (size k); If a primary block, i, is present then it must be at index i. Secondary blocks can appear anywhere.
  * @param outpkts an array of buffers into which the reconstructed output packets will be written (only packets which are not present in the inpkts input will be reconstructed and written to outpkts)
@@ -46,6 +69,37 @@ void fec_encode(const fec_t* code, const gf*restrict const*restrict const src, g
  */
 void fec_decode(const fec_t* code, const gf*restrict const*restrict const inpkts, gf*restrict const*restrict const outpkts, const unsigned*restrict const index, size_t sz);
 
+/**
+ * Same as fec_decode but the inverted decode matrix is kept in a small LRU cache inside the code, keyed by the erasure pattern (the index array).
+ * With small k the same few loss patterns repeat a lot so this skips the matrix inversion for most blocks.
+ * NOTE: the cache is not thread safe, use one fec_t per decoding thread.
+ */
+void fec_decode_cached(fec_t* code, const gf*restrict const*restrict const inpkts, gf*restrict const*restrict const outpkts, const unsigned*restrict const index, size_t sz);
+
+/**
+ * @param hits number of fec_decode_cached calls that found their decode matrix in the cache
+ * @param misses number of fec_decode_cached calls that had to invert a new decode matrix
+ */
+void fec_get_decode_cache_stats(const fec_t* code, unsigned long* hits, unsigned long* misses);
+
+/**
+ * dst[] ^= c * src[], with the kernel picked by init_fec(). Used by the specialized codes in fec_code.h
+ */
+void fec_addmul(gf*restrict dst, const gf*restrict src, gf c, size_t sz);
+
+/**
+ * @return the name of the GF multiply-accumulate kernel picked by init_fec() for this cpu (scalar, swar, ssse3, avx2, neon)
+ */
+const char* fec_get_kernel_name(void);
+
+#ifndef ESP_PLATFORM
+/**
+ * Checks that the selected kernel and the swar one produce the same bytes as the scalar one and prints the encode/decode throughput.
+ * @return 0 if the kernels match, -1 otherwise
+ */
+int fec_benchmark(unsigned short k, unsigned short n, size_t sz);
+#endif
+
 #if defined(_MSC_VER)
 #define alloca _alloca
 #else
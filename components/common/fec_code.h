@@ -0,0 +1,247 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <cassert>
+#include <utility>
+#include "fec.h"
+#include "fec_tables.h"
+
+#ifndef ESP_PLATFORM
+#   include <cstdio>
+#   include <cstdlib>
+#   include <chrono>
+#   include <vector>
+#endif
+
+//Compile time version of the code built by fec_new(), for the few (k, n) used in production.
+//The encode matrix is generated by the compiler with the same steps as fec_new (Vandermonde rows, _invert_vdm, _matmul),
+//  and the loops over the fec packets are unrolled so every addmul gets a constant coefficient and the zero ones are dropped.
+//NOTE: init_fec() has to be called before encoding as the addmul kernel is picked at runtime.
+
+namespace fec_code_detail
+{
+
+//the fec rows of the systematic encode matrix (rows k..n-1 of fec_t::enc_matrix)
+template<unsigned K, unsigned N>
+struct Matrix
+{
+    gf data[(N - K) * K] = {};
+};
+
+template<unsigned K, unsigned N>
+constexpr Matrix<K, N> make_matrix()
+{
+    using fec_tables::gf_mul;
+    constexpr fec_tables::Gf_Tables const& t = fec_tables::GF_TABLES;
+
+    //Vandermonde matrix, the first row is special
+    gf tmp[N * K] = {};
+    tmp[0] = 1;
+    for (unsigned row = 0; row + 1 < N; row++)
+        for (unsigned col = 0; col < K; col++)
+            tmp[(row + 1) * K + col] = t.exp[(row * col) % 255];
+
+    //_invert_vdm on the top k*k
+    if (K > 1)
+    {
+        gf c[K] = {};
+        gf b[K] = {};
+        gf p[K] = {};
+        for (unsigned i = 0; i < K; i++)
+            p[i] = tmp[i * K + 1];
+
+        c[K - 1] = p[0];
+        for (unsigned i = 1; i < K; i++)
+        {
+            for (unsigned j = K - 1 - (i - 1); j < K - 1; j++)
+                c[j] ^= gf_mul(p[i], c[j + 1]);
+            c[K - 1] ^= p[i];
+        }
+
+        for (unsigned row = 0; row < K; row++)
+        {
+            gf xx = p[row];
+            gf s = 1;
+            b[K - 1] = 1;
+            for (unsigned i = K - 1; i > 0; i--)
+            {
+                b[i - 1] = c[i] ^ gf_mul(xx, b[i]);
+                s = gf_mul(xx, s) ^ b[i - 1];
+            }
+            for (unsigned col = 0; col < K; col++)
+                tmp[col * K + row] = gf_mul(t.inverse[s], b[col]);
+        }
+    }
+
+    //_matmul of the bottom n-k rows with the inverse
+    Matrix<K, N> m;
+    for (unsigned row = 0; row < N - K; row++)
+        for (unsigned col = 0; col < K; col++)
+        {
+            gf acc = 0;
+            for (unsigned i = 0; i < K; i++)
+                acc ^= gf_mul(tmp[(K + row) * K + i], tmp[i * K + col]);
+            m.data[row * K + col] = acc;
+        }
+    return m;
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template<unsigned K, unsigned N>
+struct Fec_Code
+{
+    static_assert(K > 0 && K < N && N <= 256, "Bad coding params");
+
+    static constexpr fec_code_detail::Matrix<K, N> matrix = fec_code_detail::make_matrix<K, N>();
+
+    //Same as fec_encode_add(code, src, src_index, fecs, {K, ..., N - 1}, N - K, sz)
+    static void encode_add(const gf*restrict src, unsigned src_index, gf*restrict const*restrict fecs, size_t sz)
+    {
+        assert(src_index < K);
+        encode_add(src, src_index, fecs, sz, std::make_index_sequence<K>());
+    }
+
+    //Same as fec_encode(code, src, fecs, {K, ..., N - 1}, N - K, sz)
+    static void encode(const gf*restrict const*restrict src, gf*restrict const*restrict fecs, size_t sz)
+    {
+        encode(src, fecs, sz, std::make_index_sequence<K>());
+    }
+
+private:
+    using Column_Fn = void (*)(const gf*restrict src, gf*restrict const*restrict fecs, size_t sz);
+
+    template<gf C>
+    static void addmul(gf*restrict dst, const gf*restrict src, size_t sz)
+    {
+        if (C != 0)
+            fec_addmul(dst, src, C, sz);
+    }
+
+    template<unsigned C, size_t... R>
+    static void column(const gf*restrict src, gf*restrict const*restrict fecs, size_t sz, std::index_sequence<R...>)
+    {
+        if (C == 0)
+        {
+            int dummy[] = { (memset(fecs[R], 0, sz), 0)... };
+            (void)dummy;
+        }
+        int dummy[] = { (addmul<matrix.data[R * K + C]>(fecs[R], src, sz), 0)... };
+        (void)dummy;
+    }
+
+    template<unsigned C>
+    static void column(const gf*restrict src, gf*restrict const*restrict fecs, size_t sz)
+    {
+        column<C>(src, fecs, sz, std::make_index_sequence<N - K>());
+    }
+
+    template<size_t... C>
+    static void encode_add(const gf*restrict src, unsigned src_index, gf*restrict const*restrict fecs, size_t sz, std::index_sequence<C...>)
+    {
+        static const Column_Fn columns[] = { &column<C>... };
+        columns[src_index](src, fecs, sz);
+    }
+
+    template<size_t... C>
+    static void encode(const gf*restrict const*restrict src, gf*restrict const*restrict fecs, size_t sz, std::index_sequence<C...>)
+    {
+        int dummy[] = { (column<C>(src[C], fecs, sz), 0)... };
+        (void)dummy;
+    }
+};
+
+template<unsigned K, unsigned N>
+constexpr fec_code_detail::Matrix<K, N> Fec_Code<K, N>::matrix;
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef void (*fec_encode_add_fn)(const gf*restrict src, unsigned src_index, gf*restrict const*restrict fecs, size_t sz);
+
+//The specialized fec_encode_add for the codes used in production (2/3, 4/7, 12/20 for the video, 2/6 for the uplink).
+//Returns nullptr for the other codes, use the generic fec_encode_add for those.
+inline fec_encode_add_fn fec_code_get_encode_add(unsigned k, unsigned n)
+{
+    if (k == 2 && n == 3)
+        return &Fec_Code<2, 3>::encode_add;
+    if (k == 4 && n == 7)
+        return &Fec_Code<4, 7>::encode_add;
+    if (k == 12 && n == 20)
+        return &Fec_Code<12, 20>::encode_add;
+    if (k == 2 && n == 6)
+        return &Fec_Code<2, 6>::encode_add;
+    return nullptr;
+}
+
+#ifndef ESP_PLATFORM
+//Checks that the specialized code produces the same bytes as fec_encode_add and prints the throughput of both.
+//Returns 0 if they match (or if there is no specialized code for k/n), -1 otherwise
+inline int fec_code_benchmark(unsigned k, unsigned n, size_t sz)
+{
+    fec_encode_add_fn encode_add = fec_code_get_encode_add(k, n);
+    if (!encode_add)
+        return 0;
+
+    fec_t* code = fec_new(k, n);
+    unsigned fec_count = n - k;
+
+    std::vector<gf> data((size_t)k * sz);
+    std::vector<gf> fecs_data((size_t)fec_count * sz);
+    std::vector<gf> ref_fecs_data((size_t)fec_count * sz);
+    std::vector<gf*> fecs(fec_count);
+    std::vector<gf*> ref_fecs(fec_count);
+    std::vector<unsigned> block_nums(fec_count);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (gf)rand();
+    for (unsigned i = 0; i < fec_count; i++)
+    {
+        fecs[i] = &fecs_data[i * sz];
+        ref_fecs[i] = &ref_fecs_data[i * sz];
+        block_nums[i] = k + i;
+    }
+
+    for (unsigned i = 0; i < k; i++)
+    {
+        fec_encode_add(code, &data[i * sz], i, ref_fecs.data(), block_nums.data(), fec_count, sz);
+        encode_add(&data[i * sz], i, fecs.data(), sz);
+    }
+
+    int result = 0;
+    if (fecs_data != ref_fecs_data)
+    {
+        printf("FEC %u/%u/%zu: specialized code MISMATCH\n", k, n, sz);
+        result = -1;
+    }
+
+    using clock = std::chrono::steady_clock;
+    double mbps[2];
+    for (int mode = 0; mode < 2; mode++)
+    {
+        size_t iterations = 0;
+        clock::time_point start = clock::now();
+        clock::duration elapsed;
+        do
+        {
+            for (unsigned i = 0; i < k; i++)
+            {
+                if (mode == 0)
+                    fec_encode_add(code, &data[i * sz], i, ref_fecs.data(), block_nums.data(), fec_count, sz);
+                else
+                    encode_add(&data[i * sz], i, fecs.data(), sz);
+            }
+            iterations++;
+            elapsed = clock::now() - start;
+        } while (elapsed < std::chrono::milliseconds(250));
+        double seconds = std::chrono::duration<double>(elapsed).count();
+        mbps[mode] = (double)(iterations * k * sz) / seconds / (1024.0 * 1024.0);
+    }
+
+    printf("FEC %u/%u/%zu: encode_add %.1f MB/s, specialized %.1f MB/s\n", k, n, sz, mbps[0], mbps[1]);
+
+    fec_free(code);
+    return result;
+}
+#endif
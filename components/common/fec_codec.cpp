@@ -1,8 +1,11 @@
 #include "fec_codec.h"
 #include <cassert>
 #include <algorithm>
-#include "esp_task_wdt.h"
-#include "safe_printf.h"
+#include <cstdio>
+#ifdef ESP_PLATFORM
+#   include "esp_task_wdt.h"
+#   include "safe_printf.h"
+#endif
 
 static constexpr unsigned BLOCK_NUMS[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
                                            10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20,
@@ -14,31 +17,35 @@ const size_t Fec_Codec::PACKET_OVERHEAD;
 
 constexpr size_t STACK_SIZE = 4096;
 
-#define ENCODER_LOG(...)
-//#define ENCODER_LOG(...) SAFE_PRINTF(__VA_ARGS__)
+//#define ENCODER_LOG_ENABLED
+#ifdef ENCODER_LOG_ENABLED
+#   define ENCODER_LOG(...) SAFE_PRINTF(__VA_ARGS__)
+#else
+#   define ENCODER_LOG(...)
+#endif
 
 #define DECODER_LOG(...)
 //#define DECODER_LOG(...) SAFE_PRINTF(__VA_ARGS__)
 
-#pragma pack(push, 1)
+static_assert(Fec_Codec::PACKET_OVERHEAD == sizeof(Fec_Codec::Packet_Header), "Check the PACKET_OVERHEAD size");
 
-struct Packet_Header
-{
-    //    uint32_t crc = 0;
-    uint32_t block_index : 24;
-    uint32_t packet_index : 8;
-    uint16_t size : 16;
-};
+////////////////////////////////////////////////////////////////////////////////////////////
 
-#pragma pack(pop)
+Fec_Codec::Fec_Codec()
+{
 
-static_assert(Fec_Codec::PACKET_OVERHEAD == sizeof(Packet_Header), "Check the PACKET_OVERHEAD size");
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
-Fec_Codec::Fec_Codec()
+Fec_Codec::~Fec_Codec()
 {
+    stop_tasks();
 
+    if (m_fec)
+        fec_free(m_fec);
+    if (m_fec_fft)
+        fec_fft_free(m_fec_fft);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
@@ -59,20 +66,26 @@ bool Fec_Codec::init_decoder(const Descriptor& descriptor)
 
 bool Fec_Codec::init(const Descriptor& descriptor, bool is_encoder)
 {
+    //the codec, k, n and mtu come from the config packet sent by the ground, so they are checked rather than asserted
+    if (descriptor.codec != Codec::Vandermonde && descriptor.codec != Codec::FFT)
+    {
+        printf("Invalid descriptor - bad codec %d\n", (int)descriptor.codec);
+        return false;
+    }
     if (descriptor.coding_k == 0 ||
         descriptor.coding_n <= descriptor.coding_k ||
-        descriptor.coding_k > MAX_CODING_K ||
-        descriptor.coding_n > MAX_CODING_N)
+        (descriptor.codec == Codec::Vandermonde && descriptor.coding_k > MAX_CODING_K) ||
+        (descriptor.codec == Codec::Vandermonde && descriptor.coding_n > MAX_CODING_N))
     {
-        assert(0 && "Invalid descriptor - bad coding params");
+        printf("Invalid descriptor - bad coding params %d/%d\n", (int)descriptor.coding_k, (int)descriptor.coding_n);
         return false;
     }
-    if (descriptor.mtu == 0)
+    if (descriptor.mtu == 0 || (descriptor.codec == Codec::FFT && (descriptor.mtu & 1) != 0))
     {
-        assert(0 && "Invalid descriptor - bad mtu");
+        printf("Invalid descriptor - bad mtu %d%s\n", (int)descriptor.mtu, descriptor.codec == Codec::FFT ? ", the FFT codec needs an even one" : "");
         return false;
     }
-    if (descriptor.priority >= configMAX_PRIORITIES)
+    if (descriptor.priority > RTOS_MAX_PRIORITY)
     {
         assert(0 && "Invalid descriptor - bad encoder priority");
         return false;
@@ -88,8 +101,23 @@ bool Fec_Codec::init(const Descriptor& descriptor, bool is_encoder)
 
     if (m_fec)
         fec_free(m_fec);
+    m_fec = nullptr;
+    if (m_fec_fft)
+        fec_fft_free(m_fec_fft);
+    m_fec_fft = nullptr;
 
-    m_fec = fec_new(m_descriptor.coding_k, m_descriptor.coding_n);
+    if (m_descriptor.codec == Codec::FFT)
+    {
+        m_fec_fft = fec_fft_new(m_descriptor.coding_k, m_descriptor.coding_n);
+        if (!m_fec_fft)
+        {
+            printf("Out of memory for the fec code\n");
+            return false;
+        }
+    }
+    else
+        m_fec = fec_new(m_descriptor.coding_k, m_descriptor.coding_n);
+    m_fec_code_encode_add = m_fec ? fec_code_get_encode_add(m_descriptor.coding_k, m_descriptor.coding_n) : nullptr;
 
     m_encoded_packet_size = sizeof(Packet_Header) + m_descriptor.mtu;
 
@@ -100,7 +128,7 @@ bool Fec_Codec::init(const Descriptor& descriptor, bool is_encoder)
 
 IRAM_ATTR bool Fec_Codec::is_initialized() const
 {
-    return m_fec != nullptr;
+    return m_fec != nullptr || m_fec_fft != nullptr;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
@@ -123,64 +151,54 @@ void Fec_Codec::set_data_decoded_cb(void (*cb)(void* data, size_t size))
 
 void Fec_Codec::stop_tasks()
 {
-    if (m_encoder.task)
-    {
-        //esp_task_wdt_delete(m_encoder.task);
-        vTaskDelete(m_encoder.task);
-        m_encoder.task = nullptr;
-    }
-    if (m_encoder.packet_queue)
-    {
-        vQueueDelete(m_encoder.packet_queue);
-        m_encoder.packet_queue = nullptr;
-    }
-    if (m_encoder.packet_pool)
-    {
-        vQueueDelete(m_encoder.packet_pool);
-        m_encoder.packet_pool = nullptr;
-    }
+    //wake up the tasks so they can see the exit flag. On the ESP they are deleted directly
+    m_exit = true;
+    if (m_encoder.task.is_running() && m_encoder.packet_queue.is_created())
+        m_encoder.packet_queue.send(Encoder::Packet(), false);
+    if (m_decoder.task.is_running() && m_decoder.packet_queue.is_created())
+        m_decoder.packet_queue.send(Decoder::Packet(), false);
+
+    //esp_task_wdt_delete(m_encoder.task);
+    m_encoder.task.stop();
+    m_encoder.packet_queue.destroy();
+    m_encoder.packet_pool.destroy();
     for (Encoder::Packet& packet: m_encoder.packet_pool_owned)
-        delete packet.data;
+        delete[] packet.data;
 
     m_encoder.packet_pool_owned.clear();
     
     for (Encoder::Packet& p : m_encoder.block_fec_packets)
     {
-        delete p.data;
+        delete[] p.data;
         p.data = nullptr;
     }
     
-    m_encoder.fec_src_ptrs.clear();
     m_encoder.fec_dst_ptrs.clear();
+    m_encoder.block_packets.clear(); //owned by the pool
+    m_encoder.fec_src_ptrs.clear();
+
+    delete[] m_encoder.zero_packet_data;
+    m_encoder.zero_packet_data = nullptr;
 
     ////////////////////////////////////////////////////////////////////////////////////////////
 
-    if (m_decoder.task)
-    {
-        //esp_task_wdt_delete(m_decoder.task);
-        vTaskDelete(m_decoder.task);
-        m_decoder.task = nullptr;
-    }
-    if (m_decoder.packet_queue)
-    {
-        vQueueDelete(m_decoder.packet_queue);
-        m_decoder.packet_queue = nullptr;
-    }
+    //esp_task_wdt_delete(m_decoder.task);
+    m_decoder.task.stop();
+    m_decoder.packet_queue.destroy();
     for (Decoder::Packet& packet: m_decoder.fec_decoded_packets)
-        delete packet.data;
+        delete[] packet.data;
 
     m_decoder.fec_decoded_packets.clear();
     
-    if (m_decoder.packet_pool)
-    {
-        vQueueDelete(m_decoder.packet_pool);
-        m_decoder.packet_pool = nullptr;
-    }
+    m_decoder.packet_pool.destroy();
     for (Decoder::Packet& packet: m_decoder.packet_pool_owned)
-        delete packet.data;
+        delete[] packet.data;
 
     m_decoder.packet_pool_owned.clear();
 
+    delete[] m_decoder.zero_packet_data;
+    m_decoder.zero_packet_data = nullptr;
+
     m_decoder.fec_src_ptrs.clear();
     m_decoder.fec_dst_ptrs.clear();
 }
@@ -193,20 +211,20 @@ bool Fec_Codec::start_tasks()
 
     m_encoder = Encoder();
     m_decoder = Decoder();
+    m_exit = false;
+    m_skipped_block_count = 0;
 
     ////////////////////////////////////////////////////////////////////////////////////////////
 
     if (m_is_encoder)
     {
-        m_encoder.packet_queue = xQueueCreate(m_encoder_pool_size, sizeof(Encoder::Packet));
-        if (m_encoder.packet_queue == nullptr)
+        if (!m_encoder.packet_queue.create(m_encoder_pool_size))
         {
             stop_tasks();
             return false;
         }
         
-        m_encoder.packet_pool = xQueueCreate(m_encoder_pool_size, sizeof(Encoder::Packet));
-        if (m_encoder.packet_pool == nullptr)
+        if (!m_encoder.packet_pool.create(m_encoder_pool_size))
         {
             stop_tasks();
             return false;
@@ -221,8 +239,8 @@ bool Fec_Codec::start_tasks()
                 stop_tasks();
                 return false;
             }
-            BaseType_t res = xQueueSend(m_encoder.packet_pool, &packet, 0);
-            if (res != pdPASS)
+            bool res = m_encoder.packet_pool.send(packet, false);
+            if (!res)
             {
                 stop_tasks();
                 return false;
@@ -240,36 +258,36 @@ bool Fec_Codec::start_tasks()
             }
         }
 
-        m_encoder.fec_src_ptrs.resize(m_descriptor.coding_k);
-        m_encoder.fec_dst_ptrs.resize(m_descriptor.coding_n);
-        
-        if (m_descriptor.core != Core::Any)
+        //the fec packets are accumulated in place, so the destinations never change
+        m_encoder.fec_dst_ptrs.resize(m_encoder.block_fec_packets.size());
+        for (size_t i = 0; i < m_encoder.block_fec_packets.size(); i++)
+            m_encoder.fec_dst_ptrs[i] = m_encoder.block_fec_packets[i].data + sizeof(Packet_Header);
+        m_encoder.block_packet_count = 0;
+
+        if (m_descriptor.codec == Codec::FFT)
         {
-            int core = m_descriptor.core == Core::Core_0 ? 0 : 1;
-            BaseType_t res = xTaskCreatePinnedToCore(&static_encoder_task_proc, "Encoder", STACK_SIZE, this, m_descriptor.priority, &m_encoder.task, core);
-            if (res != pdPASS)
+            m_encoder.block_packets.reserve(m_descriptor.coding_k);
+            m_encoder.fec_src_ptrs.resize(m_descriptor.coding_k);
+            m_encoder.zero_packet_data = new uint8_t[m_descriptor.mtu];
+            if (!m_encoder.zero_packet_data)
             {
-                printf("Failed core: %d", res);
                 stop_tasks();
                 return false;
             }
+            memset(m_encoder.zero_packet_data, 0, m_descriptor.mtu);
         }
-        else
+        
+        if (!m_encoder.task.start("Encoder", &static_encoder_task_proc, this, STACK_SIZE, m_descriptor.priority, m_descriptor.core))
         {
-            BaseType_t res = xTaskCreate(&static_encoder_task_proc, "Encoder", STACK_SIZE, this, m_descriptor.priority, &m_encoder.task);
-            if (res != pdPASS)
-            {
-                printf("Failed core: %d", res);
-                stop_tasks();
-                return false;
-            }
+            printf("Failed to create the encoder task");
+            stop_tasks();
+            return false;
         }
         //esp_task_wdt_add(m_encoder.task);
     }
     else
     {
-        m_decoder.packet_queue = xQueueCreate(m_decoder_pool_size, sizeof(Decoder::Packet));
-        if (m_decoder.packet_queue == nullptr)
+        if (!m_decoder.packet_queue.create(m_decoder_pool_size))
         {
             stop_tasks();
             return false;
@@ -289,8 +307,15 @@ bool Fec_Codec::start_tasks()
             }
         }
         
-        m_decoder.packet_pool = xQueueCreate(m_decoder_pool_size, sizeof(Decoder::Packet));
-        if (m_decoder.packet_pool == nullptr)
+        m_decoder.zero_packet_data = new uint8_t[m_descriptor.mtu];
+        if (!m_decoder.zero_packet_data)
+        {
+            stop_tasks();
+            return false;
+        }
+        memset(m_decoder.zero_packet_data, 0, m_descriptor.mtu);
+
+        if (!m_decoder.packet_pool.create(m_decoder_pool_size))
         {
             stop_tasks();
             return false;
@@ -305,37 +330,22 @@ bool Fec_Codec::start_tasks()
                 stop_tasks();
                 return false;
             }
-            BaseType_t res = xQueueSend(m_decoder.packet_pool, &packet, 0);
-            if (res != pdPASS)
+            bool res = m_decoder.packet_pool.send(packet, false);
+            if (!res)
             {
                 stop_tasks();
                 return false;
             }
         }
 
-        m_decoder.fec_src_ptrs.resize(m_descriptor.coding_k);
+        m_decoder.fec_src_ptrs.resize(m_descriptor.coding_n);
         m_decoder.fec_dst_ptrs.resize(m_descriptor.coding_n);
 
-        if (m_descriptor.core != Core::Any)
+        if (!m_decoder.task.start("Decoder", &static_decoder_task_proc, this, STACK_SIZE, m_descriptor.priority, m_descriptor.core))
         {
-            int core = m_descriptor.core == Core::Core_0 ? 0 : 1;
-            BaseType_t res = xTaskCreatePinnedToCore(&static_decoder_task_proc, "Decoder", STACK_SIZE, this, m_descriptor.priority, &m_decoder.task, core);
-            if (res != pdPASS)
-            {
-                printf("Failed core: %d", res);
-                stop_tasks();
-                return false;
-            }
-        }
-        else
-        {
-            BaseType_t res = xTaskCreate(&static_decoder_task_proc, "Decoder", STACK_SIZE, this, m_descriptor.priority, &m_decoder.task);
-            if (res != pdPASS)
-            {
-                printf("Failed core: %d", res);
-                stop_tasks();
-                return false;
-            }
+            printf("Failed to create the decoder task");
+            stop_tasks();
+            return false;
         }
         //esp_task_wdt_add(m_decoder.task);
     }
@@ -366,86 +376,113 @@ void Fec_Codec::static_decoder_task_proc(void* params)
 IRAM_ATTR void Fec_Codec::encoder_task_proc()
 {
     
-    while (true)
+    while (!m_exit)
     {
         //esp_task_wdt_reset();
 
         {
-            ENCODER_LOG("1: Waiting for packet: %d\n", uxQueueSpacesAvailable(m_encoder.packet_queue));
+            ENCODER_LOG("1: Waiting for packet: %d\n", m_encoder.packet_queue.get_spaces_available());
 
             Encoder::Packet packet;
-            BaseType_t res = xQueueReceive(m_encoder.packet_queue, &packet, portMAX_DELAY);
-            if (res == pdFALSE || !packet.data)
+            bool res = m_encoder.packet_queue.receive(packet, true);
+            if (!res || !packet.data)
                 continue;
 
             //taskYIELD();
-            ENCODER_LOG("1: Received packet: %d\n", uxQueueSpacesAvailable(m_encoder.packet_queue));
+            ENCODER_LOG("1: Received packet: %d\n", m_encoder.packet_queue.get_spaces_available());
+
+            //the last packet of a block tells the receiver how many data packets to expect
+            bool close_block = packet.close_block || m_encoder.block_packet_count + 1 >= m_descriptor.coding_k;
+            m_encoder.block_data_packet_count = close_block ? m_encoder.block_packet_count + 1 : 0;
 
             if (m_encoder.cb)
             {
-                seal_packet(packet, m_encoder.last_block_index, m_encoder.block_packets.size());
+                seal_packet(packet, m_encoder.last_block_index, m_encoder.block_packet_count, m_encoder.block_data_packet_count);
                 m_encoder.cb(packet.data, m_encoded_packet_size);
             }
 
-            m_encoder.block_packets.push_back(packet);
+#ifdef ENCODER_LOG_ENABLED
+            uint64_t start = rtos_get_time_us();
+#endif
+
+            if (m_fec_fft)
+            {
+                //keep it until the block is complete
+                m_encoder.block_packets.push_back(packet);
+                m_encoder.block_packet_count++;
+            }
+            else
+            {
+                //fold the packet into the fec packets right away so they are ready as soon as the block is complete
+                size_t fec_count = m_descriptor.coding_n - m_descriptor.coding_k;
+                if (m_fec_code_encode_add)
+                    m_fec_code_encode_add(packet.data + sizeof(Packet_Header), m_encoder.block_packet_count, m_encoder.fec_dst_ptrs.data(), m_descriptor.mtu);
+                else
+                    fec_encode_add(m_fec, packet.data + sizeof(Packet_Header), m_encoder.block_packet_count, m_encoder.fec_dst_ptrs.data(), BLOCK_NUMS + m_descriptor.coding_k, fec_count, m_descriptor.mtu);
+                m_encoder.block_packet_count++;
+
+                ENCODER_LOG("Encoded fec: %d\n", (int)(rtos_get_time_us() - start));
+
+                //the packet is not needed anymore, return it to the pool
+                res = m_encoder.packet_pool.send(packet, false);
+                assert(res);
+            }
         }
 
-        //compute fec packets
-        if (m_encoder.block_packets.size() >= m_descriptor.coding_k)
+        //send the fec packets
+        if (m_encoder.block_data_packet_count > 0)
         {
-            if (1)
+            bool fecs_encoded = true;
+            if (m_fec_fft)
             {
-                uint64_t start = esp_timer_get_time();
-
-                //init data for the fec_encode
                 for (size_t i = 0; i < m_descriptor.coding_k; i++)
-                {
-                    Encoder::Packet& packet = m_encoder.block_packets[i];
-                    m_encoder.fec_src_ptrs[i] = packet.data + sizeof(Packet_Header);
-                }
+                    m_encoder.fec_src_ptrs[i] = i < m_encoder.block_packets.size() ? m_encoder.block_packets[i].data + sizeof(Packet_Header) : m_encoder.zero_packet_data;
 
-                size_t fec_count = m_descriptor.coding_n - m_descriptor.coding_k;
-                for (size_t i = 0; i < fec_count; i++)
-                    m_encoder.fec_dst_ptrs[i] = m_encoder.block_fec_packets[i].data + sizeof(Packet_Header);
-
-                //encode
-                fec_encode(m_fec, m_encoder.fec_src_ptrs.data(), m_encoder.fec_dst_ptrs.data(), BLOCK_NUMS + m_descriptor.coding_k, m_descriptor.coding_n - m_descriptor.coding_k, m_descriptor.mtu);
+                fecs_encoded = fec_fft_encode(m_fec_fft, m_encoder.fec_src_ptrs.data(), m_encoder.fec_dst_ptrs.data(), m_descriptor.mtu) == 0;
 
-                //seal the result
-                for (size_t i = 0; i < fec_count; i++)
+                for (Encoder::Packet& packet: m_encoder.block_packets)
                 {
-                    m_encoder.block_fec_packets[i].size = m_descriptor.mtu;
-                    if (m_encoder.cb)
-                    {
-                        seal_packet(m_encoder.block_fec_packets[i], m_encoder.last_block_index, m_descriptor.coding_k + i);
-                        m_encoder.cb(m_encoder.block_fec_packets[i].data, m_encoded_packet_size);
-                    }
+                    bool res = m_encoder.packet_pool.send(packet, false);
+                    assert(res);
+                    (void)res;
                 }
+                m_encoder.block_packets.clear();
+            }
 
-                ENCODER_LOG("Encoded fec: %d\n", (int)(esp_timer_get_time() - start));
+            //A closed block behaves as if the missing data packets were zeros, so the parity is already correct.
+            //Send fec packets proportional to the data packets to keep the same redundancy ratio.
+            size_t fec_count = m_descriptor.coding_n - m_descriptor.coding_k;
+            if (m_encoder.block_data_packet_count < m_descriptor.coding_k && fec_count > 0)
+                fec_count = std::max<size_t>((fec_count * m_encoder.block_data_packet_count + m_descriptor.coding_k - 1) / m_descriptor.coding_k, 1);
+            if (!fecs_encoded)
+            {
+                ENCODER_LOG("Fec encoding failed, out of memory\n");
+                fec_count = 0; //better no fec packets than garbage ones
             }
 
-            ENCODER_LOG("Returning packets: %d\n", uxQueueSpacesAvailable(m_encoder.packet_pool));
-            //return packets to the pool
-            for (Encoder::Packet& packet: m_encoder.block_packets)
+            for (size_t i = 0; i < fec_count; i++)
             {
-                BaseType_t res = xQueueSend(m_encoder.packet_pool, &packet, 0);
-                assert(res);
+                m_encoder.block_fec_packets[i].size = m_descriptor.mtu;
+                if (m_encoder.cb)
+                {
+                    seal_packet(m_encoder.block_fec_packets[i], m_encoder.last_block_index, m_descriptor.coding_k + i, m_encoder.block_data_packet_count);
+                    m_encoder.cb(m_encoder.block_fec_packets[i].data, m_encoded_packet_size);
+                }
             }
-            m_encoder.block_packets.clear();
+
+            m_encoder.block_packet_count = 0;
+            m_encoder.block_data_packet_count = 0;
             m_encoder.last_block_index++;
         }
     }
 
-    vTaskDelete(nullptr);
-    m_encoder.task = nullptr;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
 IRAM_ATTR bool Fec_Codec::encode_data(const void* _data, size_t size, bool block)
 {
-    if (m_is_encoder == false || !m_encoder.task)
+    if (m_is_encoder == false || !m_encoder.task.is_running())
     {
         ENCODER_LOG("0: Fail: Task not created");
         return false;
@@ -459,9 +496,9 @@ IRAM_ATTR bool Fec_Codec::encode_data(const void* _data, size_t size, bool block
     {
         if (!crt_packet.data)
         {
-            ENCODER_LOG("0: Waiting for pool packet: %d\n", uxQueueSpacesAvailable(m_encoder.packet_pool));
-            BaseType_t res = xQueueReceive(m_encoder.packet_pool, &crt_packet, block ? portMAX_DELAY : 0);
-            if (res != pdPASS || !crt_packet.data)
+            ENCODER_LOG("0: Waiting for pool packet: %d\n", m_encoder.packet_pool.get_spaces_available());
+            bool res = m_encoder.packet_pool.receive(crt_packet, block);
+            if (!res || !crt_packet.data)
             {
                 ENCODER_LOG("0: Timeout waiting for empty slot\n");
                 return false;
@@ -479,14 +516,15 @@ IRAM_ATTR bool Fec_Codec::encode_data(const void* _data, size_t size, bool block
         //packet ready? send for encoding
         if (crt_packet.size >= m_descriptor.mtu)
         {
-            ENCODER_LOG("0: Enqueueing packet in the queue: %d\n", uxQueueSpacesAvailable(m_encoder.packet_queue));
-            BaseType_t res = xQueueSend(m_encoder.packet_queue, &crt_packet, block ? portMAX_DELAY : 0);
-            if (res != pdPASS)
+            crt_packet.close_block = false;
+            ENCODER_LOG("0: Enqueueing packet in the queue: %d\n", m_encoder.packet_queue.get_spaces_available());
+            bool res = m_encoder.packet_queue.send(crt_packet, block);
+            if (!res)
             {
-                ENCODER_LOG("0: Failed. Returning packet to the pool: %d\n", uxQueueSpacesAvailable(m_encoder.packet_pool));
+                ENCODER_LOG("0: Failed. Returning packet to the pool: %d\n", m_encoder.packet_pool.get_spaces_available());
                 //put it back in the pool and return false
-                res = xQueueSend(m_encoder.packet_pool, &crt_packet, 0);
-                assert(res == pdPASS);
+                res = m_encoder.packet_pool.send(crt_packet, false);
+                assert(res);
                 crt_packet = Encoder::Packet();
                 return false;
             }
@@ -501,7 +539,7 @@ IRAM_ATTR bool Fec_Codec::encode_data(const void* _data, size_t size, bool block
 
 IRAM_ATTR uint8_t* Fec_Codec::get_encode_packet_data(bool block)
 {
-    if (m_is_encoder == false || !m_encoder.task)
+    if (m_is_encoder == false || !m_encoder.task.is_running())
     {
         ENCODER_LOG("0: Fail: Task not created");
         return nullptr;
@@ -511,9 +549,9 @@ IRAM_ATTR uint8_t* Fec_Codec::get_encode_packet_data(bool block)
 
     if (!crt_packet.data)
     {
-        ENCODER_LOG("0: Waiting for pool packet: %d\n", uxQueueSpacesAvailable(m_encoder.packet_pool));
-        BaseType_t res = xQueueReceive(m_encoder.packet_pool, &crt_packet, block ? portMAX_DELAY : 0);
-        if (res != pdPASS || !crt_packet.data)
+        ENCODER_LOG("0: Waiting for pool packet: %d\n", m_encoder.packet_pool.get_spaces_available());
+        bool res = m_encoder.packet_pool.receive(crt_packet, block);
+        if (!res || !crt_packet.data)
         {
             ENCODER_LOG("0: Timeout waiting for empty slot\n");
             return nullptr;
@@ -526,9 +564,9 @@ IRAM_ATTR uint8_t* Fec_Codec::get_encode_packet_data(bool block)
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
-IRAM_ATTR bool Fec_Codec::flush_encode_packet(bool block)
+IRAM_ATTR bool Fec_Codec::flush_encode_packet(bool block, bool close_block)
 {
-    if (m_is_encoder == false || !m_encoder.task)
+    if (m_is_encoder == false || !m_encoder.task.is_running())
     {
         ENCODER_LOG("0: Fail: Task not created");
         return false;
@@ -546,15 +584,16 @@ IRAM_ATTR bool Fec_Codec::flush_encode_packet(bool block)
         memset(crt_packet.data + sizeof(Packet_Header) + offset, 0, s);
         crt_packet.size += s;
     }
+    crt_packet.close_block = close_block;
 
-    ENCODER_LOG("0: Enqueueing packet in the queue: %d\n", uxQueueSpacesAvailable(m_encoder.packet_queue));
-    BaseType_t res = xQueueSend(m_encoder.packet_queue, &crt_packet, block ? portMAX_DELAY : 0);
-    if (res != pdPASS)
+    ENCODER_LOG("0: Enqueueing packet in the queue: %d\n", m_encoder.packet_queue.get_spaces_available());
+    bool res = m_encoder.packet_queue.send(crt_packet, block);
+    if (!res)
     {
-        ENCODER_LOG("0: Failed. Returning packet to the pool: %d\n", uxQueueSpacesAvailable(m_encoder.packet_pool));
+        ENCODER_LOG("0: Failed. Returning packet to the pool: %d\n", m_encoder.packet_pool.get_spaces_available());
         //put it back in the pool and return false
-        res = xQueueSend(m_encoder.packet_pool, &crt_packet, 0);
-        assert(res == pdPASS);
+        res = m_encoder.packet_pool.send(crt_packet, false);
+        assert(res);
         crt_packet = Encoder::Packet();
         return false;
     }
@@ -567,7 +606,7 @@ IRAM_ATTR bool Fec_Codec::flush_encode_packet(bool block)
 
 IRAM_ATTR bool Fec_Codec::is_encode_packet_empty()
 {
-    if (m_is_encoder == false || !m_encoder.task)
+    if (m_is_encoder == false || !m_encoder.task.is_running())
     {
         ENCODER_LOG("0: Fail: Task not created");
         return false;
@@ -580,7 +619,7 @@ IRAM_ATTR bool Fec_Codec::is_encode_packet_empty()
 
 IRAM_ATTR bool Fec_Codec::decode_data(const void* _data, size_t size, bool block)
 {
-    if (m_is_encoder == true || !m_decoder.task)
+    if (m_is_encoder == true || !m_decoder.task.is_running())
         return false;
 
     Decoder::Packet& crt_packet = m_decoder.crt_packet;
@@ -590,9 +629,9 @@ IRAM_ATTR bool Fec_Codec::decode_data(const void* _data, size_t size, bool block
     {
         if (!crt_packet.data)
         {
-            DECODER_LOG("0: Waiting for pool packet: %d\n", uxQueueSpacesAvailable(m_decoder.packet_pool));
-            BaseType_t res = xQueueReceive(m_decoder.packet_pool, &crt_packet, block ? portMAX_DELAY : 0);
-            if (res != pdPASS || !crt_packet.data)
+            DECODER_LOG("0: Waiting for pool packet: %d\n", m_decoder.packet_pool.get_spaces_available());
+            bool res = m_decoder.packet_pool.receive(crt_packet, block);
+            if (!res || !crt_packet.data)
                 return false;
 
             crt_packet.size = 0;
@@ -616,6 +655,7 @@ IRAM_ATTR bool Fec_Codec::decode_data(const void* _data, size_t size, bool block
                 const Packet_Header& header = *reinterpret_cast<const Packet_Header*>(crt_packet.data);
                 crt_packet.block_index = header.block_index;
                 crt_packet.packet_index = header.packet_index;
+                crt_packet.data_packet_count = header.data_packet_count;
                 crt_packet.received_header = true;
                 crt_packet.size = 0;
             }
@@ -633,14 +673,14 @@ IRAM_ATTR bool Fec_Codec::decode_data(const void* _data, size_t size, bool block
         //packet ready? send for decoding
         if (crt_packet.size >= m_descriptor.mtu)
         {
-            DECODER_LOG("0: Enqueueing packet in the queue: %d\n", uxQueueSpacesAvailable(m_decoder.packet_queue));
-            BaseType_t res = xQueueSend(m_decoder.packet_queue, &crt_packet, block ? portMAX_DELAY : 0);
-            if (res != pdPASS)
+            DECODER_LOG("0: Enqueueing packet in the queue: %d\n", m_decoder.packet_queue.get_spaces_available());
+            bool res = m_decoder.packet_queue.send(crt_packet, block);
+            if (!res)
             {
-                DECODER_LOG("0: Failed. Returning packet to the pool: %d\n", uxQueueSpacesAvailable(m_decoder.packet_pool));
+                DECODER_LOG("0: Failed. Returning packet to the pool: %d\n", m_decoder.packet_pool.get_spaces_available());
                 //put it back in the pool and return false
-                res = xQueueSend(m_decoder.packet_pool, &crt_packet, 0);
-                assert(res == pdPASS);
+                res = m_decoder.packet_pool.send(crt_packet, false);
+                assert(res);
                 crt_packet = Decoder::Packet();
                 return false;
             }
@@ -655,20 +695,20 @@ IRAM_ATTR bool Fec_Codec::decode_data(const void* _data, size_t size, bool block
 
 void Fec_Codec::decoder_task_proc()
 {
-    while (true)
+    while (!m_exit)
     {
         //esp_task_wdt_reset();
         
         {
             Decoder::Packet packet;
-            DECODER_LOG("1: Waiting for packet: %d\n", uxQueueSpacesAvailable(m_decoder.packet_queue));
+            DECODER_LOG("1: Waiting for packet: %d\n", m_decoder.packet_queue.get_spaces_available());
 
-            BaseType_t res = xQueueReceive(m_decoder.packet_queue, &packet, portMAX_DELAY);
-            if (res == pdFALSE || !packet.data)
+            bool res = m_decoder.packet_queue.receive(packet, true);
+            if (!res || !packet.data)
                 continue;
 
             //taskYIELD();
-            DECODER_LOG("1: Received packet: %d\n", uxQueueSpacesAvailable(m_decoder.packet_queue));
+            DECODER_LOG("1: Received packet: %d\n", m_decoder.packet_queue.get_spaces_available());
 
             uint32_t block_index = packet.block_index;
             uint32_t packet_index = packet.packet_index;
@@ -677,8 +717,9 @@ void Fec_Codec::decoder_task_proc()
             if (packet_index >= m_descriptor.coding_n)
             {
                 DECODER_LOG("1: Packet index out of range: %d > %d\n", packet_index, m_descriptor.coding_n);
-                BaseType_t res = xQueueSend(m_decoder.packet_pool, &packet, 0);
-                assert(res == pdPASS);
+                bool res = m_decoder.packet_pool.send(packet, false);
+                assert(res);
+                (void)res;
                 continue;
             }
             bool reset_block = false;
@@ -693,8 +734,9 @@ void Fec_Codec::decoder_task_proc()
                 else
                 {
                     DECODER_LOG("1: Old packet: %d < %d\n", block_index, m_decoder.crt_block_index);
-                    BaseType_t res = xQueueSend(m_decoder.packet_pool, &packet, 0);
-                    assert(res == pdPASS);
+                    bool res = m_decoder.packet_pool.send(packet, false);
+                    assert(res);
+                    (void)res;
                     continue;
                 }
             }
@@ -707,22 +749,31 @@ void Fec_Codec::decoder_task_proc()
 
             if (reset_block)
             {
+                if (!m_decoder.block_packets.empty() || !m_decoder.block_fec_packets.empty())
+                    m_skipped_block_count++;
+
                 //purge the entire block, we have a new one coming
                 for (Decoder::Packet& packet: m_decoder.block_packets)
                 {
-                    BaseType_t res = xQueueSend(m_decoder.packet_pool, &packet, 0);
+                    bool res = m_decoder.packet_pool.send(packet, false);
                     assert(res);
+                    (void)res;
                 }
                 for (Decoder::Packet& packet: m_decoder.block_fec_packets)
                 {
-                    BaseType_t res = xQueueSend(m_decoder.packet_pool, &packet, 0);
+                    bool res = m_decoder.packet_pool.send(packet, false);
                     assert(res);
+                    (void)res;
                 }
                 m_decoder.block_packets.clear();
                 m_decoder.block_fec_packets.clear();
                 m_decoder.crt_block_index = block_index;
+                m_decoder.crt_block_data_packet_count = 0;
             }
 
+            if (packet.data_packet_count > 0 && packet.data_packet_count <= m_descriptor.coding_k)
+                m_decoder.crt_block_data_packet_count = packet.data_packet_count;
+
             //store packet
             if (packet_index >= m_descriptor.coding_k) //fec?
             {
@@ -731,8 +782,9 @@ void Fec_Codec::decoder_task_proc()
                 if (iter != m_decoder.block_fec_packets.end() && (*iter).packet_index == packet_index)
                 {
                     DECODER_LOG("1: Duplicate fec packet %d from block %d (index %d)\n", packet_index, block_index, block_index * m_descriptor.coding_k + packet_index);
-                    BaseType_t res = xQueueSend(m_decoder.packet_pool, &packet, 0);
-                    assert(res == pdPASS);
+                    bool res = m_decoder.packet_pool.send(packet, false);
+                    assert(res);
+                    (void)res;
                     continue;
                 }
                 else
@@ -745,8 +797,9 @@ void Fec_Codec::decoder_task_proc()
                 if (iter != m_decoder.block_packets.end() && (*iter).packet_index == packet_index)
                 {
                     DECODER_LOG("1: Duplicate packet %d from block %d (index %d)\n", packet_index, block_index, block_index * m_descriptor.coding_k + packet_index);
-                    BaseType_t res = xQueueSend(m_decoder.packet_pool, &packet, 0);
-                    assert(res == pdPASS);
+                    bool res = m_decoder.packet_pool.send(packet, false);
+                    assert(res);
+                    (void)res;
                     continue;
                 }
                 else
@@ -755,14 +808,18 @@ void Fec_Codec::decoder_task_proc()
         }
 
         {
+            //closed blocks have fewer data packets
+            size_t block_k = m_decoder.crt_block_data_packet_count > 0 ? m_decoder.crt_block_data_packet_count : m_descriptor.coding_k;
+
             //entire block received
-            if (m_decoder.block_packets.size() >= m_descriptor.coding_k)
+            if (m_decoder.block_packets.size() >= block_k)
             {
                 DECODER_LOG("1: Complete block\n");
                 for (Decoder::Packet& packet: m_decoder.block_fec_packets)
                 {
-                    BaseType_t res = xQueueSend(m_decoder.packet_pool, &packet, 0);
+                    bool res = m_decoder.packet_pool.send(packet, false);
                     assert(res);
+                    (void)res;
                 }
 
                 for (Decoder::Packet& packet: m_decoder.block_packets)
@@ -778,12 +835,14 @@ void Fec_Codec::decoder_task_proc()
                             m_decoder.cb(packet.data, packet.size);
                         packet.is_processed = true;
                     }
-                    BaseType_t res = xQueueSend(m_decoder.packet_pool, &packet, 0);
+                    bool res = m_decoder.packet_pool.send(packet, false);
                     assert(res);
+                    (void)res;
                 }
                 m_decoder.block_packets.clear();
                 m_decoder.block_fec_packets.clear();
                 m_decoder.crt_block_index++;
+                m_decoder.crt_block_data_packet_count = 0;
                 continue;
             }
 
@@ -809,18 +868,35 @@ void Fec_Codec::decoder_task_proc()
             }
 
             //can we fec decode?
-            if (m_decoder.block_packets.size() + m_decoder.block_fec_packets.size() >= m_descriptor.coding_k)
+            if (m_decoder.block_packets.size() + m_decoder.block_fec_packets.size() >= block_k)
             {
                 DECODER_LOG("1: Complete FEC block\n");
 
                 std::array<unsigned int, 32> indices;
+                if (m_fec_fft)
+                {
+                    //data pointers first, then the fec ones. The missing packets stay nullptr
+                    std::fill(m_decoder.fec_src_ptrs.begin(), m_decoder.fec_src_ptrs.end(), nullptr);
+                    for (size_t i = block_k; i < m_descriptor.coding_k; i++)
+                        m_decoder.fec_src_ptrs[i] = m_decoder.zero_packet_data;
+                    for (Decoder::Packet& packet: m_decoder.block_packets)
+                        m_decoder.fec_src_ptrs[packet.packet_index] = packet.data;
+                    for (Decoder::Packet& packet: m_decoder.block_fec_packets)
+                        m_decoder.fec_src_ptrs[packet.packet_index] = packet.data;
+                }
+                else
                 {
                     //compute the packets indices and the fec source packets
                     size_t primary_index = 0;
                     size_t used_fec_index = 0;
                     for (size_t i = 0; i < m_descriptor.coding_k; i++)
                     {
-                        if (primary_index < m_decoder.block_packets.size() && i == m_decoder.block_packets[primary_index].packet_index)
+                        if (i >= block_k) //not part of a closed block, these are zeros
+                        {
+                            m_decoder.fec_src_ptrs[i] = m_decoder.zero_packet_data;
+                            indices[i] = i;
+                        }
+                        else if (primary_index < m_decoder.block_packets.size() && i == m_decoder.block_packets[primary_index].packet_index)
                         {
                             m_decoder.fec_src_ptrs[i] = m_decoder.block_packets[primary_index].data;
                             indices[i] = m_decoder.block_packets[primary_index].packet_index;
@@ -839,7 +915,7 @@ void Fec_Codec::decoder_task_proc()
                     //compute the fec destination packets, they will be filled with data by the fec_decode below
                     size_t fec_index = 0;
                     size_t primary_index = 0;
-                    for (size_t i = 0; i < m_descriptor.coding_k; i++)
+                    for (size_t i = 0; i < block_k; i++)
                     {
                         if (primary_index < m_decoder.block_packets.size() && i == m_decoder.block_packets[primary_index].packet_index)
                             primary_index++;
@@ -855,20 +931,31 @@ void Fec_Codec::decoder_task_proc()
                     }
                 }
 
-                fec_decode(m_fec, m_decoder.fec_src_ptrs.data(), m_decoder.fec_dst_ptrs.data(), indices.data(), m_descriptor.mtu);
+                bool is_decoded = true;
+                if (m_fec_fft)
+                    is_decoded = fec_fft_decode(m_fec_fft, m_decoder.fec_src_ptrs.data(), m_decoder.fec_src_ptrs.data() + m_descriptor.coding_k, m_decoder.fec_dst_ptrs.data(), m_descriptor.mtu) == 0;
+                else
+                    fec_decode_cached(m_fec, m_decoder.fec_src_ptrs.data(), m_decoder.fec_dst_ptrs.data(), indices.data(), m_descriptor.mtu);
+                if (!is_decoded)
+                {
+                    //the fec decoded packets hold garbage, only the primary packets that arrived are dispatched
+                    DECODER_LOG("1: FEC decoding failed for block %d\n", m_decoder.crt_block_index);
+                    m_skipped_block_count++;
+                }
 
                 //release these as soon as they are not needed
                 for (Decoder::Packet& packet: m_decoder.block_fec_packets)
                 {
-                    BaseType_t res = xQueueSend(m_decoder.packet_pool, &packet, 0);
+                    bool res = m_decoder.packet_pool.send(packet, false);
                     assert(res);
+                    (void)res;
                 }
 
                 {
                     //now dispatch them, either from the primary packets or from the fec decoded ones
                     size_t fec_index = 0;
                     size_t primary_index = 0;
-                    for (size_t i = 0; i < m_descriptor.coding_k; i++)
+                    for (size_t i = 0; i < block_k; i++)
                     {
                         bool release_to_pool = false;
                         Decoder::Packet* packet = nullptr;
@@ -877,8 +964,10 @@ void Fec_Codec::decoder_task_proc()
                             packet = &m_decoder.block_packets[primary_index++];
                             release_to_pool = true;
                         }
-                        else
+                        else if (is_decoded)
                             packet = &m_decoder.fec_decoded_packets[fec_index++];
+                        else
+                            continue;
 
                         //uint32_t seq_number = packet->block_index * m_descriptor.coding_k + packet->packet_index;
                         if (!packet->is_processed)
@@ -893,8 +982,9 @@ void Fec_Codec::decoder_task_proc()
 
                         if (release_to_pool)
                         {
-                            BaseType_t res = xQueueSend(m_decoder.packet_pool, packet, 0);
+                            bool res = m_decoder.packet_pool.send(*packet, false);
                             assert(res);
+                            (void)res;
                         }
                     }
                 }
@@ -902,23 +992,23 @@ void Fec_Codec::decoder_task_proc()
                 m_decoder.block_packets.clear();
                 m_decoder.block_fec_packets.clear();
                 m_decoder.crt_block_index++;
+                m_decoder.crt_block_data_packet_count = 0;
                 continue;
             }
         }
     }
 
-    vTaskDelete(nullptr);
-    m_decoder.task = nullptr;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
-void Fec_Codec::seal_packet(Encoder::Packet& packet, uint32_t block_index, uint8_t packet_index)
+void Fec_Codec::seal_packet(Encoder::Packet& packet, uint32_t block_index, uint8_t packet_index, uint8_t data_packet_count)
 {
     Packet_Header& header = *reinterpret_cast<Packet_Header*>(packet.data);
     header.size = packet.size;
     header.block_index = block_index;
     header.packet_index = packet_index;
+    header.data_packet_count = data_packet_count;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
@@ -937,6 +1027,13 @@ bool Fec_Codec::is_encoder() const
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
+uint32_t Fec_Codec::get_skipped_block_count() const
+{
+    return m_skipped_block_count;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
 /*Fec_Codec s_fec_codec;
 size_t s_fec_encoded_data_size = 0;
 size_t s_fec_decoded_data_size = 0;
@@ -1043,3 +1140,248 @@ void test_fec_decoding()
 }
 
 */
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef ESP_PLATFORM
+
+static Fec_Codec* s_benchmark_decoder = nullptr;
+static size_t s_benchmark_mtu = 0;
+static uint32_t s_benchmark_loss_percent = 0;
+static uint32_t s_benchmark_random = 1;
+static std::atomic<size_t> s_benchmark_packets_sent = { 0 };
+static std::atomic<size_t> s_benchmark_packets_lost = { 0 };
+static std::atomic<size_t> s_benchmark_decoded_data_size = { 0 };
+static std::atomic<size_t> s_benchmark_errors = { 0 };
+static bool s_benchmark_has_last_seq = false; //only touched by the decoder task
+static uint32_t s_benchmark_last_seq = 0;
+
+//Each payload starts with its sequence number and size, followed by a pattern derived from both.
+//A payload shorter than the mtu is padded with zeros by flush_encode_packet.
+static constexpr size_t BENCHMARK_HEADER_SIZE = 6;
+
+static uint8_t benchmark_pattern(uint32_t seq, size_t i)
+{
+    return (uint8_t)(seq * 131 + i * 7 + (i >> 8));
+}
+
+static void fill_benchmark_payload(uint8_t* data, uint32_t seq, size_t size)
+{
+    uint16_t size16 = (uint16_t)size;
+    memcpy(data, &seq, sizeof(seq));
+    memcpy(data + sizeof(seq), &size16, sizeof(size16));
+    for (size_t i = BENCHMARK_HEADER_SIZE; i < size; i++)
+        data[i] = benchmark_pattern(seq, i);
+}
+
+static void benchmark_encoded_cb(void* data, size_t size)
+{
+    s_benchmark_packets_sent++;
+
+    //simple LCG so the runs are repeatable
+    s_benchmark_random = s_benchmark_random * 1103515245 + 12345;
+    if ((s_benchmark_random >> 16) % 100 < s_benchmark_loss_percent)
+    {
+        s_benchmark_packets_lost++;
+        return;
+    }
+    s_benchmark_decoder->decode_data(data, size, true);
+}
+
+static void benchmark_decoded_cb(void* _data, size_t size)
+{
+    uint8_t const* data = reinterpret_cast<uint8_t const*>(_data);
+    if (size != s_benchmark_mtu)
+    {
+        s_benchmark_errors++;
+        return;
+    }
+
+    uint32_t seq = 0;
+    uint16_t payload_size = 0;
+    memcpy(&seq, data, sizeof(seq));
+    memcpy(&payload_size, data + sizeof(seq), sizeof(payload_size));
+
+    bool ok = payload_size >= BENCHMARK_HEADER_SIZE && payload_size <= size;
+    for (size_t i = BENCHMARK_HEADER_SIZE; ok && i < payload_size; i++)
+        ok = data[i] == benchmark_pattern(seq, i);
+    for (size_t i = payload_size; ok && i < size; i++)
+        ok = data[i] == 0;
+
+    //lost payloads leave gaps, but a payload cannot come twice or out of order
+    ok &= !s_benchmark_has_last_seq || seq > s_benchmark_last_seq;
+    if (!ok)
+    {
+        s_benchmark_errors++;
+        return;
+    }
+    s_benchmark_has_last_seq = true;
+    s_benchmark_last_seq = seq;
+    s_benchmark_decoded_data_size += payload_size;
+}
+
+int fec_codec_benchmark(uint8_t k, uint8_t n, size_t mtu, uint32_t loss_percent, Fec_Codec::Codec codec, bool close_blocks)
+{
+    const char* name = codec == Fec_Codec::Codec::FFT ? "Fec_Codec FFT" : "Fec_Codec";
+    const char* mode = close_blocks ? ", closed blocks" : "";
+
+    if (mtu <= BENCHMARK_HEADER_SIZE)
+    {
+        printf("%s %u/%u/%zu: mtu too small\n", name, k, n, mtu);
+        return -1;
+    }
+
+    Fec_Codec::Descriptor descriptor;
+    descriptor.codec = codec;
+    descriptor.coding_k = k;
+    descriptor.coding_n = n;
+    descriptor.mtu = mtu;
+
+    //the decoder has to outlive the encoder as it's fed from the encoder task
+    Fec_Codec decoder;
+    Fec_Codec encoder;
+    if (!decoder.init_decoder(descriptor) || !encoder.init_encoder(descriptor))
+    {
+        printf("%s %u/%u/%zu: init failed\n", name, k, n, mtu);
+        return -1;
+    }
+
+    s_benchmark_decoder = &decoder;
+    s_benchmark_mtu = mtu;
+    s_benchmark_loss_percent = loss_percent;
+    s_benchmark_random = 1;
+    s_benchmark_packets_sent = 0;
+    s_benchmark_packets_lost = 0;
+    s_benchmark_decoded_data_size = 0;
+    s_benchmark_errors = 0;
+    s_benchmark_has_last_seq = false;
+    s_benchmark_last_seq = 0;
+    encoder.set_data_encoded_cb(&benchmark_encoded_cb);
+    decoder.set_data_decoded_cb(&benchmark_decoded_cb);
+
+    std::vector<uint8_t> data(mtu);
+    size_t data_size = 0;
+    uint32_t seq = 0;
+    uint32_t frame_random = 1;
+
+    int64_t start = rtos_get_time_us();
+    int64_t duration = 0;
+    while (duration < 500000)
+    {
+        //with close_blocks the payloads are grouped in frames of up to 1.5 blocks. Each frame ends with a shorter
+        //  payload that closes its block early, like the video frames do
+        size_t frame_size = 1;
+        if (close_blocks)
+        {
+            frame_random = frame_random * 1103515245 + 12345;
+            frame_size = 1 + (frame_random >> 16) % (k + k / 2);
+        }
+
+        for (size_t i = 0; i < frame_size; i++)
+        {
+            size_t size = mtu;
+            if (close_blocks && i + 1 == frame_size)
+            {
+                frame_random = frame_random * 1103515245 + 12345;
+                size = BENCHMARK_HEADER_SIZE + (frame_random >> 16) % (mtu - BENCHMARK_HEADER_SIZE);
+            }
+
+            fill_benchmark_payload(data.data(), seq++, size);
+            if (!encoder.encode_data(data.data(), size, true))
+            {
+                printf("%s %u/%u/%zu: encode failed\n", name, k, n, mtu);
+                return -1;
+            }
+            data_size += size;
+        }
+        if (close_blocks)
+            encoder.flush_encode_packet(true, true);
+
+        duration = rtos_get_time_us() - start;
+    }
+    encoder.flush_encode_packet(true, true);
+
+    //let the tasks drain their queues
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    double seconds = duration / 1000000.0;
+    printf("%s %u/%u/%zu%s: %.1f MB/s in, %u%% loss (%zu of %zu packets), %.1f%% of the data delivered, %u blocks skipped, %zu errors\n",
+           name, k, n, mtu, mode,
+           data_size / (1024.0 * 1024.0) / seconds,
+           loss_percent, s_benchmark_packets_lost.load(), s_benchmark_packets_sent.load(),
+           data_size > 0 ? 100.0 * s_benchmark_decoded_data_size.load() / data_size : 0.0,
+           (unsigned)decoder.get_skipped_block_count(), s_benchmark_errors.load());
+
+    return s_benchmark_errors > 0 ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+int rtos_queue_stress_test(size_t item_count)
+{
+    //shared with the threads, as they are left behind if they get stuck
+    struct State
+    {
+        Rtos_Queue<size_t> queue;
+        std::atomic<size_t> sent = { 0 };
+        std::atomic<size_t> received = { 0 };
+        std::atomic<size_t> errors = { 0 };
+    };
+    std::shared_ptr<State> state = std::make_shared<State>();
+
+    //the smallest queue, so both sides block on almost every item
+    if (!state->queue.create(1))
+    {
+        printf("Rtos_Queue stress: create failed\n");
+        return -1;
+    }
+
+    int64_t start = rtos_get_time_us();
+    std::thread producer([state, item_count]
+    {
+        for (size_t i = 0; i < item_count; i++)
+        {
+            state->queue.send(i, true);
+            state->sent++;
+        }
+    });
+    std::thread consumer([state, item_count]
+    {
+        for (size_t i = 0; i < item_count; i++)
+        {
+            size_t item = 0;
+            state->queue.receive(item, true);
+            if (item != i)
+                state->errors++;
+            state->received++;
+        }
+    });
+
+    //a lost wakeup leaves a side asleep forever, so watch the progress instead of joining blindly
+    size_t last_received = 0;
+    int64_t last_progress_tp = rtos_get_time_us();
+    while (state->received < item_count)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (state->received != last_received)
+        {
+            last_received = state->received;
+            last_progress_tp = rtos_get_time_us();
+        }
+        else if (rtos_get_time_us() - last_progress_tp > 2000000)
+        {
+            printf("Rtos_Queue stress: stalled at %zu sent, %zu received\n", state->sent.load(), state->received.load());
+            producer.detach();
+            consumer.detach();
+            return -1;
+        }
+    }
+    producer.join();
+    consumer.join();
+
+    double seconds = (rtos_get_time_us() - start) / 1000000.0;
+    printf("Rtos_Queue stress: %zu items in %.2fs, %zu errors\n", item_count, seconds, state->errors.load());
+    return state->errors == 0 ? 0 : -1;
+}
+
+#endif
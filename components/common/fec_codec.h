@@ -4,36 +4,53 @@
 #include <cstring>
 #include <array>
 #include <vector>
+#include <atomic>
 
-#include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
-#include "freertos/task.h"
-#include "freertos/semphr.h"
+#include "rtos_port.h"
 #include "fec.h"
+#include "fec_fft.h"
+#include "fec_code.h"
 
 class Fec_Codec
 {
 public:
     Fec_Codec();
+    ~Fec_Codec();
 
     static const uint8_t MAX_CODING_K = 16;
     static const uint8_t MAX_CODING_N = 32;
-    static const size_t PACKET_OVERHEAD = 6;
+    static const size_t PACKET_OVERHEAD = 7;
 
-    enum class Core
+#pragma pack(push, 1)
+
+    //Shared by everything sending or receiving fec packets (the air firmware and the GS Comms)
+    struct Packet_Header
     {
-        Any,
-        Core_0,
-        Core_1
+        //    uint32_t crc = 0;
+        uint32_t block_index : 24;
+        uint32_t packet_index : 8;
+        uint16_t size : 16;
+        uint8_t data_packet_count; //0 if unknown, otherwise the block has this many data packets. Set on the last data packet and on the fec packets
+    };
+
+#pragma pack(pop)
+
+    using Core = Rtos_Task::Core;
+
+    enum class Codec : uint8_t
+    {
+        Vandermonde,    //GF(2^8), fast for small blocks. k <= MAX_CODING_K, n <= MAX_CODING_N
+        FFT             //GF(2^16), the per packet cost grows with log(n) instead of n so it wins for big blocks (n up to 255). Needs an even mtu
     };
 
     struct Descriptor
     {
+        Codec codec = Codec::Vandermonde;
         uint8_t coding_k = 2;
         uint8_t coding_n = 4;
         size_t mtu = 512;
         Core core = Core::Any;
-        uint8_t priority = configMAX_PRIORITIES - 1;
+        uint8_t priority = RTOS_MAX_PRIORITY;
     };
 
     bool init_encoder(const Descriptor& descriptor);
@@ -51,7 +68,10 @@ public:
     //Size dosn't have to be a full packet. Can be anything > 0, even bigger than a packet
     //NOTE: This has to be called from a single thread only (any thread, as long as it's just one)
     IRAM_ATTR bool encode_data(const void* data, size_t size, bool block);
-    IRAM_ATTR bool flush_encode_packet(bool block);
+    //Pads the current packet with zeros and sends it for encoding.
+    //If close_block is true, the current block is ended with this packet and its fec packets are sent right away instead of
+    //  waiting for more data to fill the block. Use this at the end of a frame so its tail can be recovered without delay.
+    IRAM_ATTR bool flush_encode_packet(bool block, bool close_block = false);
     IRAM_ATTR uint8_t* get_encode_packet_data(bool block);
     IRAM_ATTR bool is_encode_packet_empty();
 
@@ -64,6 +84,9 @@ public:
     //NOTE: This has to be called from a single thread only (any thread, as long as it's just one)
     IRAM_ATTR bool decode_data(const void* data, size_t size, bool block);
 
+    //Blocks the decoder gave up on, either abandoned for a newer one or because their fec decoding failed.
+    uint32_t get_skipped_block_count() const;
+
 private:
     bool init(const Descriptor& descriptor, bool is_encoder);
     void stop_tasks();
@@ -82,35 +105,45 @@ private:
     size_t m_encoded_packet_size = 0;
 
     fec_t* m_fec = nullptr;
+    fec_fft_t* m_fec_fft = nullptr;
+    fec_encode_add_fn m_fec_code_encode_add = nullptr; //specialized encoder if the k/n is one of the production codes
     bool m_is_encoder = false;
+    std::atomic_bool m_exit = { false };
+    std::atomic<uint32_t> m_skipped_block_count = { 0 }; //see get_skipped_block_count
 
     struct Encoder
     {
         struct Packet
         {
             uint32_t size = 0;
+            bool close_block = false;
             uint8_t* data = nullptr;
         };
-        QueueHandle_t packet_queue = nullptr;
-        QueueHandle_t packet_pool = nullptr;
-        TaskHandle_t task = nullptr;
+        Rtos_Queue<Packet> packet_queue;
+        Rtos_Queue<Packet> packet_pool;
+        Rtos_Task task;
 
         uint32_t last_block_index = 0;
 
-        std::vector<Packet> block_packets;
+        uint32_t block_packet_count = 0;
+        uint32_t block_data_packet_count = 0; //set when the block is complete, either full or closed early
         std::vector<Packet> block_fec_packets; //these are owned by the array
 
+        std::vector<uint8_t*> fec_dst_ptrs; //point in the block_fec_packets, the parity is accumulated here as the packets arrive
+
+        //the FFT codec cannot accumulate the parity so it keeps the block packets until the block is complete
+        std::vector<Packet> block_packets;
         std::vector<uint8_t const*> fec_src_ptrs;
-        std::vector<uint8_t*> fec_dst_ptrs;
+        uint8_t* zero_packet_data = nullptr; //stands in for the packets missing from a closed block
 
         std::vector<Packet> packet_pool_owned;
 
         Packet crt_packet;
 
-        void (*cb)(void* data, size_t size);
+        void (*cb)(void* data, size_t size) = nullptr;
     } m_encoder;
 
-    void seal_packet(Encoder::Packet& packet, uint32_t block_index, uint8_t packet_index);
+    void seal_packet(Encoder::Packet& packet, uint32_t block_index, uint8_t packet_index, uint8_t data_packet_count);
 
     struct Decoder
     {
@@ -121,25 +154,29 @@ private:
             uint32_t size = 0;
             uint32_t block_index = 0;
             uint32_t packet_index = 0;
+            uint32_t data_packet_count = 0;
             uint8_t* data = nullptr;
         };
-        QueueHandle_t packet_queue = nullptr;
-        QueueHandle_t packet_pool = nullptr;
-        TaskHandle_t task = nullptr;
+        Rtos_Queue<Packet> packet_queue;
+        Rtos_Queue<Packet> packet_pool;
+        Rtos_Task task;
 
         uint32_t crt_block_index = 0;
+        uint32_t crt_block_data_packet_count = 0; //0 if not known yet, otherwise the block was closed early with this many packets
         std::vector<Packet> block_packets;
         std::vector<Packet> block_fec_packets;
 
-        std::vector<uint8_t const*> fec_src_ptrs;
+        std::vector<uint8_t const*> fec_src_ptrs; //the FFT codec uses k data pointers followed by n - k fec pointers, nullptr if missing
         std::vector<uint8_t*> fec_dst_ptrs;
 
         std::vector<Packet> fec_decoded_packets;
         std::vector<Packet> packet_pool_owned;
 
+        uint8_t* zero_packet_data = nullptr; //stands in for the packets missing from a closed block
+
         Packet crt_packet;
 
-        void (*cb)(void* data, size_t size);
+        void (*cb)(void* data, size_t size) = nullptr;
     } m_decoder;
 
     Encoder::Packet* pop_encoder_packet_from_pool();
@@ -147,3 +184,15 @@ private:
     Decoder::Packet* pop_decoder_packet_from_pool();
     void push_decoder_packet_to_pool(Decoder::Packet* packet);
 };
+
+#ifndef ESP_PLATFORM
+//Runs the whole encoder -> lossy link -> decoder path on the host.
+//Prints the input throughput and how much of the data made it through.
+//With close_blocks the data is sent in frames that close their block early, so shortened blocks are decoded too.
+//Fails if a delivered payload is corrupt, duplicated or out of order.
+int fec_codec_benchmark(uint8_t k, uint8_t n, size_t mtu, uint32_t loss_percent, Fec_Codec::Codec codec = Fec_Codec::Codec::Vandermonde, bool close_blocks = false);
+
+//A producer and a consumer both blocking on a tiny Rtos_Queue, the way the codec tasks use it.
+//Fails if a wakeup is lost (a side stays asleep past the timeout) or an item is lost or reordered.
+int rtos_queue_stress_test(size_t item_count);
+#endif
@@ -0,0 +1,1064 @@
+/**
+ * Reed-Solomon erasure code over GF(2^16) using the additive FFT, see fec_fft.h.
+ * The field, basis and transforms are the ones of Leopard-RS (FF16) by Christopher A. Taylor. The multiplications
+ * use its split-nibble tables as well, so they run as byte shuffles with SSSE3/AVX2/NEON.
+ */
+
+#include "fec_fft.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#else
+#include <chrono>
+#include <vector>
+#endif
+
+#if !defined(ESP_PLATFORM) && (defined(__x86_64__) || defined(__i386__))
+#define FEC_FFT_X86_SIMD
+#include <immintrin.h>
+#elif !defined(ESP_PLATFORM) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define FEC_FFT_NEON_SIMD
+#include <arm_neon.h>
+#endif
+
+/*
+ * The decoder sums the error locator directly while count * erasures is below this, otherwise it uses the two
+ * kOrder point Walsh-Hadamard transforms of Leopard. Both cost about the same at this point.
+ */
+#ifndef FEC_FFT_WALSH_THRESHOLD
+#define FEC_FFT_WALSH_THRESHOLD (1u << 20)
+#endif
+
+typedef uint16_t ffe_t;
+
+static const unsigned kBits = 16;
+static const unsigned kOrder = 65536;
+static const unsigned kModulus = 65535;
+static const unsigned kPolynomial = 0x1002D;
+
+/* bytes of a chunk: the low bytes of 32 symbols followed by their high bytes */
+static const size_t kChunkSize = 64;
+
+/* basis used for generating the logarithm tables */
+static const ffe_t kCantorBasis[kBits] = {
+    0x0001, 0xACCA, 0x3C0E, 0x163E,
+    0xC582, 0xED2E, 0x914C, 0x4012,
+    0x6C98, 0x10D8, 0x6A72, 0xB900,
+    0xFDB8, 0xFB34, 0xFF38, 0x991E
+};
+
+static ffe_t* s_log = NULL;     /* Cantor basis element -> log */
+static ffe_t* s_exp = NULL;     /* log -> Cantor basis element */
+static ffe_t* s_fft_skew = NULL; /* twisted factors of the FFT, as logs */
+static ffe_t* s_log_walsh = NULL; /* Walsh-Hadamard transform of s_log, only built for the codes that need it */
+static int fec_fft_initialized = 0;
+
+static ffe_t*
+_alloc_table(size_t count) {
+#ifdef ESP_PLATFORM
+    ffe_t* table = (ffe_t*)heap_caps_malloc(count * sizeof(ffe_t), MALLOC_CAP_SPIRAM);
+    if (table)
+        return table;
+#endif
+    return (ffe_t*)malloc(count * sizeof(ffe_t));
+}
+
+/* a + b mod kModulus, where kModulus is also a valid representation of 0 */
+static inline ffe_t
+_add_mod(unsigned a, unsigned b) {
+    unsigned sum = a + b;
+    return (ffe_t)(sum + (sum >> kBits));
+}
+
+/* a - b mod kModulus */
+static inline ffe_t
+_sub_mod(unsigned a, unsigned b) {
+    unsigned dif = a + kModulus - b;
+    return (ffe_t)(dif + (dif >> kBits));
+}
+
+/* a * exp(log_b) */
+static inline ffe_t
+_multiply_log(ffe_t a, ffe_t log_b) {
+    if (a == 0)
+        return 0;
+    return s_exp[_add_mod(s_log[a], log_b)];
+}
+
+static unsigned
+_next_pow2(unsigned n) {
+    unsigned p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+/*
+ * Multiplication by a constant, split in nibbles. It's linear so
+ *   c * x = t[0][x & 15] ^ t[1][(x >> 4) & 15] ^ t[2][(x >> 8) & 15] ^ t[3][x >> 12]
+ * where t[p][v] = c * (v << 4p). The low and high bytes of t are kept apart so a 16 entry table fits in one vector
+ * register and the multiplication becomes 8 byte shuffles per 32 symbols.
+ */
+typedef struct {
+    alignas(16) uint8_t lo[4][16];
+    alignas(16) uint8_t hi[4][16];
+} mul_table_t;
+
+static void
+_make_mul_table(mul_table_t* table, ffe_t log_m) {
+    for (unsigned p = 0; p < 4; p++) {
+        ffe_t bits[4];
+        for (unsigned b = 0; b < 4; b++)
+            bits[b] = _multiply_log((ffe_t)(1u << (p * 4 + b)), log_m);
+
+        ffe_t products[16];
+        products[0] = 0;
+        for (unsigned v = 1; v < 16; v++) {
+            /* v without its lowest bit was done already */
+            products[v] = products[v & (v - 1)] ^ bits[__builtin_ctz(v)];
+            table->lo[p][v] = (uint8_t)products[v];
+            table->hi[p][v] = (uint8_t)(products[v] >> 8);
+        }
+        table->lo[p][0] = 0;
+        table->hi[p][0] = 0;
+    }
+}
+
+static void _select_kernels(void);
+
+int
+init_fec_fft(void) {
+    if (fec_fft_initialized)
+        return 0;
+
+    s_log = _alloc_table(kOrder);
+    s_exp = _alloc_table(kOrder);
+    s_fft_skew = _alloc_table(kModulus);
+    if (!s_log || !s_exp || !s_fft_skew) {
+        free(s_log);
+        free(s_exp);
+        free(s_fft_skew);
+        s_log = s_exp = s_fft_skew = NULL;
+        return -1;
+    }
+
+    /* LFSR table generation */
+    unsigned state = 1;
+    for (unsigned i = 0; i < kModulus; ++i) {
+        s_exp[state] = (ffe_t)i;
+        state <<= 1;
+        if (state >= kOrder)
+            state ^= kPolynomial;
+    }
+    s_exp[0] = kModulus;
+
+    /* conversion to the Cantor basis */
+    s_log[0] = 0;
+    for (unsigned i = 0; i < kBits; ++i) {
+        const ffe_t basis = kCantorBasis[i];
+        const unsigned width = 1u << i;
+        for (unsigned j = 0; j < width; ++j)
+            s_log[j + width] = s_log[j] ^ basis;
+    }
+    for (unsigned i = 0; i < kOrder; ++i)
+        s_log[i] = s_exp[s_log[i]];
+    for (unsigned i = 0; i < kOrder; ++i)
+        s_exp[s_log[i]] = (ffe_t)i;
+    s_exp[kModulus] = s_exp[0];
+
+    /* FFT skew factors */
+    ffe_t temp[kBits - 1];
+    for (unsigned i = 1; i < kBits; ++i)
+        temp[i - 1] = (ffe_t)(1u << i);
+
+    for (unsigned m = 0; m < kBits - 1; ++m) {
+        const unsigned step = 1u << (m + 1);
+        s_fft_skew[(1u << m) - 1] = 0;
+        for (unsigned i = m; i < kBits - 1; ++i) {
+            const unsigned s = 1u << (i + 1);
+            for (unsigned j = (1u << m) - 1; j < s; j += step)
+                s_fft_skew[j + s] = s_fft_skew[j] ^ temp[i];
+        }
+
+        temp[m] = (ffe_t)(kModulus - s_log[_multiply_log(temp[m], s_log[temp[m] ^ 1])]);
+        for (unsigned i = m + 1; i < kBits - 1; ++i) {
+            const ffe_t sum = _add_mod(s_log[temp[i] ^ 1], temp[m]);
+            temp[i] = _multiply_log(temp[i], sum);
+        }
+    }
+    for (unsigned i = 0; i < kModulus; ++i)
+        s_fft_skew[i] = s_log[s_fft_skew[i]];
+
+    _select_kernels();
+    fec_fft_initialized = 1;
+    return 0;
+}
+
+/* Walsh-Hadamard transform mod kModulus. As kOrder = 1 mod kModulus it's its own inverse */
+static void
+_fwht(ffe_t* data) {
+    for (unsigned width = 1; width < kOrder; width <<= 1) {
+        for (unsigned i = 0; i < kOrder; i += width * 2) {
+            for (unsigned j = i; j < i + width; j++) {
+                const ffe_t a = data[j];
+                const ffe_t b = data[j + width];
+                data[j] = _add_mod(a, b);
+                data[j + width] = _sub_mod(a, b);
+            }
+        }
+    }
+}
+
+static int
+_init_log_walsh(void) {
+    if (s_log_walsh)
+        return 0;
+    ffe_t* table = _alloc_table(kOrder);
+    if (!table)
+        return -1;
+    memcpy(table, s_log, kOrder * sizeof(ffe_t));
+    table[0] = 0;
+    _fwht(table);
+    s_log_walsh = table;
+    return 0;
+}
+
+/*
+ * Buffer operations.
+ * A packet is a sequence of 64 byte chunks, each holding the low bytes of 32 symbols followed by their high bytes.
+ * A last partial chunk of r bytes holds the low bytes of r/2 symbols followed by their high bytes. In the work
+ * buffers it's padded to a full chunk, the padding symbols are 0 in every packet so they stay 0.
+ * The kernels work on whole chunks: sz is a multiple of 64.
+ */
+
+/* x[] ^= y[] */
+typedef void (*xor_t)(gf*restrict x, const gf*restrict y, size_t sz);
+
+static void
+_xor_scalar(gf*restrict x, const gf*restrict y, size_t sz) {
+    for (size_t i = 0; i < sz; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, x + i, 8);
+        memcpy(&b, y + i, 8);
+        a ^= b;
+        memcpy(x + i, &a, 8);
+    }
+}
+
+/* x[] ^= y[] * c; y[] ^= x[] */
+typedef void (*fft_butterfly_t)(gf*restrict x, gf*restrict y, const mul_table_t* table, size_t sz);
+/* y[] ^= x[]; x[] ^= y[] * c */
+typedef void (*ifft_butterfly_t)(gf*restrict x, gf*restrict y, const mul_table_t* table, size_t sz);
+/* x[] = y[] * c, x and y can be the same buffer */
+typedef void (*mul_t)(gf* x, const gf* y, const mul_table_t* table, size_t sz);
+
+static inline void
+_mul_chunk_scalar(const gf* y, const mul_table_t* t, gf* lo, gf* hi) {
+    for (size_t j = 0; j < 32; j++) {
+        const unsigned l = y[j];
+        const unsigned h = y[j + 32];
+        lo[j] = t->lo[0][l & 15] ^ t->lo[1][l >> 4] ^ t->lo[2][h & 15] ^ t->lo[3][h >> 4];
+        hi[j] = t->hi[0][l & 15] ^ t->hi[1][l >> 4] ^ t->hi[2][h & 15] ^ t->hi[3][h >> 4];
+    }
+}
+
+static void
+_fft_butterfly_scalar(gf*restrict x, gf*restrict y, const mul_table_t* table, size_t sz) {
+    mul_table_t t = *table; /* on the stack, so the lookups hit internal RAM on the ESP */
+    gf p[kChunkSize];
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        _mul_chunk_scalar(y + i, &t, p, p + 32);
+        for (size_t j = 0; j < kChunkSize; j++) {
+            x[i + j] ^= p[j];
+            y[i + j] ^= x[i + j];
+        }
+    }
+}
+
+static void
+_ifft_butterfly_scalar(gf*restrict x, gf*restrict y, const mul_table_t* table, size_t sz) {
+    mul_table_t t = *table;
+    gf p[kChunkSize];
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        for (size_t j = 0; j < kChunkSize; j++)
+            y[i + j] ^= x[i + j];
+        _mul_chunk_scalar(y + i, &t, p, p + 32);
+        for (size_t j = 0; j < kChunkSize; j++)
+            x[i + j] ^= p[j];
+    }
+}
+
+static void
+_mul_scalar(gf* x, const gf* y, const mul_table_t* table, size_t sz) {
+    mul_table_t t = *table;
+    gf p[kChunkSize];
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        _mul_chunk_scalar(y + i, &t, p, p + 32);
+        memcpy(x + i, p, kChunkSize);
+    }
+}
+
+#if defined(FEC_FFT_X86_SIMD)
+
+typedef struct {
+    __m128i lo[4];
+    __m128i hi[4];
+} ssse3_table_t;
+
+__attribute__((target("ssse3"))) static inline void
+_load_table_ssse3(ssse3_table_t* t, const mul_table_t* table) {
+    for (unsigned p = 0; p < 4; p++) {
+        t->lo[p] = _mm_load_si128((const __m128i*)table->lo[p]);
+        t->hi[p] = _mm_load_si128((const __m128i*)table->hi[p]);
+    }
+}
+
+/* 16 symbols: l holds their low bytes and h their high bytes */
+__attribute__((target("ssse3"))) static inline void
+_mul_ssse3(const ssse3_table_t* t, __m128i l, __m128i h, __m128i* pl, __m128i* ph) {
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i n0 = _mm_and_si128(l, mask);
+    const __m128i n1 = _mm_and_si128(_mm_srli_epi64(l, 4), mask);
+    const __m128i n2 = _mm_and_si128(h, mask);
+    const __m128i n3 = _mm_and_si128(_mm_srli_epi64(h, 4), mask);
+    *pl = _mm_xor_si128(_mm_xor_si128(_mm_shuffle_epi8(t->lo[0], n0), _mm_shuffle_epi8(t->lo[1], n1)),
+                        _mm_xor_si128(_mm_shuffle_epi8(t->lo[2], n2), _mm_shuffle_epi8(t->lo[3], n3)));
+    *ph = _mm_xor_si128(_mm_xor_si128(_mm_shuffle_epi8(t->hi[0], n0), _mm_shuffle_epi8(t->hi[1], n1)),
+                        _mm_xor_si128(_mm_shuffle_epi8(t->hi[2], n2), _mm_shuffle_epi8(t->hi[3], n3)));
+}
+
+__attribute__((target("ssse3"))) static void
+_fft_butterfly_ssse3(gf*restrict x, gf*restrict y, const mul_table_t* table, size_t sz) {
+    ssse3_table_t t;
+    _load_table_ssse3(&t, table);
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        for (size_t j = 0; j < 32; j += 16) {
+            __m128i* xl = (__m128i*)(x + i + j);
+            __m128i* xh = (__m128i*)(x + i + j + 32);
+            __m128i* yl = (__m128i*)(y + i + j);
+            __m128i* yh = (__m128i*)(y + i + j + 32);
+            const __m128i l = _mm_loadu_si128(yl);
+            const __m128i h = _mm_loadu_si128(yh);
+            __m128i pl, ph;
+            _mul_ssse3(&t, l, h, &pl, &ph);
+            pl = _mm_xor_si128(pl, _mm_loadu_si128(xl));
+            ph = _mm_xor_si128(ph, _mm_loadu_si128(xh));
+            _mm_storeu_si128(xl, pl);
+            _mm_storeu_si128(xh, ph);
+            _mm_storeu_si128(yl, _mm_xor_si128(l, pl));
+            _mm_storeu_si128(yh, _mm_xor_si128(h, ph));
+        }
+    }
+}
+
+__attribute__((target("ssse3"))) static void
+_ifft_butterfly_ssse3(gf*restrict x, gf*restrict y, const mul_table_t* table, size_t sz) {
+    ssse3_table_t t;
+    _load_table_ssse3(&t, table);
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        for (size_t j = 0; j < 32; j += 16) {
+            __m128i* xl = (__m128i*)(x + i + j);
+            __m128i* xh = (__m128i*)(x + i + j + 32);
+            __m128i* yl = (__m128i*)(y + i + j);
+            __m128i* yh = (__m128i*)(y + i + j + 32);
+            const __m128i x0 = _mm_loadu_si128(xl);
+            const __m128i x1 = _mm_loadu_si128(xh);
+            const __m128i l = _mm_xor_si128(_mm_loadu_si128(yl), x0);
+            const __m128i h = _mm_xor_si128(_mm_loadu_si128(yh), x1);
+            _mm_storeu_si128(yl, l);
+            _mm_storeu_si128(yh, h);
+            __m128i pl, ph;
+            _mul_ssse3(&t, l, h, &pl, &ph);
+            _mm_storeu_si128(xl, _mm_xor_si128(x0, pl));
+            _mm_storeu_si128(xh, _mm_xor_si128(x1, ph));
+        }
+    }
+}
+
+__attribute__((target("ssse3"))) static void
+_mul_ssse3_mem(gf* x, const gf* y, const mul_table_t* table, size_t sz) {
+    ssse3_table_t t;
+    _load_table_ssse3(&t, table);
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        for (size_t j = 0; j < 32; j += 16) {
+            __m128i pl, ph;
+            _mul_ssse3(&t, _mm_loadu_si128((const __m128i*)(y + i + j)), _mm_loadu_si128((const __m128i*)(y + i + j + 32)), &pl, &ph);
+            _mm_storeu_si128((__m128i*)(x + i + j), pl);
+            _mm_storeu_si128((__m128i*)(x + i + j + 32), ph);
+        }
+    }
+}
+
+typedef struct {
+    __m256i lo[4];
+    __m256i hi[4];
+} avx2_table_t;
+
+__attribute__((target("avx2"))) static inline void
+_load_table_avx2(avx2_table_t* t, const mul_table_t* table) {
+    for (unsigned p = 0; p < 4; p++) {
+        t->lo[p] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)table->lo[p]));
+        t->hi[p] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)table->hi[p]));
+    }
+}
+
+/* 32 symbols: l holds their low bytes and h their high bytes */
+__attribute__((target("avx2"))) static inline void
+_mul_avx2(const avx2_table_t* t, __m256i l, __m256i h, __m256i* pl, __m256i* ph) {
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    const __m256i n0 = _mm256_and_si256(l, mask);
+    const __m256i n1 = _mm256_and_si256(_mm256_srli_epi64(l, 4), mask);
+    const __m256i n2 = _mm256_and_si256(h, mask);
+    const __m256i n3 = _mm256_and_si256(_mm256_srli_epi64(h, 4), mask);
+    *pl = _mm256_xor_si256(_mm256_xor_si256(_mm256_shuffle_epi8(t->lo[0], n0), _mm256_shuffle_epi8(t->lo[1], n1)),
+                           _mm256_xor_si256(_mm256_shuffle_epi8(t->lo[2], n2), _mm256_shuffle_epi8(t->lo[3], n3)));
+    *ph = _mm256_xor_si256(_mm256_xor_si256(_mm256_shuffle_epi8(t->hi[0], n0), _mm256_shuffle_epi8(t->hi[1], n1)),
+                           _mm256_xor_si256(_mm256_shuffle_epi8(t->hi[2], n2), _mm256_shuffle_epi8(t->hi[3], n3)));
+}
+
+__attribute__((target("avx2"))) static void
+_xor_avx2(gf*restrict x, const gf*restrict y, size_t sz) {
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        __m256i* x0 = (__m256i*)(x + i);
+        __m256i* x1 = (__m256i*)(x + i + 32);
+        _mm256_storeu_si256(x0, _mm256_xor_si256(_mm256_loadu_si256(x0), _mm256_loadu_si256((const __m256i*)(y + i))));
+        _mm256_storeu_si256(x1, _mm256_xor_si256(_mm256_loadu_si256(x1), _mm256_loadu_si256((const __m256i*)(y + i + 32))));
+    }
+}
+
+__attribute__((target("avx2"))) static void
+_fft_butterfly_avx2(gf*restrict x, gf*restrict y, const mul_table_t* table, size_t sz) {
+    avx2_table_t t;
+    _load_table_avx2(&t, table);
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        __m256i* xl = (__m256i*)(x + i);
+        __m256i* xh = (__m256i*)(x + i + 32);
+        __m256i* yl = (__m256i*)(y + i);
+        __m256i* yh = (__m256i*)(y + i + 32);
+        const __m256i l = _mm256_loadu_si256(yl);
+        const __m256i h = _mm256_loadu_si256(yh);
+        __m256i pl, ph;
+        _mul_avx2(&t, l, h, &pl, &ph);
+        pl = _mm256_xor_si256(pl, _mm256_loadu_si256(xl));
+        ph = _mm256_xor_si256(ph, _mm256_loadu_si256(xh));
+        _mm256_storeu_si256(xl, pl);
+        _mm256_storeu_si256(xh, ph);
+        _mm256_storeu_si256(yl, _mm256_xor_si256(l, pl));
+        _mm256_storeu_si256(yh, _mm256_xor_si256(h, ph));
+    }
+}
+
+__attribute__((target("avx2"))) static void
+_ifft_butterfly_avx2(gf*restrict x, gf*restrict y, const mul_table_t* table, size_t sz) {
+    avx2_table_t t;
+    _load_table_avx2(&t, table);
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        __m256i* xl = (__m256i*)(x + i);
+        __m256i* xh = (__m256i*)(x + i + 32);
+        __m256i* yl = (__m256i*)(y + i);
+        __m256i* yh = (__m256i*)(y + i + 32);
+        const __m256i x0 = _mm256_loadu_si256(xl);
+        const __m256i x1 = _mm256_loadu_si256(xh);
+        const __m256i l = _mm256_xor_si256(_mm256_loadu_si256(yl), x0);
+        const __m256i h = _mm256_xor_si256(_mm256_loadu_si256(yh), x1);
+        _mm256_storeu_si256(yl, l);
+        _mm256_storeu_si256(yh, h);
+        __m256i pl, ph;
+        _mul_avx2(&t, l, h, &pl, &ph);
+        _mm256_storeu_si256(xl, _mm256_xor_si256(x0, pl));
+        _mm256_storeu_si256(xh, _mm256_xor_si256(x1, ph));
+    }
+}
+
+__attribute__((target("avx2"))) static void
+_mul_avx2_mem(gf* x, const gf* y, const mul_table_t* table, size_t sz) {
+    avx2_table_t t;
+    _load_table_avx2(&t, table);
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        __m256i pl, ph;
+        _mul_avx2(&t, _mm256_loadu_si256((const __m256i*)(y + i)), _mm256_loadu_si256((const __m256i*)(y + i + 32)), &pl, &ph);
+        _mm256_storeu_si256((__m256i*)(x + i), pl);
+        _mm256_storeu_si256((__m256i*)(x + i + 32), ph);
+    }
+}
+
+#endif
+
+#if defined(FEC_FFT_NEON_SIMD)
+
+#if defined(__aarch64__)
+typedef uint8x16_t neon_lut_t;
+static inline uint8x16_t
+_lookup_neon(neon_lut_t t, uint8x16_t i) {
+    return vqtbl1q_u8(t, i);
+}
+static inline neon_lut_t
+_load_lut_neon(const uint8_t* t) {
+    return vld1q_u8(t);
+}
+#else
+typedef uint8x8x2_t neon_lut_t;
+static inline uint8x16_t
+_lookup_neon(neon_lut_t t, uint8x16_t i) {
+    return vcombine_u8(vtbl2_u8(t, vget_low_u8(i)), vtbl2_u8(t, vget_high_u8(i)));
+}
+static inline neon_lut_t
+_load_lut_neon(const uint8_t* t) {
+    neon_lut_t lut;
+    lut.val[0] = vld1_u8(t);
+    lut.val[1] = vld1_u8(t + 8);
+    return lut;
+}
+#endif
+
+typedef struct {
+    neon_lut_t lo[4];
+    neon_lut_t hi[4];
+} neon_table_t;
+
+static inline void
+_load_table_neon(neon_table_t* t, const mul_table_t* table) {
+    for (unsigned p = 0; p < 4; p++) {
+        t->lo[p] = _load_lut_neon(table->lo[p]);
+        t->hi[p] = _load_lut_neon(table->hi[p]);
+    }
+}
+
+/* 16 symbols: l holds their low bytes and h their high bytes */
+static inline void
+_mul_neon(const neon_table_t* t, uint8x16_t l, uint8x16_t h, uint8x16_t* pl, uint8x16_t* ph) {
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+    const uint8x16_t n0 = vandq_u8(l, mask);
+    const uint8x16_t n1 = vshrq_n_u8(l, 4);
+    const uint8x16_t n2 = vandq_u8(h, mask);
+    const uint8x16_t n3 = vshrq_n_u8(h, 4);
+    *pl = veorq_u8(veorq_u8(_lookup_neon(t->lo[0], n0), _lookup_neon(t->lo[1], n1)),
+                   veorq_u8(_lookup_neon(t->lo[2], n2), _lookup_neon(t->lo[3], n3)));
+    *ph = veorq_u8(veorq_u8(_lookup_neon(t->hi[0], n0), _lookup_neon(t->hi[1], n1)),
+                   veorq_u8(_lookup_neon(t->hi[2], n2), _lookup_neon(t->hi[3], n3)));
+}
+
+static void
+_fft_butterfly_neon(gf*restrict x, gf*restrict y, const mul_table_t* table, size_t sz) {
+    neon_table_t t;
+    _load_table_neon(&t, table);
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        for (size_t j = 0; j < 32; j += 16) {
+            gf* xl = x + i + j;
+            gf* xh = x + i + j + 32;
+            gf* yl = y + i + j;
+            gf* yh = y + i + j + 32;
+            const uint8x16_t l = vld1q_u8(yl);
+            const uint8x16_t h = vld1q_u8(yh);
+            uint8x16_t pl, ph;
+            _mul_neon(&t, l, h, &pl, &ph);
+            pl = veorq_u8(pl, vld1q_u8(xl));
+            ph = veorq_u8(ph, vld1q_u8(xh));
+            vst1q_u8(xl, pl);
+            vst1q_u8(xh, ph);
+            vst1q_u8(yl, veorq_u8(l, pl));
+            vst1q_u8(yh, veorq_u8(h, ph));
+        }
+    }
+}
+
+static void
+_ifft_butterfly_neon(gf*restrict x, gf*restrict y, const mul_table_t* table, size_t sz) {
+    neon_table_t t;
+    _load_table_neon(&t, table);
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        for (size_t j = 0; j < 32; j += 16) {
+            gf* xl = x + i + j;
+            gf* xh = x + i + j + 32;
+            gf* yl = y + i + j;
+            gf* yh = y + i + j + 32;
+            const uint8x16_t x0 = vld1q_u8(xl);
+            const uint8x16_t x1 = vld1q_u8(xh);
+            const uint8x16_t l = veorq_u8(vld1q_u8(yl), x0);
+            const uint8x16_t h = veorq_u8(vld1q_u8(yh), x1);
+            vst1q_u8(yl, l);
+            vst1q_u8(yh, h);
+            uint8x16_t pl, ph;
+            _mul_neon(&t, l, h, &pl, &ph);
+            vst1q_u8(xl, veorq_u8(x0, pl));
+            vst1q_u8(xh, veorq_u8(x1, ph));
+        }
+    }
+}
+
+static void
+_mul_neon_mem(gf* x, const gf* y, const mul_table_t* table, size_t sz) {
+    neon_table_t t;
+    _load_table_neon(&t, table);
+    for (size_t i = 0; i < sz; i += kChunkSize) {
+        for (size_t j = 0; j < 32; j += 16) {
+            uint8x16_t pl, ph;
+            _mul_neon(&t, vld1q_u8(y + i + j), vld1q_u8(y + i + j + 32), &pl, &ph);
+            vst1q_u8(x + i + j, pl);
+            vst1q_u8(x + i + j + 32, ph);
+        }
+    }
+}
+
+#endif
+
+typedef struct {
+    fft_butterfly_t fft_butterfly;
+    ifft_butterfly_t ifft_butterfly;
+    mul_t mul;
+    xor_t xor_mem;
+    const char* name;
+} fft_kernels_t;
+
+static const fft_kernels_t kScalarKernels = { _fft_butterfly_scalar, _ifft_butterfly_scalar, _mul_scalar, _xor_scalar, "scalar" };
+static fft_kernels_t s_kernels = kScalarKernels;
+
+static void
+_select_kernels(void) {
+#if defined(FEC_FFT_X86_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        const fft_kernels_t kernels = { _fft_butterfly_avx2, _ifft_butterfly_avx2, _mul_avx2_mem, _xor_avx2, "avx2" };
+        s_kernels = kernels;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        const fft_kernels_t kernels = { _fft_butterfly_ssse3, _ifft_butterfly_ssse3, _mul_ssse3_mem, _xor_scalar, "ssse3" };
+        s_kernels = kernels;
+    }
+#elif defined(FEC_FFT_NEON_SIMD)
+    const fft_kernels_t kernels = { _fft_butterfly_neon, _ifft_butterfly_neon, _mul_neon_mem, _xor_scalar, "neon" };
+    s_kernels = kernels;
+#endif
+}
+
+/* the size of a packet in the work buffers, whole chunks */
+static inline size_t
+_work_size(size_t sz) {
+    return (sz + kChunkSize - 1) & ~(kChunkSize - 1);
+}
+
+/* x[] = packet y[] of sz bytes, in whole chunks */
+static void
+_import(gf*restrict x, const gf*restrict y, size_t sz) {
+    const size_t full = sz & ~(kChunkSize - 1);
+    memcpy(x, y, full);
+    if (full < sz) {
+        const size_t half = (sz - full) / 2;
+        memset(x + full, 0, kChunkSize);
+        memcpy(x + full, y + full, half);
+        memcpy(x + full + 32, y + full + half, half);
+    }
+}
+
+/* packet x[] of sz bytes = y[], in whole chunks */
+static void
+_export(gf*restrict x, const gf*restrict y, size_t sz) {
+    const size_t full = sz & ~(kChunkSize - 1);
+    memcpy(x, y, full);
+    if (full < sz) {
+        const size_t half = (sz - full) / 2;
+        memcpy(x + full, y + full, half);
+        memcpy(x + full + half, y + full + 32, half);
+    }
+}
+
+/* x[] = packet y[] * exp(log_m) */
+static void
+_import_mul(gf*restrict x, const gf*restrict y, ffe_t log_m, size_t sz) {
+    mul_table_t table;
+    _make_mul_table(&table, log_m);
+    const size_t full = sz & ~(kChunkSize - 1);
+    s_kernels.mul(x, y, &table, full);
+    if (full < sz) {
+        _import(x + full, y + full, sz - full);
+        s_kernels.mul(x + full, x + full, &table, kChunkSize);
+    }
+}
+
+/* packet x[] = y[] * exp(log_m). y is overwritten */
+static void
+_mul_export(gf*restrict x, gf*restrict y, ffe_t log_m, size_t sz) {
+    mul_table_t table;
+    _make_mul_table(&table, log_m);
+    const size_t full = sz & ~(kChunkSize - 1);
+    s_kernels.mul(x, y, &table, full);
+    if (full < sz) {
+        s_kernels.mul(y + full, y + full, &table, kChunkSize);
+        _export(x + full, y + full, sz - full);
+    }
+}
+
+/*
+ * Decimation in time IFFT. Only the first m_truncated inputs can be non-zero.
+ * skew is indexed with the position of the second element of each butterfly.
+ * With nonzero, nonzero[i] is the count of non-zero inputs before i (up to m). The outputs of a group of butterflies
+ * only depend on its own inputs, so the groups without any are skipped.
+ */
+static void
+_ifft_dit(gf** work, unsigned m_truncated, unsigned m, const ffe_t* skew, const unsigned* nonzero, size_t sz) {
+    mul_table_t table;
+    for (unsigned dist = 1; dist < m; dist <<= 1) {
+        for (unsigned r = 0; r < m_truncated; r += dist * 2) {
+            if (nonzero && nonzero[r + dist * 2] == nonzero[r])
+                continue;
+            const ffe_t log_m = skew[r + dist];
+            if (log_m == kModulus) {
+                for (unsigned i = r; i < r + dist; i++)
+                    s_kernels.xor_mem(work[i + dist], work[i], sz);
+                continue;
+            }
+            _make_mul_table(&table, log_m);
+            for (unsigned i = r; i < r + dist; i++)
+                s_kernels.ifft_butterfly(work[i], work[i + dist], &table, sz);
+        }
+    }
+}
+
+/*
+ * Decimation in time FFT. Only the first m_truncated outputs are computed.
+ * With needed, needed[i] is the count of the outputs wanted before i (up to m). A group of butterflies only feeds
+ * its own outputs, so the groups without any wanted are skipped.
+ */
+static void
+_fft_dit(gf** work, unsigned m_truncated, unsigned m, const ffe_t* skew, const unsigned* needed, size_t sz) {
+    mul_table_t table;
+    for (unsigned dist = m >> 1; dist > 0; dist >>= 1) {
+        for (unsigned r = 0; r < m_truncated; r += dist * 2) {
+            if (needed && needed[r + dist * 2] == needed[r])
+                continue;
+            const ffe_t log_m = skew[r + dist];
+            if (log_m == kModulus) {
+                for (unsigned i = r; i < r + dist; i++)
+                    s_kernels.xor_mem(work[i + dist], work[i], sz);
+                continue;
+            }
+            _make_mul_table(&table, log_m);
+            for (unsigned i = r; i < r + dist; i++)
+                s_kernels.fft_butterfly(work[i], work[i + dist], &table, sz);
+        }
+    }
+}
+
+/* makes sure the work buffers hold packets of sz bytes. Returns -1 if they cannot be allocated */
+static int
+_reserve_work(fec_fft_t* code, size_t sz) {
+    const size_t work_sz = _work_size(sz);
+    if (code->work_sz >= work_sz)
+        return 0;
+
+    /* the encoder needs 2 * m buffers, the decoder work_count */
+    unsigned count = code->work_count > 2 * code->m ? code->work_count : 2 * code->m;
+    gf* data = (gf*)malloc(count * work_sz);
+    if (!data)
+        return -1;
+    free(code->work_data);
+    code->work_data = data;
+    for (unsigned i = 0; i < count; i++)
+        code->work[i] = code->work_data + i * work_sz;
+    code->work_sz = work_sz;
+    return 0;
+}
+
+fec_fft_t*
+fec_fft_new(unsigned k, unsigned n) {
+    assert(k > 0 && k < n && n <= kOrder);
+
+    if (fec_fft_initialized == 0 && init_fec_fft() != 0)
+        return NULL;
+
+    fec_fft_t* retval = (fec_fft_t*)calloc(1, sizeof(fec_fft_t));
+    if (!retval)
+        return NULL;
+    retval->k = k;
+    retval->n = n;
+    retval->m = _next_pow2(n - k);
+    retval->work_count = _next_pow2(retval->m + k);
+    assert(retval->m + k <= kOrder);
+
+    unsigned count = retval->work_count > 2 * retval->m ? retval->work_count : 2 * retval->m;
+    retval->work = (gf**)malloc(count * sizeof(gf*));
+    retval->erasures = (unsigned*)malloc((retval->m + k) * sizeof(unsigned));
+    retval->nonzero = (unsigned*)malloc((retval->work_count + 1) * sizeof(unsigned));
+    retval->needed = (unsigned*)malloc((retval->work_count + 1) * sizeof(unsigned));
+    retval->locator = (uint16_t*)malloc(((retval->m + k) * (size_t)retval->m > FEC_FFT_WALSH_THRESHOLD ? kOrder : retval->m + k) * sizeof(uint16_t));
+    if (!retval->work || !retval->erasures || !retval->locator || !retval->nonzero || !retval->needed) {
+        fec_fft_free(retval);
+        return NULL;
+    }
+    return retval;
+}
+
+void
+fec_fft_free(fec_fft_t* p) {
+    assert(p != NULL);
+    free(p->work_data);
+    free(p->work);
+    free(p->erasures);
+    free(p->nonzero);
+    free(p->needed);
+    free(p->locator);
+    free(p);
+}
+
+int
+fec_fft_encode(fec_fft_t* code, const gf*restrict const*restrict const src, gf*restrict const*restrict const fecs, size_t sz) {
+    assert((sz & 1) == 0);
+    if (_reserve_work(code, sz) != 0)
+        return -1;
+
+    const unsigned k = code->k;
+    const unsigned m = code->m;
+    const size_t work_sz = code->work_sz;
+    gf** work = code->work;
+    gf** temp = code->work + m;
+
+    /* work <- IFFT(src) in chunks of m, xored together */
+    for (unsigned first = 0; first < k; first += m) {
+        gf** dst = first == 0 ? work : temp;
+        unsigned count = k - first < m ? k - first : m;
+        for (unsigned i = 0; i < count; i++)
+            _import(dst[i], src[first + i], sz);
+        for (unsigned i = count; i < m; i++)
+            memset(dst[i], 0, work_sz);
+
+        _ifft_dit(dst, count, m, s_fft_skew + m - 1 + first, NULL, work_sz);
+
+        if (first != 0)
+            for (unsigned i = 0; i < m; i++)
+                s_kernels.xor_mem(work[i], temp[i], work_sz);
+    }
+
+    /* work <- FFT(work) */
+    const unsigned fec_count = code->n - k;
+    _fft_dit(work, fec_count, m, s_fft_skew - 1, NULL, work_sz);
+
+    for (unsigned i = 0; i < fec_count; i++)
+        _export(fecs[i], work[i], sz);
+    return 0;
+}
+
+int
+fec_fft_decode(fec_fft_t* code, const gf*restrict const*restrict const src, const gf*restrict const*restrict const fecs, gf*restrict const*restrict const outpkts, size_t sz) {
+    assert((sz & 1) == 0);
+
+    const unsigned k = code->k;
+    const unsigned m = code->m;
+    const unsigned fec_count = code->n - k;
+    const unsigned count = m + k;
+
+    /* positions: [0, fec_count) secondary blocks, [fec_count, m) padding, [m, m + k) primary blocks */
+    unsigned* erasures = code->erasures;
+    unsigned erasure_count = 0;
+    unsigned missing_count = 0;
+    for (unsigned i = 0; i < fec_count; i++)
+        if (!fecs[i])
+            erasures[erasure_count++] = i;
+    for (unsigned i = fec_count; i < m; i++)
+        erasures[erasure_count++] = i;
+    for (unsigned i = 0; i < k; i++)
+        if (!src[i]) {
+            erasures[erasure_count++] = m + i;
+            missing_count++;
+        }
+    if (erasure_count - (m - fec_count) > fec_count)
+        return -1;
+    if (missing_count == 0)
+        return 0;
+
+    if (_reserve_work(code, sz) != 0)
+        return -1;
+    const size_t work_sz = code->work_sz;
+    gf** work = code->work;
+
+    /*
+     * Log of the error locator polynomial evaluated at each position: the sum of log(x_i - x_j) over the erasures j.
+     * It's a Walsh-Hadamard convolution of the erasures with the log table, which Leopard computes with two kOrder
+     * point transforms. That's a fixed ~1M operations, the direct sum is cheaper for the codes with fewer
+     * count * erasures (all of them with n <= 255).
+     */
+    ffe_t* locator = code->locator;
+    if ((size_t)count * erasure_count <= FEC_FFT_WALSH_THRESHOLD) {
+        for (unsigned i = 0; i < count; i++) {
+            uint32_t sum = 0;
+            for (unsigned e = 0; e < erasure_count; e++) {
+                unsigned d = i ^ erasures[e];
+                if (d != 0)
+                    sum += s_log[d];
+            }
+            locator[i] = (ffe_t)(sum % kModulus);
+        }
+    } else {
+        if (_init_log_walsh() != 0)
+            return -1;
+        memset(locator, 0, kOrder * sizeof(ffe_t));
+        for (unsigned e = 0; e < erasure_count; e++)
+            locator[erasures[e]] = 1;
+        _fwht(locator);
+        for (unsigned i = 0; i < kOrder; i++)
+            locator[i] = (ffe_t)(((unsigned)locator[i] * s_log_walsh[i]) % kModulus);
+        _fwht(locator);
+    }
+
+    /* work <- received data scaled by the locator */
+    for (unsigned i = 0; i < fec_count; i++) {
+        if (fecs[i])
+            _import_mul(work[i], fecs[i], locator[i], sz);
+        else
+            memset(work[i], 0, work_sz);
+    }
+    for (unsigned i = fec_count; i < m; i++)
+        memset(work[i], 0, work_sz);
+    for (unsigned i = 0; i < k; i++) {
+        if (src[i])
+            _import_mul(work[m + i], src[i], locator[m + i], sz);
+        else
+            memset(work[m + i], 0, work_sz);
+    }
+    for (unsigned i = count; i < code->work_count; i++)
+        memset(work[i], 0, work_sz);
+
+    /* the received positions, and the missing primary blocks we want back */
+    unsigned* nonzero = code->nonzero;
+    unsigned* needed = code->needed;
+    nonzero[0] = 0;
+    needed[0] = 0;
+    for (unsigned i = 0; i < code->work_count; i++) {
+        const int is_received = i < fec_count ? fecs[i] != NULL : (i >= m && i < count && src[i - m] != NULL);
+        const int is_needed = i >= m && i < count && src[i - m] == NULL;
+        nonzero[i + 1] = nonzero[i] + is_received;
+        needed[i + 1] = needed[i] + is_needed;
+    }
+
+    /* work <- FFT(FormalDerivative(IFFT(work))) */
+    _ifft_dit(work, count, code->work_count, s_fft_skew - 1, nonzero, work_sz);
+    for (unsigned i = 1; i < code->work_count; i++) {
+        const unsigned width = ((i ^ (i - 1)) + 1) >> 1;
+        for (unsigned j = 0; j < width; j++)
+            s_kernels.xor_mem(work[i - width + j], work[i + j], work_sz);
+    }
+    _fft_dit(work, count, code->work_count, s_fft_skew - 1, needed, work_sz);
+
+    /* reveal the erasures */
+    unsigned out = 0;
+    for (unsigned i = 0; i < k; i++)
+        if (!src[i])
+            _mul_export(outpkts[out++], work[m + i], (ffe_t)(kModulus - locator[m + i]), sz);
+
+    return 0;
+}
+
+const char*
+fec_fft_get_kernel_name(void) {
+    return s_kernels.name;
+}
+
+#ifndef ESP_PLATFORM
+
+int
+fec_fft_benchmark(unsigned k, unsigned n, size_t sz) {
+    fec_fft_t* code = fec_fft_new(k, n);
+    unsigned fec_count = n - k;
+    unsigned lost_count = fec_count < k ? fec_count : k;
+
+    std::vector<gf> data((size_t)n * sz);
+    std::vector<gf> decoded((size_t)lost_count * sz);
+    for (size_t i = 0; i < k * sz; i++)
+        data[i] = (gf)rand();
+
+    std::vector<const gf*> src(k);
+    std::vector<gf*> fecs(fec_count);
+    for (unsigned i = 0; i < k; i++)
+        src[i] = &data[i * sz];
+    for (unsigned i = 0; i < fec_count; i++)
+        fecs[i] = &data[(k + i) * sz];
+    std::vector<gf*> dec_dst(lost_count);
+    for (unsigned i = 0; i < lost_count; i++)
+        dec_dst[i] = &decoded[i * sz];
+
+    fec_fft_encode(code, src.data(), fecs.data(), sz);
+
+    //the SIMD kernels have to produce the same bytes as the scalar ones
+    int result = 0;
+    {
+        std::vector<gf> scalar_data((size_t)fec_count * sz);
+        std::vector<gf*> scalar_fecs(fec_count);
+        for (unsigned i = 0; i < fec_count; i++)
+            scalar_fecs[i] = &scalar_data[i * sz];
+        const fft_kernels_t kernels = s_kernels;
+        s_kernels = kScalarKernels;
+        fec_fft_encode(code, src.data(), scalar_fecs.data(), sz);
+        s_kernels = kernels;
+        if (memcmp(scalar_data.data(), &data[(size_t)k * sz], scalar_data.size()) != 0) {
+            printf("FEC FFT %u/%u/%zu: %s kernels MISMATCH\n", k, n, sz, s_kernels.name);
+            result = -1;
+        }
+    }
+
+    //correctness: random erasure patterns have to decode back to the original packets
+    std::vector<const gf*> dec_src(k);
+    std::vector<const gf*> dec_fecs(fec_count);
+    std::vector<unsigned> order(n);
+    for (unsigned pattern = 0; pattern < 32 && result == 0; pattern++) {
+        for (unsigned i = 0; i < n; i++)
+            order[i] = i;
+        unsigned lost = pattern == 0 ? lost_count : (unsigned)rand() % (lost_count + 1);
+        for (unsigned i = 0; i < lost; i++) {
+            unsigned j = i + (unsigned)rand() % (n - i);
+            unsigned t = order[i]; order[i] = order[j]; order[j] = t;
+        }
+        for (unsigned i = 0; i < k; i++)
+            dec_src[i] = src[i];
+        for (unsigned i = 0; i < fec_count; i++)
+            dec_fecs[i] = fecs[i];
+        for (unsigned i = 0; i < lost; i++) {
+            if (order[i] < k)
+                dec_src[order[i]] = NULL;
+            else
+                dec_fecs[order[i] - k] = NULL;
+        }
+
+        if (fec_fft_decode(code, dec_src.data(), dec_fecs.data(), dec_dst.data(), sz) != 0)
+            result = -1;
+        unsigned out = 0;
+        for (unsigned i = 0; i < k && result == 0; i++)
+            if (!dec_src[i] && memcmp(dec_dst[out++], src[i], sz) != 0)
+                result = -1;
+    }
+    if (result != 0)
+        printf("FEC FFT %u/%u/%zu: decode MISMATCH\n", k, n, sz);
+
+    //worst case decode: the first lost_count primary packets are replaced by fec packets
+    for (unsigned i = 0; i < k; i++)
+        dec_src[i] = i < lost_count ? NULL : src[i];
+    for (unsigned i = 0; i < fec_count; i++)
+        dec_fecs[i] = i < lost_count ? fecs[i] : NULL;
+
+    using clock = std::chrono::steady_clock;
+    double mbps[2];
+    for (int mode = 0; mode < 2; mode++) {
+        size_t iterations = 0;
+        clock::time_point start = clock::now();
+        clock::duration elapsed;
+        do {
+            if (mode == 0)
+                fec_fft_encode(code, src.data(), fecs.data(), sz);
+            else
+                fec_fft_decode(code, dec_src.data(), dec_fecs.data(), dec_dst.data(), sz);
+            iterations++;
+            elapsed = clock::now() - start;
+        } while (elapsed < std::chrono::milliseconds(250));
+        double seconds = std::chrono::duration<double>(elapsed).count();
+        mbps[mode] = (double)(iterations * k * sz) / seconds / (1024.0 * 1024.0);
+    }
+
+    printf("FEC FFT %u/%u/%zu: encode %.1f MB/s, decode %.1f MB/s, kernel %s\n", k, n, sz, mbps[0], mbps[1], s_kernels.name);
+
+    fec_fft_free(code);
+    return result;
+}
+
+#endif
@@ -0,0 +1,83 @@
+/**
+ * Reed-Solomon erasure code over GF(2^16) using an additive FFT.
+ *
+ * This follows the Leopard-RS construction (Lin, Chung & Han, "Novel polynomial basis and its application to
+ * Reed-Solomon erasure codes"): the code is evaluated with an additive FFT in a Cantor basis so the cost per packet
+ * grows with log(n - k) to encode and log(n) to decode, instead of with n - k and k like the Vandermonde code in
+ * fec.h does. The error locator of the decoder adds O((n - k) * n) per block, independent of the packet size (or
+ * Leopard's O(65536 * 16) Walsh transforms when that's cheaper, for codes much larger than 255 packets).
+ * It's meant for large blocks (64..256 packets) that can ride out long interference bursts. For small blocks the
+ * Vandermonde code is faster.
+ *
+ * The symbols are 16 bits: each 64 bytes of a packet hold the low bytes of 32 symbols followed by their high bytes
+ * (a shorter last chunk the same way with fewer symbols), so the packet size has to be even.
+ * The multiplications use SSSE3/AVX2/NEON byte shuffles when the cpu has them, see fec_fft_get_kernel_name.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fec.h"
+
+struct fec_fft_t {
+  unsigned k, n;            /* parameters of the code */
+  unsigned m;               /* n - k rounded up to a power of 2 */
+  unsigned work_count;      /* m + k rounded up to a power of 2 */
+
+  /* scratch buffers, grown to the packet size (rounded up to 64 bytes) on demand */
+  gf* work_data;
+  gf** work;
+  size_t work_sz;
+
+  /* decoder scratch, allocated with the code */
+  unsigned* erasures;       /* m + k positions */
+  uint16_t* locator;        /* m + k logs, or 65536 for the codes using the Walsh transforms */
+  unsigned* nonzero;        /* work_count + 1 prefix counts of the received positions */
+  unsigned* needed;         /* work_count + 1 prefix counts of the positions to recover */
+};
+
+/**
+ * Builds the GF(2^16) tables (~384KB, in PSRAM on the ESP). Called by fec_fft_new if needed.
+ * @return 0 on success, -1 if the tables cannot be allocated
+ */
+int init_fec_fft(void);
+
+/**
+ * @param k the number of primary blocks
+ * @param n the total number of blocks, 0 < k < n <= 65536
+ */
+fec_fft_t* fec_fft_new(unsigned k, unsigned n); /* NULL if out of memory */
+void fec_fft_free(fec_fft_t* p);
+
+/**
+ * Computes all the n - k secondary blocks.
+ * @param src the k primary blocks
+ * @param fecs n - k buffers into which the secondary blocks will be written
+ * @param sz size of a packet in bytes, has to be even
+ * @return 0 on success, -1 if the scratch buffers cannot be allocated
+ */
+int fec_fft_encode(fec_fft_t* code, const gf*restrict const*restrict const src, gf*restrict const*restrict const fecs, size_t sz);
+
+/**
+ * @param src the k primary blocks, nullptr for the missing ones
+ * @param fecs the n - k secondary blocks, nullptr for the missing ones
+ * @param outpkts one buffer for each missing primary block, in increasing order
+ * @param sz size of a packet in bytes, has to be even
+ * @return 0 on success, -1 if less than k blocks are present or the scratch buffers cannot be allocated
+ * NOTE: the scratch buffers live in the code so it's not thread safe, use one fec_fft_t per thread.
+ */
+int fec_fft_decode(fec_fft_t* code, const gf*restrict const*restrict const src, const gf*restrict const*restrict const fecs, gf*restrict const*restrict const outpkts, size_t sz);
+
+/**
+ * The name of the multiplication kernels picked for this cpu, valid after init_fec_fft.
+ */
+const char* fec_fft_get_kernel_name(void);
+
+#ifndef ESP_PLATFORM
+/**
+ * Checks that random erasure patterns decode back to the original data and prints the encode/decode throughput.
+ * @return 0 if all the patterns decoded correctly, -1 otherwise
+ */
+int fec_fft_benchmark(unsigned k, unsigned n, size_t sz);
+#endif
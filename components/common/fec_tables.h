@@ -0,0 +1,132 @@
+#pragma once
+
+#include "fec.h"
+
+//GF(2^8) tables of the zfec code, generated at compile time so they can live in read only memory (flash on the ESP,
+//  .rodata otherwise) instead of being built on the heap at boot.
+//Shared by fec.cpp and the specialized codes in fec_code.h.
+
+namespace fec_tables
+{
+
+/*
+ * Primitive polynomials - see Lin & Costello, Appendix A,
+ * and  Lee & Messerschmitt, p. 453.
+ */
+static constexpr const char* Pp = "101110001";
+
+struct Gf_Tables
+{
+    gf exp[510] = {};   /* index->poly form conversion table    */
+    int log[256] = {};  /* Poly->index form conversion table    */
+    gf inverse[256] = {}; /* inverse of field elem.               */
+                          /* inv[\alpha**i]=\alpha**(GF_SIZE-i-1) */
+};
+
+/*
+ * Generate GF(2**m) from the irreducible polynomial p(X) in p[0]..p[m]
+ * Lookup tables:
+ *     index->polynomial form		gf_exp[] contains j= \alpha^i;
+ *     polynomial form -> index form	gf_log[ j = \alpha^i ] = i
+ * \alpha=x is the primitive element of GF(2^m)
+ *
+ * For efficiency, gf_exp[] has size 2*GF_SIZE, so that a simple
+ * multiplication of two numbers can be resolved without calling modnn
+ */
+constexpr Gf_Tables make_gf_tables()
+{
+    Gf_Tables t;
+
+    /*
+     * first, generate the (polynomial representation of) powers of \alpha,
+     * which are stored in gf_exp[i] = \alpha ** i .
+     * At the same time build gf_log[gf_exp[i]] = i .
+     * The first 8 powers are simply bits shifted to the left.
+     */
+    gf mask = 1;
+    for (int i = 0; i < 8; i++, mask <<= 1)
+    {
+        t.exp[i] = mask;
+        t.log[t.exp[i]] = i;
+        if (Pp[i] == '1')
+            t.exp[8] ^= mask;
+    }
+    t.log[t.exp[8]] = 8;
+
+    /*
+     * Poly-repr of \alpha ** (i+1) is given by poly-repr of
+     * \alpha ** i shifted left one-bit and accounting for any
+     * \alpha ** 8 term that may occur when poly-repr of
+     * \alpha ** i is shifted.
+     */
+    mask = 1 << 7;
+    for (int i = 9; i < 255; i++)
+    {
+        if (t.exp[i - 1] >= mask)
+            t.exp[i] = t.exp[8] ^ ((t.exp[i - 1] ^ mask) << 1);
+        else
+            t.exp[i] = t.exp[i - 1] << 1;
+        t.log[t.exp[i]] = i;
+    }
+
+    /* log(0) is not defined, so use a special value */
+    t.log[0] = 255;
+    /* set the extended gf_exp values for fast multiply */
+    for (int i = 0; i < 255; i++)
+        t.exp[i + 255] = t.exp[i];
+
+    /* 0 has no inverse */
+    t.inverse[0] = 0;
+    t.inverse[1] = 1;
+    for (int i = 2; i <= 255; i++)
+        t.inverse[i] = t.exp[255 - t.log[i]];
+    return t;
+}
+
+static constexpr Gf_Tables GF_TABLES = make_gf_tables();
+
+constexpr gf gf_mul(gf a, gf b)
+{
+    return (a == 0 || b == 0) ? 0 : GF_TABLES.exp[(GF_TABLES.log[a] + GF_TABLES.log[b]) % 255];
+}
+
+/*
+ * The full multiplication table, gf_mul_table[c] is the row used when
+ * multiplying many numbers by the same constant c.
+ */
+struct Gf_Mul_Table
+{
+    gf data[256][256] = {};
+};
+
+constexpr Gf_Mul_Table make_gf_mul_table()
+{
+    Gf_Mul_Table t;
+    for (int i = 0; i < 256; i++)
+        for (int j = 0; j < 256; j++)
+            t.data[i][j] = gf_mul(i, j);
+    return t;
+}
+
+/*
+ * Split-nibble tables for the SIMD kernels: c * x = lo[x & 15] ^ hi[x >> 4]
+ * where lo = gf_mul_nibble_table[c][0..15] and hi = gf_mul_nibble_table[c][16..31].
+ */
+struct Gf_Mul_Nibble_Table
+{
+    gf data[256][32] = {};
+};
+
+constexpr Gf_Mul_Nibble_Table make_gf_mul_nibble_table()
+{
+    Gf_Mul_Nibble_Table t;
+    for (int c = 0; c < 256; c++)
+        for (int i = 0; i < 16; i++)
+        {
+            t.data[c][i] = gf_mul(c, i);
+            t.data[c][i + 16] = gf_mul(c, i << 4);
+        }
+    return t;
+}
+
+}
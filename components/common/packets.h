@@ -40,7 +40,7 @@ enum class WIFI_Rate : uint8_t
     /* 29 */ RATE_N_72M_MCS7_S,
 };
 
-static constexpr size_t AIR2GROUND_MTU = WLAN_MAX_PAYLOAD_SIZE - 6; //6 is the fec header size
+static constexpr size_t AIR2GROUND_MTU = (WLAN_MAX_PAYLOAD_SIZE - 7) & ~size_t(1); //7 is the fec header size. Even, as the FFT codec needs it
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
@@ -84,6 +84,7 @@ struct Ground2Air_Config_Packet : Ground2Air_Header
     uint8_t fec_codec_k = 2;
     uint8_t fec_codec_n = 3;
     uint16_t fec_codec_mtu = AIR2GROUND_MTU;
+    uint8_t fec_codec_type = 0; //Fec_Codec::Codec: 0 - Vandermonde, 1 - FFT (needs an even mtu)
     bool dvr_record = false;
 
     struct Camera
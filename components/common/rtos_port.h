@@ -0,0 +1,429 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+//Minimal task and queue abstraction so the Fec_Codec can run both on the ESP (FreeRTOS) and on the GS (std::thread).
+//The interface follows the FreeRTOS semantics closely: items are copied in and out of the queues and a blocking
+//  operation waits forever.
+
+#ifdef ESP_PLATFORM
+#   include "freertos/FreeRTOS.h"
+#   include "freertos/queue.h"
+#   include "freertos/task.h"
+#   include "esp_timer.h"
+#else
+#   include <atomic>
+#   include <memory>
+#   include <mutex>
+#   include <condition_variable>
+#   include <thread>
+#   include <chrono>
+#   include <algorithm>
+#   ifndef IRAM_ATTR
+#       define IRAM_ATTR
+#   endif
+#endif
+
+#ifdef ESP_PLATFORM
+static constexpr uint8_t RTOS_MAX_PRIORITY = configMAX_PRIORITIES - 1;
+#else
+static constexpr uint8_t RTOS_MAX_PRIORITY = 0; //priorities are ignored outside the ESP
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+inline int64_t rtos_get_time_us()
+{
+#ifdef ESP_PLATFORM
+    return esp_timer_get_time();
+#else
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//Bounded queue of trivially copyable items.
+//On the ESP this is a FreeRTOS queue.
+//Otherwise it's a lock-free ring (Vyukov style, safe for multiple producers and consumers). A mutex and a condition
+//  variable are touched only when a blocking call has to wait, or to wake up such a waiter.
+template<typename T>
+class Rtos_Queue
+{
+public:
+    Rtos_Queue() = default;
+    ~Rtos_Queue() { destroy(); }
+
+    Rtos_Queue(Rtos_Queue&& other) { *this = std::move(other); }
+    Rtos_Queue& operator=(Rtos_Queue&& other)
+    {
+        destroy();
+#ifdef ESP_PLATFORM
+        m_queue = other.m_queue;
+        other.m_queue = nullptr;
+#else
+        m_impl = std::move(other.m_impl);
+#endif
+        return *this;
+    }
+
+    bool create(size_t capacity);
+    void destroy();
+    IRAM_ATTR bool is_created() const;
+
+    IRAM_ATTR bool send(T const& item, bool block);
+    IRAM_ATTR bool receive(T& item, bool block);
+
+    IRAM_ATTR size_t get_spaces_available() const;
+
+private:
+#ifdef ESP_PLATFORM
+    QueueHandle_t m_queue = nullptr;
+#else
+    bool try_send(T const& item);
+    bool try_receive(T& item);
+    void wake_waiters();
+
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    struct Impl
+    {
+        std::unique_ptr<Cell[]> cells;
+        size_t capacity = 0;
+
+        alignas(64) std::atomic<size_t> send_pos = { 0 };
+        alignas(64) std::atomic<size_t> receive_pos = { 0 };
+
+        std::atomic<size_t> waiters = { 0 };
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+    std::unique_ptr<Impl> m_impl;
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//A task running a function until it returns.
+//NOTE: On the ESP stop() deletes the task wherever it is, like vTaskDelete.
+//  Otherwise stop() joins the thread, so the function has to be woken up and return on its own.
+class Rtos_Task
+{
+public:
+    enum class Core
+    {
+        Any,
+        Core_0,
+        Core_1
+    };
+
+    Rtos_Task() = default;
+    ~Rtos_Task() { stop(); }
+
+    Rtos_Task(Rtos_Task&& other) { *this = std::move(other); }
+    Rtos_Task& operator=(Rtos_Task&& other)
+    {
+        stop();
+#ifdef ESP_PLATFORM
+        m_task = other.m_task;
+        other.m_task = nullptr;
+#else
+        m_thread = std::move(other.m_thread);
+#endif
+        return *this;
+    }
+
+    bool start(const char* name, void (*proc)(void* params), void* params, size_t stack_size, uint8_t priority, Core core);
+    void stop();
+    bool is_running() const;
+
+private:
+#ifdef ESP_PLATFORM
+    struct Start_Params
+    {
+        void (*proc)(void* params) = nullptr;
+        void* params = nullptr;
+    };
+    static void static_task_proc(void* params);
+
+    TaskHandle_t m_task = nullptr;
+#else
+    std::thread m_thread;
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef ESP_PLATFORM
+
+template<typename T>
+bool Rtos_Queue<T>::create(size_t capacity)
+{
+    destroy();
+    m_queue = xQueueCreate(capacity, sizeof(T));
+    return m_queue != nullptr;
+}
+
+template<typename T>
+void Rtos_Queue<T>::destroy()
+{
+    if (m_queue)
+    {
+        vQueueDelete(m_queue);
+        m_queue = nullptr;
+    }
+}
+
+template<typename T>
+IRAM_ATTR bool Rtos_Queue<T>::is_created() const
+{
+    return m_queue != nullptr;
+}
+
+template<typename T>
+IRAM_ATTR bool Rtos_Queue<T>::send(T const& item, bool block)
+{
+    return xQueueSend(m_queue, &item, block ? portMAX_DELAY : 0) == pdPASS;
+}
+
+template<typename T>
+IRAM_ATTR bool Rtos_Queue<T>::receive(T& item, bool block)
+{
+    return xQueueReceive(m_queue, &item, block ? portMAX_DELAY : 0) == pdPASS;
+}
+
+template<typename T>
+IRAM_ATTR size_t Rtos_Queue<T>::get_spaces_available() const
+{
+    return uxQueueSpacesAvailable(m_queue);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+inline bool Rtos_Task::start(const char* name, void (*proc)(void* params), void* params, size_t stack_size, uint8_t priority, Core core)
+{
+    stop();
+
+    //owned by the task from now on, so the Rtos_Task can be moved freely
+    Start_Params* start_params = new Start_Params;
+    start_params->proc = proc;
+    start_params->params = params;
+
+    BaseType_t res = pdFAIL;
+    if (core != Core::Any)
+        res = xTaskCreatePinnedToCore(&static_task_proc, name, stack_size, start_params, priority, &m_task, core == Core::Core_0 ? 0 : 1);
+    else
+        res = xTaskCreate(&static_task_proc, name, stack_size, start_params, priority, &m_task);
+
+    if (res != pdPASS)
+    {
+        delete start_params;
+        m_task = nullptr;
+        return false;
+    }
+    return true;
+}
+
+inline void Rtos_Task::stop()
+{
+    if (m_task)
+    {
+        vTaskDelete(m_task);
+        m_task = nullptr;
+    }
+}
+
+inline bool Rtos_Task::is_running() const
+{
+    return m_task != nullptr;
+}
+
+inline void Rtos_Task::static_task_proc(void* _params)
+{
+    Start_Params params = *reinterpret_cast<Start_Params*>(_params);
+    delete reinterpret_cast<Start_Params*>(_params);
+
+    params.proc(params.params);
+
+    //FreeRTOS tasks cannot return. Park here until stop() deletes us
+    while (true)
+        vTaskDelay(portMAX_DELAY);
+}
+
+#else
+
+template<typename T>
+bool Rtos_Queue<T>::create(size_t capacity)
+{
+    destroy();
+    if (capacity == 0)
+        return false;
+
+    m_impl.reset(new Impl);
+    m_impl->capacity = std::max<size_t>(capacity, 2); //with a single cell its full and its next lap empty sequences are the same
+    m_impl->cells.reset(new Cell[m_impl->capacity]);
+    for (size_t i = 0; i < m_impl->capacity; i++)
+        m_impl->cells[i].sequence.store(i, std::memory_order_relaxed);
+    return true;
+}
+
+template<typename T>
+void Rtos_Queue<T>::destroy()
+{
+    m_impl.reset();
+}
+
+template<typename T>
+bool Rtos_Queue<T>::is_created() const
+{
+    return m_impl != nullptr;
+}
+
+template<typename T>
+bool Rtos_Queue<T>::try_send(T const& item)
+{
+    Impl& impl = *m_impl;
+    size_t pos = impl.send_pos.load(std::memory_order_relaxed);
+    while (true)
+    {
+        Cell& cell = impl.cells[pos % impl.capacity];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (impl.send_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                cell.item = item;
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+            return false; //full
+        else
+            pos = impl.send_pos.load(std::memory_order_relaxed);
+    }
+}
+
+template<typename T>
+bool Rtos_Queue<T>::try_receive(T& item)
+{
+    Impl& impl = *m_impl;
+    size_t pos = impl.receive_pos.load(std::memory_order_relaxed);
+    while (true)
+    {
+        Cell& cell = impl.cells[pos % impl.capacity];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (impl.receive_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                item = cell.item;
+                cell.sequence.store(pos + impl.capacity, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+            return false; //empty
+        else
+            pos = impl.receive_pos.load(std::memory_order_relaxed);
+    }
+}
+
+template<typename T>
+void Rtos_Queue<T>::wake_waiters()
+{
+    Impl& impl = *m_impl;
+    //orders the cell published by try_send/try_receive before the waiters load. Pairs with the fence after waiters++:
+    //  either the waiter sees the cell when it re-checks under the mutex, or we see the waiter and notify it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (impl.waiters.load(std::memory_order_relaxed) > 0)
+    {
+        std::lock_guard<std::mutex> lg(impl.mutex);
+        impl.cv.notify_all();
+    }
+}
+
+template<typename T>
+bool Rtos_Queue<T>::send(T const& item, bool block)
+{
+    if (try_send(item))
+    {
+        wake_waiters();
+        return true;
+    }
+    if (!block)
+        return false;
+
+    Impl& impl = *m_impl;
+    impl.waiters++;
+    std::atomic_thread_fence(std::memory_order_seq_cst); //see wake_waiters
+    {
+        std::unique_lock<std::mutex> lg(impl.mutex);
+        impl.cv.wait(lg, [this, &item] { return try_send(item); });
+    }
+    impl.waiters--;
+    wake_waiters();
+    return true;
+}
+
+template<typename T>
+bool Rtos_Queue<T>::receive(T& item, bool block)
+{
+    if (try_receive(item))
+    {
+        wake_waiters();
+        return true;
+    }
+    if (!block)
+        return false;
+
+    Impl& impl = *m_impl;
+    impl.waiters++;
+    std::atomic_thread_fence(std::memory_order_seq_cst); //see wake_waiters
+    {
+        std::unique_lock<std::mutex> lg(impl.mutex);
+        impl.cv.wait(lg, [this, &item] { return try_receive(item); });
+    }
+    impl.waiters--;
+    wake_waiters();
+    return true;
+}
+
+template<typename T>
+size_t Rtos_Queue<T>::get_spaces_available() const
+{
+    Impl& impl = *m_impl;
+    size_t used = impl.send_pos.load(std::memory_order_relaxed) - impl.receive_pos.load(std::memory_order_relaxed);
+    return used < impl.capacity ? impl.capacity - used : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+inline bool Rtos_Task::start(const char* name, void (*proc)(void* params), void* params, size_t stack_size, uint8_t priority, Core core)
+{
+    stop();
+    m_thread = std::thread(proc, params);
+    return true;
+}
+
+inline void Rtos_Task::stop()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+inline bool Rtos_Task::is_running() const
+{
+    return m_thread.joinable();
+}
+
+#endif
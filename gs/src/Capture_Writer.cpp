@@ -0,0 +1,202 @@
+#include "Capture_Writer.h"
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Log.h"
+
+#pragma pack(push, 1)
+
+//the classic pcap format, microsecond timestamps
+struct PCap_File_Header
+{
+    uint32_t magic = 0xa1b2c3d4;
+    uint16_t version_major = 2;
+    uint16_t version_minor = 4;
+    int32_t this_zone = 0;
+    uint32_t sig_figs = 0;
+    uint32_t snap_len = 65535;
+    uint32_t link_type = 0;
+};
+
+struct PCap_Record_Header
+{
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+#pragma pack(pop)
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+Capture_Writer::~Capture_Writer()
+{
+    if (m_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lg(m_mutex);
+            m_exit = true;
+        }
+        m_cv.notify_all();
+        m_thread.join();
+    }
+
+    //the writer is done with the other buffer, save what's left in the active one
+    if (m_fd >= 0)
+    {
+        save(m_buffers[m_active]);
+        close(m_fd);
+
+        Stats stats = get_stats();
+        LOGI("Capture {} closed: {} frames, {} dropped, {} KB", m_path, stats.frame_count, stats.dropped_count, stats.saved_size / 1024);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Capture_Writer::init(std::string const& path, int link_type, Descriptor const& descriptor)
+{
+    m_path = path;
+    m_descriptor = descriptor;
+
+    m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+    {
+        LOGE("Unable to create capture {}: {}", path, strerror(errno));
+        return false;
+    }
+
+    //allocate and touch both buffers now, so the RX thread never allocates or page faults
+    for (std::vector<uint8_t>& buffer: m_buffers)
+    {
+        buffer.resize(m_descriptor.buffer_size);
+        buffer.clear();
+    }
+
+    PCap_File_Header header;
+    header.link_type = static_cast<uint32_t>(link_type);
+    m_buffers[m_active].resize(sizeof(header));
+    memcpy(m_buffers[m_active].data(), &header, sizeof(header));
+    m_active_tp = Clock::now();
+
+    m_thread = std::thread([this]() { thread_proc(); });
+
+    LOGI("Capturing to {}", path);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Capture_Writer::write(uint8_t const* data, size_t size, uint32_t ts_sec, uint32_t ts_usec)
+{
+    Clock::time_point start = Clock::now();
+
+    std::vector<uint8_t>* buffer = &m_buffers[m_active];
+    size_t record_size = sizeof(PCap_Record_Header) + size;
+
+    //full or getting old? Swap the buffers
+    if (buffer->size() + record_size > m_descriptor.buffer_size ||
+        (!buffer->empty() && start - m_active_tp >= m_descriptor.flush_period))
+    {
+        if (submit())
+            buffer = &m_buffers[m_active];
+    }
+
+    if (buffer->size() + record_size > m_descriptor.buffer_size)
+        m_dropped_count.store(m_dropped_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    else
+    {
+        if (buffer->empty())
+            m_active_tp = start;
+
+        PCap_Record_Header header = { ts_sec, ts_usec, static_cast<uint32_t>(size), static_cast<uint32_t>(size) };
+        size_t offset = buffer->size();
+        buffer->resize(offset + record_size); //within the reserved capacity, no allocation
+        memcpy(buffer->data() + offset, &header, sizeof(header));
+        memcpy(buffer->data() + offset + sizeof(header), data, size);
+        m_frame_count.store(m_frame_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    m_write_ns.store(m_write_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Capture_Writer::submit()
+{
+    {
+        std::lock_guard<std::mutex> lg(m_mutex);
+        if (m_has_pending)
+            return false;
+        m_has_pending = true;
+        m_pending = m_active;
+    }
+    m_active ^= 1;
+    m_cv.notify_one();
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Capture_Writer::save(std::vector<uint8_t>& buffer)
+{
+    uint8_t const* data = buffer.data();
+    size_t size = buffer.size();
+    while (size > 0)
+    {
+        ssize_t r = ::write(m_fd, data, size);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            LOGE("Error writing capture {}: {}", m_path, strerror(errno));
+            break;
+        }
+        data += r;
+        size -= r;
+        m_saved_size += r;
+    }
+    buffer.clear(); //keeps the capacity
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Capture_Writer::thread_proc()
+{
+    std::unique_lock<std::mutex> lg(m_mutex);
+    while (true)
+    {
+        m_cv.wait(lg, [this] { return m_has_pending || m_exit; });
+        if (!m_has_pending)
+            break;
+
+        //write() doesn't touch the pending buffer until m_has_pending is cleared
+        size_t pending = m_pending;
+        lg.unlock();
+        save(m_buffers[pending]);
+        lg.lock();
+        m_has_pending = false;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+Capture_Writer::Stats Capture_Writer::get_stats() const
+{
+    Stats stats;
+    stats.frame_count = m_frame_count.load(std::memory_order_relaxed);
+    stats.dropped_count = m_dropped_count.load(std::memory_order_relaxed);
+    stats.saved_size = m_saved_size.load(std::memory_order_relaxed);
+    stats.write_ns = m_write_ns.load(std::memory_order_relaxed);
+    return stats;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+std::string const& Capture_Writer::get_path() const
+{
+    return m_path;
+}
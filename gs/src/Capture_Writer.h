@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <array>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "Clock.h"
+
+//Saves raw frames to a pcap file without blocking the thread receiving them.
+//write() only appends the frame to the active buffer. When that is full (or old) it's handed to a writer thread and
+//  the other buffer becomes active. If the writer is still saving the other buffer the frame is dropped and counted,
+//  so a slow disk costs frames in the capture but never stalls the RX.
+class Capture_Writer
+{
+public:
+    Capture_Writer() = default;
+    ~Capture_Writer();
+
+    Capture_Writer(Capture_Writer const&) = delete;
+    Capture_Writer& operator=(Capture_Writer const&) = delete;
+
+    struct Descriptor
+    {
+        size_t buffer_size = 4 * 1024 * 1024; //each of the two buffers
+        Clock::duration flush_period = std::chrono::seconds(1); //a partially filled buffer is saved after this long
+    };
+
+    //link_type is the DLT of the frames, pcap_datalink of the interface
+    bool init(std::string const& path, int link_type, Descriptor const& descriptor);
+
+    //Call from one thread only, the one receiving the frames
+    void write(uint8_t const* data, size_t size, uint32_t ts_sec, uint32_t ts_usec);
+
+    struct Stats
+    {
+        size_t frame_count = 0; //written in the buffers
+        size_t dropped_count = 0; //both buffers were full
+        size_t saved_size = 0; //bytes in the file
+        uint64_t write_ns = 0; //total time spent in write(), the cost on the RX thread
+    };
+    Stats get_stats() const;
+
+    std::string const& get_path() const;
+
+private:
+    bool submit(); //hands the active buffer to the writer thread, false if it's still busy
+    void save(std::vector<uint8_t>& buffer);
+    void thread_proc();
+
+    std::string m_path;
+    int m_fd = -1;
+    Descriptor m_descriptor;
+
+    std::array<std::vector<uint8_t>, 2> m_buffers;
+    size_t m_active = 0; //written by write() only
+    Clock::time_point m_active_tp; //when the first frame went in the active buffer
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_has_pending = false; //m_buffers[m_pending] is being saved, guarded by m_mutex
+    size_t m_pending = 0;
+    bool m_exit = false;
+
+    std::atomic<size_t> m_frame_count = {0};
+    std::atomic<size_t> m_dropped_count = {0};
+    std::atomic<size_t> m_saved_size = {0};
+    std::atomic<uint64_t> m_write_ns = {0};
+};
@@ -1,16 +1,37 @@
 #include "Comms.h"
+#include "Packet_Ring.h"
+#include "Packet_Injector.h"
+#include "Capture_Writer.h"
 #include <pcap.h>
+#include <linux/filter.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <cstring>
+#include <cstddef>
+#include <cerrno>
 #include "radiotap/radiotap.h"
 #include <mutex>
 #include <condition_variable>
 #include <deque>
+#include <array>
 #include <set>
+#include <bitset>
+#include <limits>
+#include <algorithm>
 #include <cassert>
 #include <atomic>
 #include <iostream>
 #include "fec.h"
+#include "fec_fft.h"
+#include "fec_code.h"
+#include "fec_codec.h"
 #include "Log.h"
+#include "crc.h"
 #include "Pool.h"
+#include "SPSC_Queue.h"
 #include "structures.h"
 
 //#define DEBUG_PCAP
@@ -24,6 +45,8 @@ static constexpr size_t MAX_USER_PACKET_SIZE = 1470;
 
 static constexpr size_t DEFAULT_RATE_HZ = 26000000;
 
+static constexpr size_t MAX_TX_BATCH_SIZE = 64;
+
 static std::vector<uint8_t> RADIOTAP_HEADER;
 
 static constexpr size_t SRC_MAC_LASTBYTE = 15;
@@ -70,29 +93,74 @@ struct Penumbra_Radiotap_Header
     int32_t radiotap_flags = 0;
 };
 
-struct Packet_Header
+#pragma pack(pop)
+
+//Where the fields we read are in the radiotap headers of an interface. The adapters always produce the same layout,
+//  so it's learned from the first frame parsed with the iterator and the fields are read directly while the header
+//  length and the present bitmaps stay the same
+struct Radiotap_Layout
 {
-    uint32_t block_index : 24;
-    uint32_t packet_index : 8;
-    uint16_t size = 0;
+    static constexpr size_t MAX_PRESENT_WORDS = 4; //longer bitmap chains always use the iterator
+
+    bool is_valid = false;
+    uint16_t length = 0;
+    size_t present_word_count = 0;
+    std::array<uint32_t, MAX_PRESENT_WORDS> present = {};
+
+    //offsets from the start of the header, -1 if not present
+    int32_t rate_offset = -1;
+    int32_t channel_offset = -1;
+    int32_t input_dBm_offset = -1;
+    int32_t flags_offset = -1;
 };
 
-#pragma pack(pop)
-
-static_assert(sizeof(Packet_Header) == 6);
+//same header as the air side
+using Packet_Header = Fec_Codec::Packet_Header;
+static_assert(sizeof(Packet_Header) == Fec_Codec::PACKET_OVERHEAD);
 
 //A     B       C       D       E       F
 //A     Bx      Cx      Dx      Ex      Fx
 
 struct Comms::PCap
 {
+    std::string interface;
+
     std::mutex mutex;
     pcap_t* pcap = nullptr;
     char error_buffer[PCAP_ERRBUF_SIZE] = {0};
     int rx_pcap_selectable_fd = 0;
+    std::string filter_src;
+
+    //only with the Packet_Ring backend. The pcap is still used to set up the interface and to inject
+    std::unique_ptr<Packet_Ring> ring;
+    std::vector<Packet_Ring::Frame> ring_frames;
 
     size_t _80211_header_length = 0;
     size_t index = 0;
+
+    size_t rx_frame_count = 0; //all the frames read from the interface, touched by its RX thread only
+
+    bool is_file = false; //a file: interface, replaying a capture
+
+    Radiotap_Layout radiotap_layout; //touched by its RX thread only
+
+    //see Comms::Interface_Stats. Written by the RX thread of the interface, taken by process() once per second
+    struct Stats_Accumulator
+    {
+        std::atomic<size_t> packet_count = {0};
+        std::atomic<size_t> unique_count = {0};
+        std::atomic<size_t> duplicate_count = {0};
+        std::atomic<size_t> bad_fcs_count = {0};
+        std::atomic<int> min_input_dBm = {std::numeric_limits<int>::max()};
+        std::atomic<int> max_input_dBm = {std::numeric_limits<int>::lowest()};
+        std::atomic<int64_t> input_dBm_sum = {0};
+        std::atomic<size_t> input_dBm_count = {0};
+        std::atomic<int64_t> arrival_delta_ns_sum = {0};
+        std::atomic<size_t> arrival_delta_count = {0};
+    };
+    Stats_Accumulator stats;
+
+    std::unique_ptr<Capture_Writer> capture; //with a capture_dir
 };
 
 struct Comms::TX
@@ -100,10 +168,14 @@ struct Comms::TX
     std::thread thread;
 
     fec_t* fec = nullptr;
-    std::array<uint8_t const*, 16> fec_src_packet_ptrs;
-    std::array<uint8_t*, 32> fec_dst_packet_ptrs;
+    fec_fft_t* fec_fft = nullptr;
+    fec_encode_add_fn fec_code_encode_add = nullptr; //specialized encoder if the k/n is one of the production codes
+    std::vector<uint8_t const*> fec_src_packet_ptrs;
+    std::vector<uint8_t*> fec_dst_packet_ptrs;
 
     PCap* pcap = nullptr;
+    std::unique_ptr<Packet_Injector> injector; //with the Packet_Socket backend
+    std::vector<Packet_Injector::Buffer> inject_buffers;
 
     struct Packet 
     {
@@ -111,23 +183,24 @@ struct Comms::TX
     };
     using Packet_ptr = Pool<Packet>::Ptr;
     Pool<Packet> packet_pool;
+    std::vector<uint8_t> packet_header; //the radiotap and 802.11 headers every packet starts with, up to the payload
 
     size_t transport_packet_size = 0;
     size_t streaming_packet_size = 0;
     size_t payload_size = 0;
 
     ////////
-    //These are accessed by both the TX thread and the main thread
-    std::mutex packet_queue_mutex;
-    std::deque<Packet_ptr> packet_queue;
-    std::condition_variable packet_queue_cv;
+    //Between the thread calling send() and the TX thread
+    static constexpr size_t PACKET_QUEUE_CAPACITY = 1024;
+    SPSC_Queue<Packet_ptr> packet_queue;
     ////////
 
     ////////
     //these live in the TX thread only
     std::deque<Packet_ptr> ready_packet_queue;
-    std::vector<Packet_ptr> block_packets;
-    std::vector<Packet_ptr> block_fec_packets;
+    uint32_t block_packet_count = 0;
+    std::vector<Packet_ptr> block_fec_packets; //the parity is accumulated in these as the packets arrive
+    std::vector<Packet_ptr> block_packets; //the FFT codec cannot accumulate the parity, so it keeps the packets until the block is complete
     ///////
 
     Packet_ptr crt_packet;
@@ -135,13 +208,39 @@ struct Comms::TX
     uint32_t last_block_index = 1;
 };
 
+//Average and max of a duration, written by one thread at a time and read by any
+struct Latency_Accumulator
+{
+    std::atomic<uint64_t> count = {0};
+    std::atomic<uint64_t> total_ns = {0};
+    std::atomic<uint64_t> max_ns = {0};
+
+    void add(Clock::duration d)
+    {
+        uint64_t ns = static_cast<uint64_t>(std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(), 0));
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        total_ns.store(total_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+        if (ns > max_ns.load(std::memory_order_relaxed))
+            max_ns.store(ns, std::memory_order_relaxed);
+    }
+    Comms::RX_Stats::Latency get() const
+    {
+        Comms::RX_Stats::Latency latency;
+        uint64_t c = count.load(std::memory_order_relaxed);
+        if (c > 0)
+            latency.avg = std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds(total_ns.load(std::memory_order_relaxed) / c));
+        latency.max = std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds(max_ns.load(std::memory_order_relaxed)));
+        return latency;
+    }
+};
+
 struct Comms::RX
 {
     std::vector<std::thread> threads;
 
     fec_t* fec = nullptr;
-    std::array<uint8_t const*, 16> fec_src_packet_ptrs;
-    std::array<uint8_t*, 32> fec_dst_packet_ptrs;
+    fec_fft_t* fec_fft = nullptr;
+    std::vector<uint8_t> zero_packet; //stands in for the packets missing from a closed block
 
     std::vector<PCap*> pcaps;
     std::vector<uint32_t> pcal_last_block_index;
@@ -151,30 +250,59 @@ struct Comms::RX
     size_t payload_size = 0;
 
 
-    struct Packet
-    {
-        bool is_processed = false;
-        uint32_t index = 0;
-        std::vector<uint8_t> data;
-    };
-
-    using Packet_ptr = Pool<Packet>::Ptr;
+    using Packet = Comms::RX_Packet; //handed out as is by receive_batch
+    using Packet_ptr = Comms::RX_Packet_ptr;
     Pool<Packet> packet_pool;
 
+    //The blocks being received live in a fixed window of slots, block i in slot i % BLOCK_WINDOW_SIZE.
+    //The used slots are always in [next_block_index, next_block_index + BLOCK_WINDOW_SIZE)
+    static constexpr uint32_t BLOCK_WINDOW_SIZE = 32;
+
     struct Block
     {
+        bool is_used = false;
         uint32_t index = 0;
+        uint32_t data_packet_count = 0; //0 if unknown
+        bool is_decoding = false; //the missing packets are being recovered, no more packets are accepted
+        bool is_decoded = false;
+        bool is_decode_failed = false; //the fec decoding failed, the block can only be skipped
+        Clock::time_point first_packet_tp; //the block is released at first_packet_tp + max_latency at the latest
+
+        std::bitset<256> present; //presence bitmap, [0, k) for the primary packets and [k, n) for the fec ones
+        std::bitset<256> recovered; //the present packets that were decoded rather than received
+        uint32_t packet_count = 0; //primary packets present
+        uint32_t fec_packet_count = 0;
+        uint32_t processed_count = 0; //the primary packets [0, processed_count) were dispatched
+
+        std::vector<Packet_ptr> packets; //n slots, indexed by the packet index
+    };
+    std::array<Block, BLOCK_WINDOW_SIZE> block_window;
+    uint32_t block_count = 0; //used slots
+
+    struct Fec_Job
+    {
+        Block* block = nullptr; //the slot is not reused while the block is decoding
+        std::vector<uint8_t const*> src_packet_ptrs; //the FFT codec uses k data pointers followed by n - k fec pointers, nullptr if missing
+        std::vector<uint8_t*> dst_packet_ptrs;
+        std::vector<unsigned int> indices;
+        std::vector<Packet_ptr> decoded_packets;
+        Clock::time_point start_tp;
+    };
 
-        std::vector<Packet_ptr> packets;
-        std::vector<Packet_ptr> fec_packets;
+    struct Fec_Worker
+    {
+        std::thread thread;
+        fec_t* fec = nullptr; //each worker has its own as the decode matrix cache is not thread safe
+        fec_fft_t* fec_fft = nullptr;
     };
+    std::vector<Fec_Worker> fec_workers;
 
-    using Block_ptr = Pool<Block>::Ptr;
-    Pool<Block> block_pool;
+    std::mutex fec_job_queue_mutex;
+    std::condition_variable fec_job_queue_cv;
+    std::deque<Fec_Job> fec_job_queue;
 
     ////////////////////////////////////////
-    std::mutex block_queue_mutex;
-    std::deque<Block_ptr> block_queue;
+    std::mutex block_window_mutex;
 
     Clock::time_point last_block_tp = Clock::now();
     Clock::time_point last_packet_tp = Clock::now();
@@ -182,11 +310,260 @@ struct Comms::RX
     uint32_t next_block_index = 0;
     ////////////////////////////////////////
 
-    std::mutex ready_packet_queue_mutex;
-    std::deque<Packet_ptr> ready_packet_queue;
+    //Between the threads releasing the blocks and receive(). They push with the block_window_mutex locked, so there
+    //  is still a single producer at any time
+    static constexpr size_t READY_PACKET_QUEUE_CAPACITY = 1024;
+    SPSC_Queue<Packet_ptr> ready_packet_queue;
+
+    //Wakes up Comms::wait(). The eventfd is written only if the waiting thread is blocked
+    int event_fd = -1;
+    std::atomic_bool is_waiting = {false};
+    std::atomic_bool has_events = {false}; //something happened since the last wait()
+
+    ////////////////////////////////////////
+    //see Comms::RX_Stats. Updated with the block_window_mutex locked, except the queue latency that is updated by receive()
+    std::atomic<size_t> packet_count = {0};
+    std::atomic<size_t> released_packet_count = {0};
+    std::atomic<size_t> recovered_block_count = {0};
+    std::atomic<size_t> recovered_packet_count = {0};
+    std::atomic<size_t> skipped_block_count = {0};
+    Latency_Accumulator block_latency;
+    Latency_Accumulator decode_latency;
+    Latency_Accumulator queue_latency;
+
+    std::atomic_bool is_replaying = {false}; //the replay thread has frames left
+
+    ////////////////////////////////////////
+    //With salvage_bad_fcs, the recent frames with a bad FCS. They are combined with the next bad copies of the same packet
+    static constexpr size_t MAX_SALVAGE_COPIES = 16;
+    struct Salvage_Copy
+    {
+        bool is_used = false;
+        size_t interface_index = 0;
+        Clock::time_point tp;
+        std::vector<uint8_t> frame; //the 802.11 frame, FCS included
+    };
+    std::mutex salvage_mutex;
+    std::array<Salvage_Copy, MAX_SALVAGE_COPIES> salvage_copies;
+    std::vector<uint8_t> salvage_frame; //the rebuilt frame
+    std::vector<uint8_t> salvage_scratch;
+    std::atomic<size_t> salvaged_packet_count = {0};
 };
 
-static void seal_packet(Comms::TX::Packet& packet, size_t header_offset, uint32_t block_index, uint8_t packet_index)
+//NOTE: these are called with the block_window_mutex locked
+
+static Comms::RX::Block* find_block(Comms::RX& rx, uint32_t block_index)
+{
+    Comms::RX::Block& block = rx.block_window[block_index % Comms::RX::BLOCK_WINDOW_SIZE];
+    return (block.is_used && block.index == block_index) ? &block : nullptr;
+}
+
+//the used block with the lowest index, nullptr if none
+static Comms::RX::Block* get_front_block(Comms::RX& rx)
+{
+    if (rx.block_count == 0)
+        return nullptr;
+    for (uint32_t i = 0; i < Comms::RX::BLOCK_WINDOW_SIZE; i++)
+    {
+        Comms::RX::Block* block = find_block(rx, rx.next_block_index + i);
+        if (block)
+            return block;
+    }
+    return nullptr;
+}
+
+static Comms::RX::Block& acquire_block(Comms::RX& rx, uint32_t block_index)
+{
+    Comms::RX::Block& block = rx.block_window[block_index % Comms::RX::BLOCK_WINDOW_SIZE];
+    assert(!block.is_used);
+    block.is_used = true;
+    block.index = block_index;
+    block.first_packet_tp = Clock::now();
+    rx.block_count++;
+    return block;
+}
+
+static void release_block(Comms::RX& rx, Comms::RX::Block& block)
+{
+    assert(block.is_used && !block.is_decoding);
+    block.is_used = false;
+    block.data_packet_count = 0;
+    block.is_decoded = false;
+    block.is_decode_failed = false;
+    block.present.reset();
+    block.recovered.reset();
+    block.packet_count = 0;
+    block.fec_packet_count = 0;
+    block.processed_count = 0;
+    for (Comms::RX::Packet_ptr& packet: block.packets)
+        packet.reset();
+    rx.block_count--;
+}
+
+//A TX packet holding just the headers, ready for its payload
+static Comms::TX::Packet_ptr acquire_tx_packet(Comms::TX& tx)
+{
+    Comms::TX::Packet_ptr packet = tx.packet_pool.acquire();
+    //the headers of a reused packet are still there, only the payload has to go
+    if (packet->data.size() < tx.packet_header.size())
+        packet->data.assign(tx.packet_header.begin(), tx.packet_header.end());
+    else
+        packet->data.resize(tx.packet_header.size());
+    return packet;
+}
+
+//Called after packets were stored or released, by any thread
+static void signal_rx_event(Comms::RX& rx)
+{
+    //pairs with wait(): either the waiting thread sees has_events or we see it waiting
+    rx.has_events.store(true);
+    if (rx.is_waiting.load())
+    {
+        uint64_t value = 1;
+        ssize_t r = write(rx.event_fd, &value, sizeof(value));
+        (void)r;
+    }
+}
+
+//Hands a primary packet to receive().
+//NOTE: call with the block_window_mutex locked
+static bool release_packet(Comms::RX& rx, Comms::RX::Packet_ptr const& packet)
+{
+    Clock::time_point now = Clock::now();
+    packet->release_tp = now; //before the push, receive() reads it
+    if (!rx.ready_packet_queue.push(packet))
+        return false;
+
+    rx.block_latency.add(now - packet->rx_tp);
+    rx.released_packet_count++;
+    rx.last_packet_tp = now;
+    return true;
+}
+
+static void put_packet(Comms::RX::Block& block, uint32_t coding_k, Comms::RX::Packet_ptr const& packet)
+{
+    assert(!block.present[packet->index]);
+    block.present.set(packet->index);
+    block.packets[packet->index] = packet;
+    if (packet->index < coding_k)
+        block.packet_count++;
+    else
+        block.fec_packet_count++;
+}
+
+//Prepares the fec decoding of a block and marks it as decoding.
+//NOTE: call with the block_window_mutex locked
+static void prepare_fec_job(Comms::RX& rx, Comms::RX::Block& block, uint32_t coding_k, uint32_t coding_n, Comms::RX::Fec_Job& job)
+{
+    //closed blocks have fewer data packets
+    uint32_t block_k = block.data_packet_count > 0 ? block.data_packet_count : coding_k;
+
+    job.block = &block;
+    job.start_tp = Clock::now();
+
+    if (rx.fec_fft)
+    {
+        //data pointers first, then the fec ones. The missing packets stay nullptr
+        job.src_packet_ptrs.assign(coding_n, nullptr);
+        for (size_t i = 0; i < coding_n; i++)
+        {
+            if (block.present[i])
+                job.src_packet_ptrs[i] = block.packets[i]->data.data();
+            else if (i >= block_k && i < coding_k)
+                job.src_packet_ptrs[i] = rx.zero_packet.data();
+        }
+    }
+    else
+    {
+        job.src_packet_ptrs.resize(coding_k);
+        job.indices.resize(coding_k);
+
+        //the missing primary packets are replaced by the fec packets, in order
+        size_t fec_index = coding_k;
+        for (size_t i = 0; i < coding_k; i++)
+        {
+            if (i >= block_k) //not part of a closed block, these are zeros
+            {
+                job.src_packet_ptrs[i] = rx.zero_packet.data();
+                job.indices[i] = i;
+            }
+            else if (block.present[i])
+            {
+                job.src_packet_ptrs[i] = block.packets[i]->data.data();
+                job.indices[i] = i;
+            }
+            else
+            {
+                while (!block.present[fec_index])
+                    fec_index++;
+                job.src_packet_ptrs[i] = block.packets[fec_index]->data.data();
+                job.indices[i] = fec_index;
+                fec_index++;
+            }
+        }
+    }
+
+    //the missing packets, they will be filled with data by the fec_decode
+    job.decoded_packets.clear();
+    job.dst_packet_ptrs.resize(coding_k);
+    for (size_t i = 0; i < block_k; i++)
+    {
+        if (!block.present[i])
+        {
+            Comms::RX::Packet_ptr packet = rx.packet_pool.acquire();
+            packet->data.resize(rx.payload_size);
+            packet->index = i;
+            job.dst_packet_ptrs[job.decoded_packets.size()] = packet->data.data();
+            job.decoded_packets.push_back(packet);
+        }
+    }
+
+    block.is_decoding = true;
+}
+
+//Returns false if the packets could not be recovered
+static bool decode_fec_job(fec_t* fec, fec_fft_t* fec_fft, uint32_t coding_k, size_t payload_size, Comms::RX::Fec_Job& job)
+{
+    if (fec_fft)
+        return fec_fft_decode(fec_fft, job.src_packet_ptrs.data(), job.src_packet_ptrs.data() + coding_k, job.dst_packet_ptrs.data(), payload_size) == 0;
+
+    fec_decode_cached(fec, job.src_packet_ptrs.data(), job.dst_packet_ptrs.data(), job.indices.data(), payload_size);
+    return true;
+}
+
+//Puts the recovered packets in their block, ready to be dispatched.
+//If the decoding failed they are dropped instead and the block is left to be skipped with the packets it received.
+//NOTE: call with the block_window_mutex locked
+static void finish_fec_job(Comms::RX& rx, Comms::RX::Fec_Job& job, uint32_t coding_k, bool is_decoded)
+{
+    Clock::time_point now = Clock::now();
+    rx.decode_latency.add(now - job.start_tp);
+
+    Comms::RX::Block& block = *job.block;
+    block.is_decoding = false;
+    if (is_decoded)
+    {
+        rx.recovered_block_count++;
+        rx.recovered_packet_count += job.decoded_packets.size();
+        for (Comms::RX::Packet_ptr const& packet: job.decoded_packets)
+        {
+            packet->rx_tp = now;
+            put_packet(block, coding_k, packet);
+            block.recovered.set(packet->index);
+        }
+        block.is_decoded = true;
+    }
+    else
+    {
+        LOGE("Fec decoding failed for block {}", block.index);
+        block.is_decode_failed = true;
+    }
+
+    job.decoded_packets.clear();
+    job.block = nullptr;
+}
+
+static void seal_packet(Comms::TX::Packet& packet, size_t header_offset, uint32_t block_index, uint8_t packet_index, uint8_t data_packet_count)
 {
     assert(packet.data.size() >= header_offset + sizeof(Comms::TX::Packet));
 
@@ -194,6 +571,20 @@ static void seal_packet(Comms::TX::Packet& packet, size_t header_offset, uint32_
     header.size = packet.data.size() - header_offset;
     header.block_index = block_index;
     header.packet_index = packet_index;
+    header.data_packet_count = data_packet_count;
+}
+
+static bool check_coding_params(Fec_Codec::Codec codec, uint32_t coding_k, uint32_t coding_n, size_t mtu)
+{
+    bool valid = coding_k > 0 && coding_n >= coding_k;
+    if (codec == Fec_Codec::Codec::FFT)
+        valid &= coding_n > coding_k && coding_n <= 255 && (mtu & 1) == 0; //the packet index is 8 bits, the symbols 16 bits
+    else
+        valid &= coding_k <= Fec_Codec::MAX_CODING_K && coding_n <= Fec_Codec::MAX_CODING_N;
+
+    if (!valid)
+        LOGE("Invalid coding params: {} / {}, mtu {}", coding_k, coding_n, mtu);
+    return valid;
 }
 
 struct Comms::Impl
@@ -201,8 +592,13 @@ struct Comms::Impl
     size_t tx_packet_header_length = 0;
     std::vector<std::unique_ptr<PCap>> pcaps;
 
+    mutable std::mutex interface_stats_mutex;
+    std::vector<Interface_Stats> interface_stats; //of the last second, one per RX interface
+
     TX tx;
     RX rx;
+
+    Clock::time_point last_pool_stats_tp = Clock::now();
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////
@@ -248,17 +644,40 @@ Comms::~Comms()
 {
     m_exit = true;
 
-    m_impl->tx.packet_queue_cv.notify_all();
+    m_impl->tx.packet_queue.notify();
+    {
+        std::lock_guard<std::mutex> lg(m_impl->rx.fec_job_queue_mutex);
+        m_impl->rx.fec_job_queue_cv.notify_all();
+    }
 
     for (auto& thread: m_impl->rx.threads)
         if (thread.joinable())
             thread.join();
 
+    for (auto& worker: m_impl->rx.fec_workers)
+    {
+        if (worker.thread.joinable())
+            worker.thread.join();
+        if (worker.fec)
+            fec_free(worker.fec);
+        if (worker.fec_fft)
+            fec_fft_free(worker.fec_fft);
+    }
+
     if (m_impl->tx.thread.joinable())
         m_impl->tx.thread.join();
 
-    fec_free(m_impl->rx.fec);
-    fec_free(m_impl->tx.fec);
+    if (m_impl->rx.fec)
+        fec_free(m_impl->rx.fec);
+    if (m_impl->rx.fec_fft)
+        fec_fft_free(m_impl->rx.fec_fft);
+    if (m_impl->tx.fec)
+        fec_free(m_impl->tx.fec);
+    if (m_impl->tx.fec_fft)
+        fec_fft_free(m_impl->tx.fec_fft);
+
+    if (m_impl->rx.event_fd >= 0)
+        close(m_impl->rx.event_fd);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
@@ -289,6 +708,8 @@ bool Comms::prepare_filter(PCap& pcap)
         return false;
     }
 
+    pcap.filter_src = program_src;
+
     if (pcap_compile(pcap.pcap, &program, program_src, 1, 0) == -1)
     {
         LOGE("Failed to compile program: {} : {}", program_src, pcap_geterr(pcap.pcap));
@@ -391,208 +812,567 @@ void Comms::prepare_tx_packet_header(uint8_t* buffer)
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
-bool Comms::process_rx_packet(PCap& pcap)
+//Copies the present bitmaps of the header, 0 if they don't fit in the layout
+static size_t get_radiotap_present(uint8_t const* data, size_t size, std::array<uint32_t, Radiotap_Layout::MAX_PRESENT_WORDS>& present)
 {
-    struct pcap_pkthdr* pcap_packet_header = nullptr;
+    size_t offset = offsetof(ieee80211_radiotap_header, it_present);
+    for (size_t i = 0; i < present.size(); i++, offset += sizeof(uint32_t))
+    {
+        if (offset + sizeof(uint32_t) > size)
+            return 0;
+        memcpy(&present[i], data + offset, sizeof(uint32_t));
+        if ((present[i] & (1u << IEEE80211_RADIOTAP_EXT)) == 0)
+            return i + 1;
+    }
+    return 0;
+}
 
-    uint8_t payload_buffer[MAX_PACKET_SIZE];
-    uint8_t* payload = payload_buffer;
+//The generic path. Learns the layout of the header if layout is not null
+static bool parse_radiotap_iterator(uint8_t const* data, size_t size, Penumbra_Radiotap_Header& prh, Radiotap_Layout* layout)
+{
+    ieee80211_radiotap_iterator rti;
+    if (ieee80211_radiotap_iterator_init(&rti, (struct ieee80211_radiotap_header*)data, size) < 0)
+        return false;
 
-    while (true)
+    Radiotap_Layout new_layout;
+    int n = 0;
+    while ((n = ieee80211_radiotap_iterator_next(&rti)) == 0)
     {
+        int32_t offset = static_cast<int32_t>(rti.this_arg - data);
+        switch (rti.this_arg_index)
         {
-            std::lock_guard<std::mutex> lg(pcap.mutex);
-            int retval = pcap_next_ex(pcap.pcap, &pcap_packet_header, (const u_char**)&payload);
-            if (retval < 0)
-            {
-                LOGE("Socket broken: {}", pcap_geterr(pcap.pcap));
-                return false;
-            }
-            if (retval != 1)
-                break;
-        }
-
-        size_t header_len = (payload[2] + (payload[3] << 8));
-        if (pcap_packet_header->len < (header_len + pcap._80211_header_length))
-        {
-            LOGW("packet too small");
-            return true;
-        }
+        case IEEE80211_RADIOTAP_RATE:
+            prh.rate = (*rti.this_arg);
+            new_layout.rate_offset = offset;
+            break;
 
-        size_t bytes = pcap_packet_header->len - (header_len + pcap._80211_header_length);
+        case IEEE80211_RADIOTAP_CHANNEL:
+            prh.channel = (*((uint16_t*)rti.this_arg));
+            prh.channel_flags = (*((uint16_t*)(rti.this_arg + 2)));
+            new_layout.channel_offset = offset;
+            break;
 
-        ieee80211_radiotap_iterator rti;
-        if (ieee80211_radiotap_iterator_init(&rti, (struct ieee80211_radiotap_header*)payload, pcap_packet_header->len) < 0)
-        {
-            LOGE("iterator null");
-            return true;
+        case IEEE80211_RADIOTAP_DBM_ANTSIGNAL:
+            prh.input_dBm = *(int8_t*)rti.this_arg;
+            new_layout.input_dBm_offset = offset;
+            break;
+        case IEEE80211_RADIOTAP_FLAGS:
+            prh.radiotap_flags = *rti.this_arg;
+            new_layout.flags_offset = offset;
+            break;
         }
+    }
 
-        int n = 0;
-        Penumbra_Radiotap_Header prh;
-        while ((n = ieee80211_radiotap_iterator_next(&rti)) == 0)
+    //only a header walked to its end is a layout we can trust
+    if (layout && n == -ENOENT)
+    {
+        new_layout.present_word_count = get_radiotap_present(data, size, new_layout.present);
+        if (new_layout.present_word_count > 0)
         {
-
-            switch (rti.this_arg_index)
-            {
-            case IEEE80211_RADIOTAP_RATE:
-                prh.rate = (*rti.this_arg);
-                break;
-
-            case IEEE80211_RADIOTAP_CHANNEL:
-                prh.channel = (*((uint16_t*)rti.this_arg));
-                prh.channel_flags = (*((uint16_t*)(rti.this_arg + 2)));
-                break;
-
-            case IEEE80211_RADIOTAP_DBM_ANTSIGNAL:
-                prh.input_dBm = *(int8_t*)rti.this_arg;
-                break;
-            case IEEE80211_RADIOTAP_FLAGS:
-                prh.radiotap_flags = *rti.this_arg;
-                break;
-            }
+            new_layout.length = reinterpret_cast<ieee80211_radiotap_header const*>(data)->it_len;
+            new_layout.is_valid = true;
+            *layout = new_layout;
         }
-        payload += header_len + pcap._80211_header_length;
+    }
+    return true;
+}
 
-        if (prh.radiotap_flags & IEEE80211_RADIOTAP_F_FCS)
-            bytes -= 4;
+//The fast path. Returns false if the header doesn't have the layout, it has to be parsed with the iterator then
+static bool parse_radiotap_layout(Radiotap_Layout const& layout, uint8_t const* data, size_t size, Penumbra_Radiotap_Header& prh)
+{
+    if (!layout.is_valid || size < layout.length || reinterpret_cast<ieee80211_radiotap_header const*>(data)->it_len != layout.length)
+        return false;
 
-        bool checksum_correct = (prh.radiotap_flags & 0x40) == 0;
+    size_t present_size = layout.present_word_count * sizeof(uint32_t);
+    if (memcmp(data + offsetof(ieee80211_radiotap_header, it_present), layout.present.data(), present_size) != 0)
+        return false;
 
-        //    block_num = seq_nr / param_retransmission_block_size;//if retr_block_size would be limited to powers of two, this could be replaced by a logical AND operation
+    //same fields and types as parse_radiotap_iterator
+    if (layout.rate_offset >= 0)
+        prh.rate = data[layout.rate_offset];
+    if (layout.channel_offset >= 0)
+    {
+        uint16_t channel, channel_flags;
+        memcpy(&channel, data + layout.channel_offset, sizeof(channel));
+        memcpy(&channel_flags, data + layout.channel_offset + 2, sizeof(channel_flags));
+        prh.channel = channel;
+        prh.channel_flags = channel_flags;
+    }
+    if (layout.input_dBm_offset >= 0)
+        prh.input_dBm = static_cast<int8_t>(data[layout.input_dBm_offset]);
+    if (layout.flags_offset >= 0)
+        prh.radiotap_flags = data[layout.flags_offset];
+    return true;
+}
 
-        //printf("rec %x bytes %d crc %d\n", seq_nr, bytes, checksum_correct);
+////////////////////////////////////////////////////////////////////////////////////////////
 
-#ifdef DEBUG_PCAP
-        std::cout << "PCAP RX>>";
-        std::copy(payload, payload + bytes, std::ostream_iterator<uint8_t>(std::cout));
-        std::cout << "<<PCAP RX";
-#endif
-        if (!checksum_correct)
-        {
-            LOGW("invalid checksum.");
-            return true;
-        }
+//copies that differ in more bytes are different packets, or too damaged. It also bounds the trials to 2^N
+static constexpr size_t MAX_SALVAGE_DIFF_BYTES = 12;
 
-        {
-            int best_input_dBm = m_best_input_dBm;
-            m_best_input_dBm = std::max(best_input_dBm, prh.input_dBm);
-        }
+static uint32_t get_fcs(uint8_t const* frame, size_t size)
+{
+    uint32_t fcs;
+    memcpy(&fcs, frame + size - sizeof(fcs), sizeof(fcs));
+    return fcs;
+}
 
+//The bytes where the two copies differ, outside the FCS. False if there are too many
+static bool get_salvage_diffs(uint8_t const* a, uint8_t const* b, size_t size, std::vector<uint32_t>& diffs)
+{
+    diffs.clear();
+    for (size_t i = 0; i + sizeof(uint32_t) < size; i++)
+    {
+        if (a[i] != b[i])
         {
-            RX& rx = m_impl->rx;
+            if (diffs.size() >= MAX_SALVAGE_DIFF_BYTES)
+                return false;
+            diffs.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    return true;
+}
 
-            Packet_Header& header = *reinterpret_cast<Packet_Header*>(payload);
-            uint32_t block_index = header.block_index;
-            uint32_t packet_index = header.packet_index;
-            if (packet_index >= m_rx_descriptor.coding_n)
-            {
-                LOGE("packet index out of range: {} > {}", packet_index, m_rx_descriptor.coding_n);
-                return true;
-            }
+//Tries all the mixes of two copies at the bytes where they differ and writes the one matching the FCS of either copy to out.
+//The crc is linear, so each mix costs a xor: crc(a with byte i from b) = crc(a) ^ crc(e) ^ crc(zeros), where e is all 
+//  zeros except a[i] ^ b[i] at i
+static bool combine_salvage_copies(uint8_t const* a, uint8_t const* b, size_t size, std::vector<uint32_t> const& diffs, 
+                                   std::vector<uint8_t>& scratch, std::vector<uint8_t>& out)
+{
+    size_t data_size = size - sizeof(uint32_t);
+    uint32_t fcs_a = get_fcs(a, size);
+    uint32_t fcs_b = get_fcs(b, size);
 
-            std::lock_guard<std::mutex> lg(rx.block_queue_mutex);
+    scratch.assign(data_size, 0);
+    uint32_t zero_crc = crc32_fcs(0, scratch.data(), data_size);
 
-            //keep track of what interface returned what index. 
-            //this should allow us to skip stale blocks sooner
-            rx.pcal_last_block_index[pcap.index] = block_index;
+    std::array<uint32_t, MAX_SALVAGE_DIFF_BYTES> deltas;
+    for (size_t i = 0; i < diffs.size(); i++)
+    {
+        scratch[diffs[i]] = a[diffs[i]] ^ b[diffs[i]];
+        deltas[i] = crc32_fcs(0, scratch.data(), data_size) ^ zero_crc;
+        scratch[diffs[i]] = 0;
+    }
 
-            if (block_index < rx.next_block_index)
-            {
-                //LOGW("Old packet: {} < {}", block_index, rx.next_block_index);
-                return true;
-            }
+    //gray code order, one byte changes between consecutive mixes
+    uint32_t crc = crc32_fcs(0, a, data_size);
+    uint32_t mix = 0; //bit i set - byte diffs[i] comes from b
+    uint32_t count = 1u << diffs.size();
+    for (uint32_t k = 0; k < count; k++)
+    {
+        if (k > 0)
+        {
+            uint32_t bit = __builtin_ctz(k);
+            mix ^= 1u << bit;
+            crc ^= deltas[bit];
+        }
+        if (crc != fcs_a && crc != fcs_b)
+            continue;
+
+        out.assign(a, a + size);
+        for (size_t i = 0; i < diffs.size(); i++)
+            if (mix & (1u << i))
+                out[diffs[i]] = b[diffs[i]];
+        memcpy(out.data() + data_size, &crc, sizeof(crc));
+        return true;
+    }
+    return false;
+}
 
-            RX::Block_ptr block;
+//Byte-wise majority of three copies, if it matches its FCS
+static bool vote_salvage_copies(uint8_t const* a, uint8_t const* b, uint8_t const* c, size_t size, std::vector<uint8_t>& out)
+{
+    out.resize(size);
+    for (size_t i = 0; i < size; i++)
+        out[i] = (a[i] == b[i] || a[i] == c[i]) ? a[i] : b[i]; //if all three differ, any is as good
+    return crc32_fcs(0, out.data(), size - sizeof(uint32_t)) == get_fcs(out.data(), size);
+}
 
-            //find the block
-            {
-                auto iter = std::lower_bound(rx.block_queue.begin(), rx.block_queue.end(), block_index, [](RX::Block_ptr const& l, uint32_t index) { return l->index < index; });
-                if (iter != rx.block_queue.end() && (*iter)->index == block_index)
-                    block = *iter;
-                else
-                {
-                    block = rx.block_pool.acquire();
-                    block->index = block_index;
-                    rx.block_queue.insert(iter, block);
-                }
-            }
+////////////////////////////////////////////////////////////////////////////////////////////
 
-            RX::Packet_ptr packet = rx.packet_pool.acquire();
-            packet->data.resize(bytes - sizeof(Packet_Header));
-            packet->index = packet_index;
-            memcpy(packet->data.data(), payload + sizeof(Packet_Header), bytes - sizeof(Packet_Header));
+//Keeps a frame with a bad FCS and tries to rebuild its packet with the other bad copies received recently.
+//Returns the rebuilt frame in rx.salvage_frame.
+//NOTE: call with the salvage_mutex locked
+static bool combine_bad_frame(Comms::RX& rx, size_t interface_index, uint8_t const* frame, size_t size, Clock::duration max_age)
+{
+    using Salvage_Copy = Comms::RX::Salvage_Copy;
 
-            //store packet
-            if (packet_index >= m_rx_descriptor.coding_k)
-            {
-                auto iter = std::lower_bound(block->fec_packets.begin(), block->fec_packets.end(), packet_index, [](RX::Packet_ptr const& l, uint32_t index) { return l->index < index; });
-                if (iter != block->fec_packets.end() && (*iter)->index == packet_index)
-                {
-                    //LOGW("Duplicated packet {} from block {} (index {})", packet_index, block_index, block_index * m_coding_k + packet_index);
-                    return true;
-                }
-                else
-                    block->fec_packets.insert(iter, packet);
-            }
-            else
-            {
-                auto iter = std::lower_bound(block->packets.begin(), block->packets.end(), packet_index, [](RX::Packet_ptr const& l, uint32_t index) { return l->index < index; });
-                if (iter != block->packets.end() && (*iter)->index == packet_index)
-                {
-                    //LOGW("Duplicated packet {} from block {} (index {})", packet_index, block_index, block_index * m_coding_k + packet_index);
-                    return true;
-                }
-                else
-                    block->packets.insert(iter, packet);
-            }
+    Clock::time_point now = Clock::now();
+    std::array<Salvage_Copy*, 2> matches = {};
+    size_t match_count = 0;
+    Salvage_Copy* oldest = &rx.salvage_copies[0];
+    std::vector<uint32_t> diffs;
+    for (Salvage_Copy& copy: rx.salvage_copies)
+    {
+        if (copy.is_used && now - copy.tp > max_age) //past the block deadline
+            copy.is_used = false;
+        if (!copy.is_used)
+        {
+            oldest = oldest->is_used ? &copy : oldest;
+            continue;
         }
+        if (oldest->is_used && copy.tp < oldest->tp)
+            oldest = &copy;
 
-        //m_impl->rx_queue.enqueue(payload, bytes);
-        //        if (receive_callback && bytes > 0)
-        //        {
-        //            receive_callback(payload, bytes);
-        //        }
+        if (match_count < matches.size() && copy.frame.size() == size && get_salvage_diffs(frame, copy.frame.data(), size, diffs))
+            matches[match_count++] = &copy;
+    }
 
-#ifdef DEBUG_THROUGHPUT
-        {
-            static int xxx_data = 0;
-            static std::chrono::system_clock::time_point xxx_last_tp = std::chrono::system_clock::now();
-            xxx_data += bytes;
-            auto now = std::chrono::system_clock::now();
-            if (now - xxx_last_tp >= std::chrono::seconds(1))
-            {
-                float r = std::chrono::duration<float>(now - xxx_last_tp).count();
-                LOGI("Received: {} KB/s", float(xxx_data) / r / 1024.f);
-                xxx_data = 0;
-                xxx_last_tp = now;
-            }
-        }
-#endif
+    bool rebuilt = false;
+    if (match_count == 2)
+        rebuilt = vote_salvage_copies(frame, matches[0]->frame.data(), matches[1]->frame.data(), size, rx.salvage_frame);
+    for (size_t i = 0; i < match_count && !rebuilt; i++)
+    {
+        get_salvage_diffs(frame, matches[i]->frame.data(), size, diffs);
+        rebuilt = combine_salvage_copies(frame, matches[i]->frame.data(), size, diffs, rx.salvage_scratch, rx.salvage_frame);
     }
 
-    return true;
+    if (rebuilt)
+    {
+        for (size_t i = 0; i < match_count; i++)
+            matches[i]->is_used = false;
+        return true;
+    }
+
+    //keep it for the next copies
+    oldest->is_used = true;
+    oldest->interface_index = interface_index;
+    oldest->tp = now;
+    oldest->frame.assign(frame, frame + size);
+    return false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
-bool Comms::prepare_pcap(std::string const& interface, PCap& pcap)
+bool Comms::parse_rx_frame(PCap& pcap, uint8_t const* data, size_t size, uint8_t const*& payload, size_t& payload_size)
 {
-    LOGI("Opening interface {} in monitor mode", interface);
-
-    pcap.pcap = pcap_create(interface.c_str(), pcap.error_buffer);
-    if (pcap.pcap == nullptr)
+    if (size < 4)
     {
-        LOGE("Unable to open interface {}: {}", interface, pcap_geterr(pcap.pcap));
+        LOGW("packet too small");
         return false;
     }
-    if (pcap_set_snaplen(pcap.pcap, 1800) < 0)
+
+    size_t header_len = (data[2] + (data[3] << 8));
+    if (size < (header_len + pcap._80211_header_length))
     {
-        LOGE("Error setting pcap_set_snaplen: {}", pcap_geterr(pcap.pcap));
+        LOGW("packet too small");
         return false;
     }
-    if (pcap_set_promisc(pcap.pcap, 1) < 0)
-    {
+
+    size_t bytes = size - (header_len + pcap._80211_header_length);
+
+    //the layout of the previous frames, or learn the new one
+    Penumbra_Radiotap_Header prh;
+    if (!parse_radiotap_layout(pcap.radiotap_layout, data, size, prh) && 
+        !parse_radiotap_iterator(data, size, prh, &pcap.radiotap_layout))
+    {
+        LOGE("iterator null");
+        return false;
+    }
+
+    payload = data + header_len + pcap._80211_header_length;
+
+    if (prh.radiotap_flags & IEEE80211_RADIOTAP_F_FCS)
+        bytes -= std::min<size_t>(bytes, 4);
+
+    if (bytes < sizeof(Packet_Header))
+    {
+        LOGW("packet too small");
+        return false;
+    }
+
+    bool checksum_correct = (prh.radiotap_flags & 0x40) == 0;
+
+    //    block_num = seq_nr / param_retransmission_block_size;//if retr_block_size would be limited to powers of two, this could be replaced by a logical AND operation
+
+    //printf("rec %x bytes %d crc %d\n", seq_nr, bytes, checksum_correct);
+
+#ifdef DEBUG_PCAP
+    std::cout << "PCAP RX>>";
+    std::copy(payload, payload + bytes, std::ostream_iterator<uint8_t>(std::cout));
+    std::cout << "<<PCAP RX";
+#endif
+    PCap::Stats_Accumulator& stats = pcap.stats;
+    if (!checksum_correct)
+    {
+        stats.bad_fcs_count++;
+
+        //the FCS is needed to tell a good rebuild
+        if (m_rx_descriptor.salvage_bad_fcs && (prh.radiotap_flags & IEEE80211_RADIOTAP_F_FCS))
+        {
+            salvage_rx_frame(pcap, data + header_len, size - header_len);
+            return false; //stored already if it could be rebuilt
+        }
+
+        LOGW("invalid checksum.");
+        return false;
+    }
+
+    {
+        int best_input_dBm = m_best_input_dBm;
+        m_best_input_dBm = std::max(best_input_dBm, prh.input_dBm);
+    }
+
+    stats.packet_count++;
+    if (prh.input_dBm != 0) //0 if the adapter doesn't report it
+    {
+        //compare_exchange as process() resets them concurrently
+        int crt = stats.min_input_dBm.load(std::memory_order_relaxed);
+        while (prh.input_dBm < crt && !stats.min_input_dBm.compare_exchange_weak(crt, prh.input_dBm, std::memory_order_relaxed)) {}
+        crt = stats.max_input_dBm.load(std::memory_order_relaxed);
+        while (prh.input_dBm > crt && !stats.max_input_dBm.compare_exchange_weak(crt, prh.input_dBm, std::memory_order_relaxed)) {}
+        stats.input_dBm_sum.fetch_add(prh.input_dBm, std::memory_order_relaxed);
+        stats.input_dBm_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    payload_size = bytes;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Comms::salvage_rx_frame(PCap& pcap, uint8_t const* frame, size_t size)
+{
+    RX& rx = m_impl->rx;
+    if (size < pcap._80211_header_length + sizeof(Packet_Header) + sizeof(uint32_t))
+        return;
+
+    std::lock_guard<std::mutex> salvage_lg(rx.salvage_mutex);
+    if (!combine_bad_frame(rx, pcap.index, frame, size, m_rx_descriptor.max_latency))
+        return;
+
+    rx.salvaged_packet_count++;
+
+    //the payload is between the 802.11 header and the FCS
+    uint8_t const* payload = rx.salvage_frame.data() + pcap._80211_header_length;
+    size_t payload_size = rx.salvage_frame.size() - pcap._80211_header_length - sizeof(uint32_t);
+
+    std::unique_lock<std::mutex> lg(rx.block_window_mutex);
+    store_rx_packet(pcap, payload, payload_size);
+
+    if (m_rx_descriptor.run_to_completion)
+        process_rx_blocks(lg);
+    else
+        signal_rx_event(rx); //process() has work
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//NOTE: call with the block_window_mutex locked
+void Comms::store_rx_packet(PCap& pcap, uint8_t const* payload, size_t size)
+{
+    RX& rx = m_impl->rx;
+
+    Packet_Header const& header = *reinterpret_cast<Packet_Header const*>(payload);
+    uint32_t block_index = header.block_index;
+    uint32_t packet_index = header.packet_index;
+    if (packet_index >= m_rx_descriptor.coding_n)
+    {
+        LOGE("packet index out of range: {} > {}", packet_index, m_rx_descriptor.coding_n);
+        return;
+    }
+
+    //keep track of what interface returned what index. 
+    //this should allow us to skip stale blocks sooner
+    rx.pcal_last_block_index[pcap.index] = block_index;
+
+    if (block_index < rx.next_block_index)
+    {
+        //LOGW("Old packet: {} < {}", block_index, rx.next_block_index);
+        pcap.stats.duplicate_count++; //too late to be useful, same as a duplicate
+        return;
+    }
+
+    //too far ahead, slide the window so it fits
+    if (block_index >= rx.next_block_index + RX::BLOCK_WINDOW_SIZE)
+    {
+        uint32_t next_block_index = block_index - RX::BLOCK_WINDOW_SIZE + 1;
+        for (RX::Block const& block: rx.block_window)
+        {
+            if (block.is_used && block.index < next_block_index && block.is_decoding)
+                return; //cannot throw this one away yet, drop the packet instead
+        }
+        for (RX::Block& block: rx.block_window)
+        {
+            if (block.is_used && block.index < next_block_index)
+                release_block(rx, block);
+        }
+        rx.next_block_index = next_block_index;
+    }
+
+    RX::Block* block = find_block(rx, block_index);
+    if (!block)
+        block = &acquire_block(rx, block_index);
+
+    if (header.data_packet_count > 0 && header.data_packet_count <= m_rx_descriptor.coding_k)
+        block->data_packet_count = header.data_packet_count;
+
+    //received from another interface already
+    if (block->present[packet_index])
+    {
+        //LOGW("Duplicated packet {} from block {} (index {})", packet_index, block_index, block_index * m_coding_k + packet_index);
+        pcap.stats.duplicate_count++;
+        if (!block->recovered[packet_index])
+        {
+            //how far behind the interface that got it first
+            Clock::duration delta = Clock::now() - block->packets[packet_index]->rx_tp;
+            pcap.stats.arrival_delta_ns_sum += std::chrono::duration_cast<std::chrono::nanoseconds>(delta).count();
+            pcap.stats.arrival_delta_count++;
+        }
+        return;
+    }
+
+    //already has enough packets, they are being recovered
+    if (block->is_decoding || block->is_decoded)
+    {
+        pcap.stats.duplicate_count++;
+        return;
+    }
+
+    RX::Packet_ptr packet = rx.packet_pool.acquire();
+    packet->data.resize(size - sizeof(Packet_Header));
+    packet->index = packet_index;
+    packet->rx_tp = Clock::now();
+    memcpy(packet->data.data(), payload + sizeof(Packet_Header), size - sizeof(Packet_Header));
+    rx.packet_count++;
+    pcap.stats.unique_count++;
+
+    put_packet(*block, m_rx_descriptor.coding_k, packet);
+
+#ifdef DEBUG_THROUGHPUT
+    {
+        static int xxx_data = 0;
+        static std::chrono::system_clock::time_point xxx_last_tp = std::chrono::system_clock::now();
+        xxx_data += size;
+        auto now = std::chrono::system_clock::now();
+        if (now - xxx_last_tp >= std::chrono::seconds(1))
+        {
+            float r = std::chrono::duration<float>(now - xxx_last_tp).count();
+            LOGI("Received: {} KB/s", float(xxx_data) / r / 1024.f);
+            xxx_data = 0;
+            xxx_last_tp = now;
+        }
+    }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Comms::process_rx_packet(PCap& pcap)
+{
+    struct pcap_pkthdr* pcap_packet_header = nullptr;
+
+    while (true)
+    {
+        uint8_t const* data = nullptr;
+        {
+            std::lock_guard<std::mutex> lg(pcap.mutex);
+            int retval = pcap_next_ex(pcap.pcap, &pcap_packet_header, (const u_char**)&data);
+            if (retval < 0)
+            {
+                LOGE("Socket broken: {}", pcap_geterr(pcap.pcap));
+                return false;
+            }
+            if (retval != 1)
+                break;
+        }
+        pcap.rx_frame_count++;
+
+        if (pcap.capture)
+            pcap.capture->write(data, pcap_packet_header->caplen, pcap_packet_header->ts.tv_sec, pcap_packet_header->ts.tv_usec);
+
+        process_rx_frame(pcap, data, pcap_packet_header->len);
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Comms::process_rx_frame(PCap& pcap, uint8_t const* data, size_t size)
+{
+    uint8_t const* payload = nullptr;
+    size_t payload_size = 0;
+    if (!parse_rx_frame(pcap, data, size, payload, payload_size))
+        return;
+
+    std::unique_lock<std::mutex> lg(m_impl->rx.block_window_mutex);
+    store_rx_packet(pcap, payload, payload_size);
+
+    if (m_rx_descriptor.run_to_completion)
+        process_rx_blocks(lg);
+    else
+        signal_rx_event(m_impl->rx); //process() has work
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//Stores all the frames of the ready ring blocks, locking the block queue once per ring block
+bool Comms::process_rx_ring(PCap& pcap)
+{
+    RX& rx = m_impl->rx;
+    std::vector<Packet_Ring::Frame>& frames = pcap.ring_frames;
+
+    while (pcap.ring->acquire_block(frames))
+    {
+        pcap.rx_frame_count += frames.size();
+
+        if (pcap.capture)
+        {
+            for (Packet_Ring::Frame const& frame: frames)
+                pcap.capture->write(frame.data, frame.size, frame.ts_sec, frame.ts_nsec / 1000);
+        }
+
+        //parse outside the lock, then drop the frames that are not ours
+        size_t count = 0;
+        for (Packet_Ring::Frame const& frame: frames)
+        {
+            uint8_t const* payload = nullptr;
+            size_t payload_size = 0;
+            if (parse_rx_frame(pcap, frame.data, frame.size, payload, payload_size))
+                frames[count++] = { payload, payload_size };
+        }
+
+        if (count > 0)
+        {
+            std::unique_lock<std::mutex> lg(rx.block_window_mutex);
+            for (size_t i = 0; i < count; i++)
+                store_rx_packet(pcap, frames[i].data, frames[i].size);
+
+            if (m_rx_descriptor.run_to_completion)
+            {
+                pcap.ring->release_block(); //the payloads are copied, give the ring block back before decoding anything
+                process_rx_blocks(lg);
+            }
+            else
+                signal_rx_event(rx); //process() has work
+        }
+
+        pcap.ring->release_block();
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Comms::prepare_pcap(std::string const& interface, PCap& pcap)
+{
+    LOGI("Opening interface {} in monitor mode", interface);
+
+    pcap.pcap = pcap_create(interface.c_str(), pcap.error_buffer);
+    if (pcap.pcap == nullptr)
+    {
+        LOGE("Unable to open interface {}: {}", interface, pcap_geterr(pcap.pcap));
+        return false;
+    }
+    if (pcap_set_snaplen(pcap.pcap, 1800) < 0)
+    {
+        LOGE("Error setting pcap_set_snaplen: {}", pcap_geterr(pcap.pcap));
+        return false;
+    }
+    if (pcap_set_promisc(pcap.pcap, 1) < 0)
+    {
         LOGE("Error setting pcap_set_promisc: {}", pcap_geterr(pcap.pcap));
         return false;
     }
@@ -656,9 +1436,89 @@ bool Comms::prepare_pcap(std::string const& interface, PCap& pcap)
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
+bool Comms::prepare_pcap_file(std::string const& path, PCap& pcap)
+{
+    LOGI("Opening capture {}", path);
+
+    pcap.pcap = pcap_open_offline(path.c_str(), pcap.error_buffer);
+    if (pcap.pcap == nullptr)
+    {
+        LOGE("Unable to open capture {}: {}", path, pcap.error_buffer);
+        return false;
+    }
+    pcap.is_file = true;
+
+    //same filter as the live interfaces, so the replay sees exactly the frames they would
+    if (!prepare_filter(pcap))
+        return false;
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//Not fatal, the interface just isn't captured
+void Comms::prepare_capture(PCap& pcap)
+{
+    char date[32];
+    time_t t = time(nullptr);
+    tm local_tm;
+    strftime(date, sizeof(date), "%Y%m%d_%H%M%S", localtime_r(&t, &local_tm));
+    std::string path = fmt::format("{}/{}_{}.pcap", m_rx_descriptor.capture_dir, pcap.interface, date);
+
+    std::unique_ptr<Capture_Writer> capture(new Capture_Writer);
+    if (!capture->init(path, pcap_datalink(pcap.pcap), Capture_Writer::Descriptor()))
+    {
+        LOGW("Cannot capture {}", pcap.interface);
+        return;
+    }
+    pcap.capture = std::move(capture);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Comms::prepare_ring(PCap& pcap)
+{
+    struct bpf_program program;
+    if (pcap_compile(pcap.pcap, &program, pcap.filter_src.c_str(), 1, 0) == -1)
+    {
+        LOGE("Failed to compile program: {} : {}", pcap.filter_src, pcap_geterr(pcap.pcap));
+        return false;
+    }
+
+    //the classic BPF program built by pcap has the same layout as the kernel one
+    static_assert(sizeof(bpf_insn) == sizeof(sock_filter), "BPF layout mismatch");
+    sock_fprog filter;
+    filter.len = static_cast<unsigned short>(program.bf_len);
+    filter.filter = reinterpret_cast<sock_filter*>(program.bf_insns);
+
+    std::unique_ptr<Packet_Ring> ring(new Packet_Ring);
+    bool ok = ring->init(pcap.interface, Packet_Ring::Descriptor(), &filter);
+    pcap_freecode(&program);
+    if (!ok)
+        return false;
+
+    //the pcap socket stays open for the TX, make it drop everything so the kernel doesn't queue a second copy of each frame
+    if (pcap_compile(pcap.pcap, &program, "less 1", 1, 0) == -1 || pcap_setfilter(pcap.pcap, &program) == -1)
+        LOGW("Cannot disable the pcap RX on {}: {}", pcap.interface, pcap_geterr(pcap.pcap));
+    pcap_freecode(&program);
+
+    pcap.ring = std::move(ring);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool is_file_interface(std::string const& interface)
+{
+    return interface.compare(0, 5, "file:") == 0;
+}
+
 bool Comms::init(RX_Descriptor const& rx_descriptor, TX_Descriptor const& tx_descriptor)
 {
-    if (tx_descriptor.interface.empty())
+    //a replay only needs the RX
+    bool has_tx = !tx_descriptor.interface.empty() && !is_file_interface(tx_descriptor.interface);
+    if (!has_tx && std::none_of(rx_descriptor.interfaces.begin(), rx_descriptor.interfaces.end(), is_file_interface))
     {
         LOGE("Invalid TX interface");
         return false;
@@ -669,19 +1529,26 @@ bool Comms::init(RX_Descriptor const& rx_descriptor, TX_Descriptor const& tx_des
     m_tx_descriptor = tx_descriptor;
     m_tx_descriptor.mtu = std::min(tx_descriptor.mtu, MAX_USER_PACKET_SIZE);
 
-    if (m_tx_descriptor.coding_k == 0 || 
-        m_tx_descriptor.coding_n < m_tx_descriptor.coding_k || 
-        m_tx_descriptor.coding_k > m_impl->tx.fec_src_packet_ptrs.size() || 
-        m_tx_descriptor.coding_n > m_impl->tx.fec_dst_packet_ptrs.size())
-    {
-        LOGE("Invalid coding params: {} / {}", m_tx_descriptor.coding_k, m_tx_descriptor.coding_n);
+    if (!check_coding_params(m_tx_descriptor.codec, m_tx_descriptor.coding_k, m_tx_descriptor.coding_n, m_tx_descriptor.mtu))
         return false;
-    }
 
-    if (m_impl->tx.fec)
-        fec_free(m_impl->tx.fec);
-
-    m_impl->tx.fec = fec_new(m_tx_descriptor.coding_k, m_tx_descriptor.coding_n);
+    if (m_tx_descriptor.codec == Fec_Codec::Codec::FFT)
+    {
+        m_impl->tx.fec_fft = fec_fft_new(m_tx_descriptor.coding_k, m_tx_descriptor.coding_n);
+        if (!m_impl->tx.fec_fft)
+        {
+            LOGE("Out of memory for the TX fec code");
+            return false;
+        }
+        m_impl->tx.fec_src_packet_ptrs.resize(m_tx_descriptor.coding_k);
+    }
+    else
+    {
+        m_impl->tx.fec = fec_new(m_tx_descriptor.coding_k, m_tx_descriptor.coding_n);
+        m_impl->tx.fec_code_encode_add = fec_code_get_encode_add(m_tx_descriptor.coding_k, m_tx_descriptor.coding_n);
+    }
+    m_impl->tx.fec_dst_packet_ptrs.resize(m_tx_descriptor.coding_n - m_tx_descriptor.coding_k);
+    LOGI("FEC kernel: {}", fec_get_kernel_name());
 
     /////////
     
@@ -694,19 +1561,20 @@ bool Comms::init(RX_Descriptor const& rx_descriptor, TX_Descriptor const& tx_des
     m_rx_descriptor = rx_descriptor;
     m_rx_descriptor.mtu = std::min(rx_descriptor.mtu, MAX_USER_PACKET_SIZE);
 
-    if (m_rx_descriptor.coding_k == 0 || 
-        m_rx_descriptor.coding_n < m_rx_descriptor.coding_k || 
-        m_rx_descriptor.coding_k > m_impl->rx.fec_src_packet_ptrs.size() || 
-        m_rx_descriptor.coding_n > m_impl->rx.fec_dst_packet_ptrs.size())
-    {
-        LOGE("Invalid coding params: {} / {}", m_rx_descriptor.coding_k, m_rx_descriptor.coding_n);
+    if (!check_coding_params(m_rx_descriptor.codec, m_rx_descriptor.coding_k, m_rx_descriptor.coding_n, m_rx_descriptor.mtu))
         return false;
-    }
-
-    if (m_impl->rx.fec)
-        fec_free(m_impl->rx.fec);
 
-    m_impl->rx.fec = fec_new(m_rx_descriptor.coding_k, m_rx_descriptor.coding_n);
+    if (m_rx_descriptor.codec == Fec_Codec::Codec::FFT)
+    {
+        m_impl->rx.fec_fft = fec_fft_new(m_rx_descriptor.coding_k, m_rx_descriptor.coding_n);
+        if (!m_impl->rx.fec_fft)
+        {
+            LOGE("Out of memory for the RX fec code");
+            return false;
+        }
+    }
+    else
+        m_impl->rx.fec = fec_new(m_rx_descriptor.coding_k, m_rx_descriptor.coding_n);
 
     /////////
 
@@ -725,6 +1593,7 @@ bool Comms::init(RX_Descriptor const& rx_descriptor, TX_Descriptor const& tx_des
     m_impl->rx.transport_packet_size = m_payload_offset + m_rx_descriptor.mtu;
     m_impl->rx.streaming_packet_size = m_impl->rx.transport_packet_size - m_impl->tx_packet_header_length;
     m_impl->rx.payload_size = m_rx_descriptor.mtu;
+    m_impl->rx.zero_packet.assign(m_impl->rx.payload_size, 0);
 
     m_impl->tx.transport_packet_size = m_payload_offset + m_tx_descriptor.mtu;
     m_impl->tx.streaming_packet_size = m_impl->tx.transport_packet_size - m_impl->tx_packet_header_length;
@@ -732,39 +1601,37 @@ bool Comms::init(RX_Descriptor const& rx_descriptor, TX_Descriptor const& tx_des
 
     /////////////////////
 
-    m_impl->tx.packet_pool.on_acquire = [this](TX::Packet& packet) 
-    {
-        if (packet.data.empty())
-        {
-            packet.data.resize(m_payload_offset);
-            prepare_tx_packet_header(packet.data.data());
-        }
-        else
-            packet.data.resize(m_payload_offset);
-    };
+    m_impl->tx.packet_header.resize(m_payload_offset);
+    prepare_tx_packet_header(m_impl->tx.packet_header.data());
+
+    for (RX::Block& block: m_impl->rx.block_window)
+        block.packets.resize(m_rx_descriptor.coding_n);
 
-    m_impl->rx.packet_pool.on_acquire = [this](RX::Packet& packet) 
+    //allocate the working set now rather than on the first packets: the whole receive window and a few TX blocks
+    size_t rx_packet_capacity = m_impl->rx.transport_packet_size;
+    m_impl->rx.packet_pool.prewarm(RX::BLOCK_WINDOW_SIZE * m_rx_descriptor.coding_n, [rx_packet_capacity](RX::Packet& packet)
     {
-        packet.index = 0;
-        packet.is_processed = false;
-        packet.data.clear();
-        packet.data.reserve(m_impl->rx.transport_packet_size);
-    };
-    m_impl->rx.block_pool.on_acquire = [this](RX::Block& block) 
+        packet.data.reserve(rx_packet_capacity);
+    });
+    size_t tx_packet_capacity = m_impl->tx.transport_packet_size;
+    m_impl->tx.packet_pool.prewarm(4 * m_tx_descriptor.coding_n, [tx_packet_capacity](TX::Packet& packet)
     {
-        block.index = 0;
+        packet.data.reserve(tx_packet_capacity);
+    });
 
-        block.packets.clear();
-        block.packets.reserve(m_rx_descriptor.coding_k);
+    if (!m_impl->tx.packet_queue.init(TX::PACKET_QUEUE_CAPACITY, true) ||
+        !m_impl->rx.ready_packet_queue.init(RX::READY_PACKET_QUEUE_CAPACITY, false))
+    {
+        LOGE("Unable to create the packet queues: {}", strerror(errno));
+        return false;
+    }
 
-        block.fec_packets.clear();
-        block.fec_packets.reserve(m_rx_descriptor.coding_n - m_rx_descriptor.coding_k);
-    };
-    m_impl->rx.block_pool.on_release = [this](RX::Block& block) 
+    m_impl->rx.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_impl->rx.event_fd < 0)
     {
-        block.packets.clear();
-        block.fec_packets.clear();
-    };
+        LOGE("Unable to create the RX eventfd: {}", strerror(errno));
+        return false;
+    }
 
     //    m_impl->pcap = pcap_open_live(m_interface.c_str(), 2048, 1, -1, pcap_error);
     //    if (m_impl->pcap == nullptr)
@@ -788,7 +1655,8 @@ bool Comms::init(RX_Descriptor const& rx_descriptor, TX_Descriptor const& tx_des
     std::set<std::string> interfaces;
     for (auto i: m_rx_descriptor.interfaces)
         interfaces.insert(i);
-    interfaces.insert(m_tx_descriptor.interface);
+    if (has_tx)
+        interfaces.insert(m_tx_descriptor.interface);
 
     m_impl->rx.pcal_last_block_index.resize(interfaces.size());
     m_impl->rx.pcaps.resize(interfaces.size());
@@ -797,69 +1665,329 @@ bool Comms::init(RX_Descriptor const& rx_descriptor, TX_Descriptor const& tx_des
     for (auto& interf: interfaces)
     {
         m_impl->pcaps[index] = std::make_unique<PCap>();
-        if (!prepare_pcap(interf, *m_impl->pcaps[index]))
+        m_impl->pcaps[index]->interface = interf;
+        if (is_file_interface(interf))
+        {
+            if (!prepare_pcap_file(interf.substr(5), *m_impl->pcaps[index]))
+                return false;
+        }
+        else if (!prepare_pcap(interf, *m_impl->pcaps[index]))
             return false;
 
         m_impl->pcaps[index]->index = index;
 
+        bool is_rx = std::find(m_rx_descriptor.interfaces.begin(), m_rx_descriptor.interfaces.end(), interf) != m_rx_descriptor.interfaces.end();
+        if (is_rx && !m_impl->pcaps[index]->is_file && m_rx_descriptor.backend == RX_Descriptor::Backend::Packet_Ring && !prepare_ring(*m_impl->pcaps[index]))
+            LOGW("Cannot use the RX ring on {}, falling back to pcap", interf);
+
+        if (is_rx && !m_impl->pcaps[index]->is_file && !m_rx_descriptor.capture_dir.empty())
+            prepare_capture(*m_impl->pcaps[index]);
+
         if (m_tx_descriptor.interface == interf)
+        {
             m_impl->tx.pcap = m_impl->pcaps[index].get();
+            if (m_tx_descriptor.backend == TX_Descriptor::Backend::Packet_Socket)
+            {
+                std::unique_ptr<Packet_Injector> injector(new Packet_Injector);
+                if (injector->init(interf))
+                    m_impl->tx.injector = std::move(injector);
+                else
+                    LOGW("Cannot use a packet socket to inject on {}, falling back to pcap", interf);
+            }
+        }
+
+        for (size_t j = 0; j < m_rx_descriptor.interfaces.size(); j++)
+        {
+            if (m_rx_descriptor.interfaces[j] == interf)
+            {
+                m_impl->rx.pcaps[j] = m_impl->pcaps[index].get();
+                break;
+            }
+        }
+        index++;
+    }
+
+    if (has_tx)
+        m_impl->tx.thread = std::thread([this]() { tx_thread_proc(); });
+
+    //the captures are merged by a replay thread, the live interfaces are read as configured
+    size_t live_count = 0;
+    for (PCap* pcap: m_impl->rx.pcaps)
+        live_count += pcap->is_file ? 0 : 1;
+    if (live_count < m_impl->rx.pcaps.size())
+    {
+        m_impl->rx.is_replaying = true;
+        m_impl->rx.threads.push_back(std::thread([this]() { rx_replay_thread_proc(); }));
+    }
+    if (live_count > 0)
+    {
+        if (m_rx_descriptor.single_rx_thread)
+            m_impl->rx.threads.push_back(std::thread([this]() { rx_epoll_thread_proc(); }));
+        else
+        {
+            for (size_t i = 0; i < m_rx_descriptor.interfaces.size(); i++)
+                if (!m_impl->rx.pcaps[i]->is_file)
+                    m_impl->rx.threads.push_back(std::thread([this, i]() { rx_thread_proc(i); }));
+        }
+    }
+
+    m_impl->rx.fec_workers.resize(m_rx_descriptor.fec_worker_count);
+    for (size_t i = 0; i < m_impl->rx.fec_workers.size(); i++)
+    {
+        if (m_rx_descriptor.codec == Fec_Codec::Codec::FFT)
+        {
+            m_impl->rx.fec_workers[i].fec_fft = fec_fft_new(m_rx_descriptor.coding_k, m_rx_descriptor.coding_n);
+            if (!m_impl->rx.fec_workers[i].fec_fft)
+            {
+                LOGE("Out of memory for the fec code of worker {}", i);
+                return false;
+            }
+        }
+        else
+            m_impl->rx.fec_workers[i].fec = fec_new(m_rx_descriptor.coding_k, m_rx_descriptor.coding_n);
+        m_impl->rx.fec_workers[i].thread = std::thread([this, i]() { fec_worker_thread_proc(i); });
+    }
+
+#if defined RASPBERRY_PI_XXX
+    {
+        //        int policy = SCHED_OTHER;
+        //        struct sched_param param;
+        //        param.sched_priority = 0;
+        int policy = SCHED_FIFO;
+        struct sched_param param;
+        param.sched_priority = sched_get_priority_max(policy);
+        if (pthread_setschedparam(m_impl->tx.thread.native_handle(), policy, &param) != 0)
+            perror("Cannot set TX thread priority - using normal");
+        if (pthread_setschedparam(m_impl->rx.thread.native_handle(), policy, &param) != 0)
+            perror("Cannot set TX thread priority - using normal");
+    }
+#endif
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t get_thread_cpu_time_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+//frames/s and CPU time per frame of an RX thread, to compare the backends
+struct RX_Thread_Stats
+{
+    Clock::time_point tp = Clock::now();
+    uint64_t cpu_time_ns = get_thread_cpu_time_ns();
+    size_t frame_count = 0;
+
+    void update(std::string const& name, char const* backend, size_t crt_frame_count)
+    {
+        Clock::time_point now = Clock::now();
+        if (now - tp < std::chrono::seconds(10))
+            return;
+
+        uint64_t crt_cpu_time_ns = get_thread_cpu_time_ns();
+        size_t frames = crt_frame_count - frame_count;
+        float d = std::chrono::duration<float>(now - tp).count();
+        if (frames > 0)
+            LOGI("RX {} ({}): {} frames/s, {} us CPU/frame", name, backend, static_cast<size_t>(frames / d), (crt_cpu_time_ns - cpu_time_ns) / 1000.f / frames);
+
+        tp = now;
+        cpu_time_ns = crt_cpu_time_ns;
+        frame_count = crt_frame_count;
+    }
+};
+
+void Comms::rx_thread_proc(size_t index)
+{
+    RX& rx = m_impl->rx;
+    PCap& pcap = *rx.pcaps[index];
+
+    int fd = pcap.ring ? pcap.ring->get_fd() : pcap.rx_pcap_selectable_fd;
+
+    RX_Thread_Stats stats;
+    stats.frame_count = pcap.rx_frame_count;
+
+    while (!m_exit)
+    {
+        fd_set readset;
+        struct timeval to;
+
+        to.tv_sec = 0;
+        to.tv_usec = 30000;
+
+        FD_ZERO(&readset);
+        FD_SET(fd, &readset);
+
+        int n = select(fd + 1, &readset, nullptr, nullptr, &to);
+        if (n > 0 && FD_ISSET(fd, &readset))
+        {
+            if (pcap.ring)
+                process_rx_ring(pcap);
+            else
+                process_rx_packet(pcap);
+        }
+
+        stats.update(pcap.interface, pcap.ring ? "ring" : "pcap", pcap.rx_frame_count);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Comms::rx_epoll_thread_proc()
+{
+    RX& rx = m_impl->rx;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        LOGE("Cannot create the RX epoll: {}", strerror(errno));
+        return;
+    }
 
-        for (size_t j = 0; j < m_rx_descriptor.interfaces.size(); j++)
-        {
-            if (m_rx_descriptor.interfaces[j] == interf)
-            {
-                m_impl->rx.pcaps[j] = m_impl->pcaps[index].get();
-                break;
-            }
-        }
-        index++;
+    for (size_t i = 0; i < rx.pcaps.size(); i++)
+    {
+        PCap& pcap = *rx.pcaps[i];
+        if (pcap.is_file)
+            continue;
+
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = static_cast<uint32_t>(i);
+        int fd = pcap.ring ? pcap.ring->get_fd() : pcap.rx_pcap_selectable_fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            LOGE("Cannot epoll {}: {}", pcap.interface, strerror(errno));
     }
 
-    m_impl->tx.thread = std::thread([this]() { tx_thread_proc(); });
-    for (size_t i = 0; i < m_rx_descriptor.interfaces.size(); i++)
-        m_impl->rx.threads.push_back(std::thread([this, i]() { rx_thread_proc(i); }));
+    RX_Thread_Stats stats;
+    std::array<epoll_event, 8> events;
 
-#if defined RASPBERRY_PI_XXX
+    while (!m_exit)
     {
-        //        int policy = SCHED_OTHER;
-        //        struct sched_param param;
-        //        param.sched_priority = 0;
-        int policy = SCHED_FIFO;
-        struct sched_param param;
-        param.sched_priority = sched_get_priority_max(policy);
-        if (pthread_setschedparam(m_impl->tx.thread.native_handle(), policy, &param) != 0)
-            perror("Cannot set TX thread priority - using normal");
-        if (pthread_setschedparam(m_impl->rx.thread.native_handle(), policy, &param) != 0)
-            perror("Cannot set TX thread priority - using normal");
+        int n = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), 30);
+        for (int i = 0; i < n; i++)
+        {
+            PCap& pcap = *rx.pcaps[events[i].data.u32];
+            if (pcap.ring)
+                process_rx_ring(pcap);
+            else
+                process_rx_packet(pcap);
+        }
+
+        size_t frame_count = 0;
+        bool has_ring = false;
+        for (PCap* pcap: rx.pcaps)
+        {
+            if (pcap->is_file)
+                continue;
+            frame_count += pcap->rx_frame_count;
+            has_ring |= pcap->ring != nullptr;
+        }
+        stats.update("all", has_ring ? "ring, epoll" : "pcap, epoll", frame_count);
     }
-#endif
 
-    return true;
+    close(epoll_fd);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
-void Comms::rx_thread_proc(size_t index)
+//with a fast replay, the reader waits while this many blocks are pending. It's below the count that makes 
+//  process_rx_blocks give up on the front block, so the replay measures the RX path instead of dropping blocks
+static constexpr uint32_t MAX_REPLAY_BLOCK_COUNT = 3;
+
+//Replays the captures of the file: interfaces merged in timestamp order, the way the adapters received them
+void Comms::rx_replay_thread_proc()
 {
     RX& rx = m_impl->rx;
-    PCap& pcap = *rx.pcaps[index];
+
+    struct Cursor
+    {
+        PCap* pcap = nullptr;
+        struct pcap_pkthdr* header = nullptr; //the next frame, nullptr once the capture is done
+        uint8_t const* data = nullptr;
+        int64_t ts_us = 0;
+    };
+    auto advance = [](Cursor& cursor)
+    {
+        int retval = pcap_next_ex(cursor.pcap->pcap, &cursor.header, (const u_char**)&cursor.data);
+        if (retval != 1)
+        {
+            if (retval != PCAP_ERROR_BREAK) //otherwise it's the end of the capture
+                LOGE("Error reading capture {}: {}", cursor.pcap->interface, pcap_geterr(cursor.pcap->pcap));
+            cursor.header = nullptr;
+            return;
+        }
+        cursor.ts_us = static_cast<int64_t>(cursor.header->ts.tv_sec) * 1000000 + cursor.header->ts.tv_usec;
+    };
+
+    std::vector<Cursor> cursors;
+    for (PCap* pcap: rx.pcaps)
+    {
+        if (!pcap->is_file)
+            continue;
+        cursors.emplace_back();
+        cursors.back().pcap = pcap;
+        advance(cursors.back());
+    }
+
+    RX_Thread_Stats stats;
+    Clock::time_point start_tp = Clock::now();
+    size_t frame_count = 0;
+    bool has_base = false;
+    int64_t base_ts_us = 0; //capture timestamp of the first frame, replayed at start_tp
 
     while (!m_exit)
     {
-        fd_set readset;
-        struct timeval to;
+        Cursor* cursor = nullptr;
+        for (Cursor& c: cursors)
+            if (c.header && (!cursor || c.ts_us < cursor->ts_us))
+                cursor = &c;
+        if (!cursor)
+            break; //all the captures are done
+
+        if (!has_base)
+        {
+            has_base = true;
+            base_ts_us = cursor->ts_us;
+        }
 
-        to.tv_sec = 0;
-        to.tv_usec = 30000;
+        if (m_rx_descriptor.replay_realtime)
+            std::this_thread::sleep_until(start_tp + std::chrono::microseconds(cursor->ts_us - base_ts_us));
+        else
+        {
+            //wait for process() to catch up
+            while (!m_exit)
+            {
+                {
+                    std::lock_guard<std::mutex> lg(rx.block_window_mutex);
+                    if (rx.block_count < MAX_REPLAY_BLOCK_COUNT)
+                        break;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
 
-        FD_ZERO(&readset);
-        FD_SET(pcap.rx_pcap_selectable_fd, &readset);
+        PCap& pcap = *cursor->pcap;
+        pcap.rx_frame_count++;
+        frame_count++;
 
-        int n = select(30, &readset, nullptr, nullptr, &to);
-        if (n != 0 && FD_ISSET(pcap.rx_pcap_selectable_fd, &readset))
-            process_rx_packet(pcap);
+        //only caplen bytes were saved
+        process_rx_frame(pcap, cursor->data, cursor->header->caplen);
+        advance(*cursor);
+
+        stats.update("replay", "file", frame_count);
     }
+
+    float d = std::chrono::duration<float>(Clock::now() - start_tp).count();
+    for (Cursor const& c: cursors)
+        LOGI("Replayed {}: {} frames", c.pcap->interface, c.pcap->rx_frame_count);
+    LOGI("Replay done: {} frames in {}s, {} frames/s", frame_count, d, static_cast<size_t>(frame_count / std::max(d, 0.001f)));
+
+    rx.is_replaying = false;
+    signal_rx_event(rx);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
@@ -871,7 +1999,7 @@ void Comms::tx_thread_proc()
     uint32_t coding_n = m_tx_descriptor.coding_n;
 
 #if 0 //TEST THROUGHPUT
-     TX::Packet_ptr packet = tx.packet_pool.acquire();
+     TX::Packet_ptr packet = acquire_tx_packet(tx);
 
      size_t s = std::min(8192u, m_transport_packet_size - packet->data.size());
      size_t offset = packet->data.size();
@@ -921,68 +2049,91 @@ void Comms::tx_thread_proc()
 
     while (!m_exit)
     {
+        TX::Packet_ptr packet;
+        if (!tx.packet_queue.pop(packet))
         {
             //wait for data
-            std::unique_lock<std::mutex> lg(tx.packet_queue_mutex);
-            if (tx.packet_queue.empty())
-                tx.packet_queue_cv.wait(lg, [this, &tx] { return tx.packet_queue.empty() == false || m_exit == true; });
+            tx.packet_queue.wait();
 
             if (m_exit)
                 break;
 
-            TX::Packet_ptr packet;
-            if (!tx.packet_queue.empty())
-            {
-                packet = tx.packet_queue.front();
-                tx.packet_queue.pop_front();
-            }
-
-            if (packet)
-            {
-                seal_packet(*packet, m_packet_header_offset, tx.last_block_index, tx.block_packets.size());
-                tx.ready_packet_queue.push_back(packet); //ready to send
-                tx.block_packets.push_back(packet);
-            }
+            tx.packet_queue.pop(packet);
         }
 
-        //compute fec packets
-        if (tx.block_packets.size() >= coding_k)
+        if (packet)
         {
-            if (1)
-            {
-                //auto start = Clock::now();
-
-                //init data for the fec_encode
-                for (size_t i = 0; i < coding_k; i++)
-                    tx.fec_src_packet_ptrs[i] = tx.block_packets[i]->data.data() + m_payload_offset;
+            bool last_in_block = tx.block_packet_count + 1 >= coding_k;
+            seal_packet(*packet, m_packet_header_offset, tx.last_block_index, tx.block_packet_count, last_in_block ? coding_k : 0);
+            tx.ready_packet_queue.push_back(packet); //ready to send
 
-                size_t fec_count = coding_n - coding_k;
+            size_t fec_count = coding_n - coding_k;
+            if (tx.block_packet_count == 0)
+            {
                 tx.block_fec_packets.resize(fec_count);
                 for (size_t i = 0; i < fec_count; i++)
                 {
-                    tx.block_fec_packets[i] = tx.packet_pool.acquire();
+                    tx.block_fec_packets[i] = acquire_tx_packet(tx);
                     tx.block_fec_packets[i]->data.resize(tx.transport_packet_size);
                     tx.fec_dst_packet_ptrs[i] = tx.block_fec_packets[i]->data.data() + m_payload_offset;
                 }
+            }
 
-                //encode
-                fec_encode(tx.fec, tx.fec_src_packet_ptrs.data(), tx.fec_dst_packet_ptrs.data(), BLOCK_NUMS + coding_k, coding_n - coding_k, tx.payload_size);
+            if (tx.fec_fft)
+                tx.block_packets.push_back(packet); //encoded when the block is complete
+            else
+            {
+                //fold the packet into the fec packets right away so they are ready as soon as the block is complete
+                if (tx.fec_code_encode_add)
+                    tx.fec_code_encode_add(packet->data.data() + m_payload_offset, tx.block_packet_count, tx.fec_dst_packet_ptrs.data(), tx.payload_size);
+                else
+                    fec_encode_add(tx.fec, packet->data.data() + m_payload_offset, tx.block_packet_count, tx.fec_dst_packet_ptrs.data(), BLOCK_NUMS + coding_k, fec_count, tx.payload_size);
+            }
+            tx.block_packet_count++;
+        }
 
-                //seal the result
-                for (size_t i = 0; i < fec_count; i++)
+        //send the fec packets
+        if (tx.block_packet_count >= coding_k)
+        {
+            size_t fec_count = coding_n - coding_k;
+            if (tx.fec_fft)
+            {
+                for (size_t i = 0; i < coding_k; i++)
+                    tx.fec_src_packet_ptrs[i] = tx.block_packets[i]->data.data() + m_payload_offset;
+                if (fec_fft_encode(tx.fec_fft, tx.fec_src_packet_ptrs.data(), tx.fec_dst_packet_ptrs.data(), tx.payload_size) != 0)
                 {
-                    seal_packet(*tx.block_fec_packets[i], m_packet_header_offset, tx.last_block_index, coding_k + i);
-                    tx.ready_packet_queue.push_back(tx.block_fec_packets[i]); //ready to send
+                    LOGE("Fec encoding failed, out of memory");
+                    fec_count = 0; //better no fec packets than garbage ones
                 }
+                tx.block_packets.clear();
+            }
 
-                //LOGI("Encoded fec: {}", Clock::now() - start);
+            for (size_t i = 0; i < fec_count; i++)
+            {
+                seal_packet(*tx.block_fec_packets[i], m_packet_header_offset, tx.last_block_index, coding_k + i, coding_k);
+                tx.ready_packet_queue.push_back(tx.block_fec_packets[i]); //ready to send
             }
 
-            tx.block_packets.clear();
+            tx.block_packet_count = 0;
             tx.block_fec_packets.clear();
             tx.last_block_index++;
         }
 
+        if (tx.injector && !tx.ready_packet_queue.empty())
+        {
+            //more packets are queued already? Take them first so a whole block (data and fec) goes out in one batch
+            if (tx.ready_packet_queue.size() < MAX_TX_BATCH_SIZE && !tx.packet_queue.empty())
+                continue;
+
+            //everything that is ready in one syscall. The socket is not the pcap one, so no need for its mutex
+            tx.inject_buffers.clear();
+            for (TX::Packet_ptr const& packet: tx.ready_packet_queue)
+                tx.inject_buffers.push_back({ packet->data.data(), packet->data.size() });
+
+            tx.injector->inject(tx.inject_buffers.data(), tx.inject_buffers.size());
+            tx.ready_packet_queue.clear();
+        }
+
         while (!tx.ready_packet_queue.empty())
         {
             TX::Packet_ptr packet = tx.ready_packet_queue.front();
@@ -1042,6 +2193,8 @@ void Comms::tx_thread_proc()
 void Comms::send(void const* _data, size_t size, bool flush)
 {
     TX& tx = m_impl->tx;
+    if (!tx.pcap) //replaying, no TX interface
+        return;
 
     TX::Packet_ptr& packet = tx.crt_packet;
 
@@ -1050,7 +2203,7 @@ void Comms::send(void const* _data, size_t size, bool flush)
     while (size > 0)
     {
         if (!packet)
-            packet = tx.packet_pool.acquire();
+            packet = acquire_tx_packet(tx);
 
         size_t s = std::min(size, tx.transport_packet_size - packet->data.size());
         size_t offset = packet->data.size();
@@ -1065,13 +2218,9 @@ void Comms::send(void const* _data, size_t size, bool flush)
                 packet->data.resize(tx.transport_packet_size);
 
             //send the current packet
-            {
-                std::unique_lock<std::mutex> lg(tx.packet_queue_mutex);
-                tx.packet_queue.push_back(packet);
-            }
-            packet = tx.packet_pool.acquire();
-
-            tx.packet_queue_cv.notify_all();
+            if (!tx.packet_queue.push(std::move(packet)))
+                LOGW("TX queue full, dropping packet");
+            packet = acquire_tx_packet(tx);
         }
     }
 }
@@ -1095,121 +2244,120 @@ int Comms::get_input_dBm() const
 void Comms::process_rx_packets()
 {
     RX& rx = m_impl->rx;
-    uint32_t coding_k = m_rx_descriptor.coding_k;
-    uint32_t coding_n = m_rx_descriptor.coding_n;
 
-    std::unique_lock<std::mutex> lg(rx.block_queue_mutex);
+    std::unique_lock<std::mutex> lg(rx.block_window_mutex);
 
     if (Clock::now() - rx.last_packet_tp > m_rx_descriptor.reset_duration)
-        rx.next_block_index = 0;
-
-    while (!rx.block_queue.empty())
     {
-        RX::Block_ptr block = rx.block_queue.front();
+        //start over, but not while a block is decoding as it has to stay in its slot
+        bool is_decoding = false;
+        for (RX::Block const& block: rx.block_window)
+            is_decoding |= block.is_used && block.is_decoding;
+        if (!is_decoding)
+        {
+            for (RX::Block& block: rx.block_window)
+                if (block.is_used)
+                    release_block(rx, block);
+            rx.next_block_index = 0;
+        }
+    }
 
-        //try to process consecutive packets before the block is finished to minimize latency
-        for (size_t i = 0; i < block->packets.size(); i++)
+    process_rx_blocks(lg);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//Recovers and releases the blocks in order. Called by process() or, with run_to_completion, by the threads that 
+//  just stored packets or recovered a block.
+//NOTE: call with the block_window_mutex locked. It's unlocked while decoding
+void Comms::process_rx_blocks(std::unique_lock<std::mutex>& lg)
+{
+    RX& rx = m_impl->rx;
+    uint32_t coding_k = m_rx_descriptor.coding_k;
+    uint32_t coding_n = m_rx_descriptor.coding_n;
+
+    //hand the decodable blocks to the fec workers. They are dispatched below, in order, once decoded
+    if (!rx.fec_workers.empty())
+    {
+        for (uint32_t i = 0; i < RX::BLOCK_WINDOW_SIZE; i++)
         {
-            RX::Packet_ptr const& d = block->packets[i];
-            if (d->index == i)
+            RX::Block* block = find_block(rx, rx.next_block_index + i);
+            if (!block)
+                continue;
+
+            uint32_t block_k = block->data_packet_count > 0 ? block->data_packet_count : coding_k;
+            if (!block->is_decoding && 
+                !block->is_decoded &&
+                !block->is_decode_failed &&
+                block->packet_count < block_k && 
+                block->packet_count + block->fec_packet_count >= block_k)
             {
-                if (!d->is_processed)
+                RX::Fec_Job job;
+                prepare_fec_job(rx, *block, coding_k, coding_n, job);
                 {
-                    //LOGI("Packet {}", block->index * coding_k + d->index);
-                    m_data_stats_data_accumulated += d->data.size();
-                    {
-                        std::lock_guard<std::mutex> lg2(rx.ready_packet_queue_mutex);   
-                        rx.ready_packet_queue.push_back(d);
-                    }
-                    rx.last_packet_tp = Clock::now();
-                    d->is_processed = true;
+                    std::lock_guard<std::mutex> lg2(rx.fec_job_queue_mutex);
+                    rx.fec_job_queue.push_back(std::move(job));
                 }
+                rx.fec_job_queue_cv.notify_one();
             }
-            else
-                break;
         }
+    }
 
-        //entire block received
-        if (block->packets.size() >= coding_k)
+    bool is_ready_queue_full = false;
+    size_t released_count = 0;
+    while (RX::Block* block = get_front_block(rx))
+    {
+        //closed blocks have fewer data packets
+        uint32_t block_k = block->data_packet_count > 0 ? block->data_packet_count : coding_k;
+
+        //try to process consecutive packets before the block is finished to minimize latency
+        while (block->processed_count < block_k && block->present[block->processed_count])
         {
-            //sanity check - this should not happen
-            for (size_t i = 0; i < block->packets.size(); i++)
+            RX::Packet_ptr const& d = block->packets[block->processed_count];
+            //LOGI("Packet {}", block->index * coding_k + d->index);
+            if (!release_packet(rx, d))
             {
-                RX::Packet_ptr const& d = block->packets[i];
-                if (!d->is_processed)
-                    LOGI("Skipping {}!!!", block->index * coding_k + d->index);
+                is_ready_queue_full = true; //receive() is behind, leave the rest in the block for now
+                break;
             }
+            m_data_stats_data_accumulated += d->data.size();
+            released_count++;
+            block->processed_count++;
+        }
 
+        //entire block received
+        if (block->processed_count >= block_k)
+        {
             rx.last_block_tp = Clock::now();
             rx.next_block_index = block->index + 1;
-            rx.block_queue.pop_front();
+            release_block(rx, *block);
             continue; //next packet
         }
 
+        if (is_ready_queue_full)
+            break;
+
+        //being recovered by a fec worker. Wait for it so the packets are released in order
+        if (block->is_decoding)
+            break;
+
         //can we fec decode?
-        if (block->packets.size() + block->fec_packets.size() >= coding_k)
+        if (!block->is_decode_failed && block->packet_count + block->fec_packet_count >= block_k)
         {
             //auto start = Clock::now();
 
-            std::array<unsigned int, 32> indices;
-            size_t primary_index = 0;
-            size_t used_fec_index = 0;
-            for (size_t i = 0; i < coding_k; i++)
-            {
-                if (primary_index < block->packets.size() && i == block->packets[primary_index]->index)
-                {
-                    rx.fec_src_packet_ptrs[i] = block->packets[primary_index]->data.data();
-                    indices[i] = block->packets[primary_index]->index;
-                    primary_index++;
-                }
-                else
-                {
-                    rx.fec_src_packet_ptrs[i] = block->fec_packets[used_fec_index]->data.data();
-                    indices[i] = block->fec_packets[used_fec_index]->index;
-                    used_fec_index++;
-                }
-            }
-
-            //insert the missing packets, they will be filled with data by the fec_decode below
-            size_t fec_index = 0;
-            for (size_t i = 0; i < coding_k; i++)
-            {
-                if (i >= block->packets.size() || i != block->packets[i]->index)
-                {
-                    block->packets.insert(block->packets.begin() + i, rx.packet_pool.acquire());
-                    block->packets[i]->data.resize(rx.payload_size);
-                    block->packets[i]->index = i;
-                    rx.fec_dst_packet_ptrs[fec_index++] = block->packets[i]->data.data();
-                }
-            }
+            RX::Fec_Job job;
+            prepare_fec_job(rx, *block, coding_k, coding_n, job);
 
             lg.unlock(); //not need to hold the mutex locked - give the rx_proc a chance to get its data in
-            fec_decode(rx.fec, rx.fec_src_packet_ptrs.data(), rx.fec_dst_packet_ptrs.data(), indices.data(), rx.payload_size);
+            bool is_decoded = decode_fec_job(rx.fec, rx.fec_fft, coding_k, rx.payload_size, job);
             lg.lock(); //relock the mutex
 
-            //now dispatch them
-            for (size_t i = 0; i < block->packets.size(); i++)
-            {
-                RX::Packet_ptr const& d = block->packets[i];
-                if (!d->is_processed)
-                {
-                    //LOGI("Packet F {}", block->index * coding_k + d->index);
-                    m_data_stats_data_accumulated += d->data.size();
-                    {
-                        std::lock_guard<std::mutex> lg2(rx.ready_packet_queue_mutex);   
-                        rx.ready_packet_queue.push_back(d);
-                    }
-                    rx.last_packet_tp = Clock::now();
-                    d->is_processed = true;
-                }
-            }
+            finish_fec_job(rx, job, coding_k, is_decoded);
 
             //LOGI("Decoded fac: {}", Clock::now() - start);
 
-            rx.last_block_tp = Clock::now();
-            rx.next_block_index = block->index + 1;
-            rx.block_queue.pop_front();
-            continue; //next packet
+            continue; //the block is complete now, it will be dispatched above
         }
 
         //calculate what is the earliest block index received
@@ -1217,51 +2365,191 @@ void Comms::process_rx_packets()
         for (uint32_t index: rx.pcal_last_block_index)
             earliest_block_index = std::min(earliest_block_index, index);
 
-        //skip if too much buffering
-        bool skipped_blocks = false;
-        while ((rx.block_queue.size() > 0 && rx.block_queue.front()->index < earliest_block_index) || //if all interfaces received blocks bigger that the first in the queue
-            rx.block_queue.size() > 3) //or if queueing too much
+        //give up on the block and move on
+        if (block->is_decode_failed || //if its packets cannot be recovered
+            block->index < earliest_block_index || //if all interfaces received blocks bigger that the first in the queue
+            rx.block_count > 3 || //or if queueing too much
+            Clock::now() - block->first_packet_tp >= m_rx_descriptor.max_latency) //or if it's past its deadline, so a straggling interface cannot stall the video
         {
-            // if (rx.block_queue.front()->index < earliest_block_index)ˇ
+            // if (block->index < earliest_block_index)
             //     LOGI("Skipping stale packet: fast");
             // else
             //     LOGI("Skipping stale packet: slow");
 
-            for (size_t i = 0; i < block->packets.size(); i++)
+            //release the primary packets that did arrive, in order. The missing ones are lost
+            for (; block->processed_count < block_k; block->processed_count++)
             {
-                RX::Packet_ptr const& d = block->packets[i];
-                if (!d->is_processed)
-                    ;//LOGI("Skipping {}", block->index * coding_k + d->index);
+                if (!block->present[block->processed_count])
+                    continue;
+                RX::Packet_ptr const& d = block->packets[block->processed_count];
+                if (!release_packet(rx, d))
+                {
+                    is_ready_queue_full = true;
+                    break;
+                }
+                m_data_stats_data_accumulated += d->data.size();
+                released_count++;
             }
+            if (is_ready_queue_full)
+                break;
+
+            rx.skipped_block_count++;
             rx.next_block_index = block->index + 1;
-            rx.block_queue.pop_front();
-            skipped_blocks = true;
+            release_block(rx, *block);
+            continue; //the next block might be complete already
         }
 
         //nothing else to do - we cannot complete nor skip blocks - so wait for more data
-        if (!skipped_blocks)
-            break;
+        break;
+    }
+
+    //the thread calling receive() might be sleeping
+    if (released_count > 0)
+        signal_rx_event(rx);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Comms::fec_worker_thread_proc(size_t index)
+{
+    RX& rx = m_impl->rx;
+    RX::Fec_Worker& worker = rx.fec_workers[index];
+
+    while (!m_exit)
+    {
+        RX::Fec_Job job;
+        {
+            std::unique_lock<std::mutex> lg(rx.fec_job_queue_mutex);
+            rx.fec_job_queue_cv.wait(lg, [this, &rx] { return rx.fec_job_queue.empty() == false || m_exit == true; });
+            if (m_exit)
+                break;
+
+            job = std::move(rx.fec_job_queue.front());
+            rx.fec_job_queue.pop_front();
+        }
+
+        bool is_decoded = decode_fec_job(worker.fec, worker.fec_fft, m_rx_descriptor.coding_k, rx.payload_size, job);
+
+        std::unique_lock<std::mutex> lg(rx.block_window_mutex);
+        finish_fec_job(rx, job, m_rx_descriptor.coding_k, is_decoded);
+
+        //release the block right away instead of waiting for the next process()
+        if (m_rx_descriptor.run_to_completion)
+            process_rx_blocks(lg);
+        else
+            signal_rx_event(rx);
     }
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////
+
 bool Comms::receive(void* data, size_t& size)
 {
     RX& rx = m_impl->rx;
     
-    std::lock_guard<std::mutex> lg2(rx.ready_packet_queue_mutex);
-
-    if (rx.ready_packet_queue.empty())
+    RX::Packet_ptr d;
+    if (!rx.ready_packet_queue.pop(d))
         return false;
 
-    auto d = rx.ready_packet_queue.front();
+    rx.queue_latency.add(Clock::now() - d->release_tp);
+
     size = d->data.size();
     if (size > 0)
         memcpy(data, d->data.data(), d->data.size());
 
-    rx.ready_packet_queue.pop_front();
     return true;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Comms::wait(Clock::duration timeout)
+{
+    RX& rx = m_impl->rx;
+
+    //wake up in time to give up on the front block
+    {
+        std::lock_guard<std::mutex> lg(rx.block_window_mutex);
+        RX::Block* block = get_front_block(rx);
+        if (block && !block->is_decoding)
+            timeout = std::min(timeout, block->first_packet_tp + m_rx_descriptor.max_latency - Clock::now());
+    }
+    if (timeout <= Clock::duration::zero())
+        return;
+
+    rx.is_waiting.store(true);
+    if (!rx.has_events.exchange(false) && rx.ready_packet_queue.empty())
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+        timespec ts = { static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000) };
+        pollfd pfd = { rx.event_fd, POLLIN, 0 };
+        ppoll(&pfd, 1, &ts, nullptr);
+    }
+    rx.is_waiting.store(false);
+
+    uint64_t value;
+    while (read(rx.event_fd, &value, sizeof(value)) > 0) {}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+size_t Comms::receive_batch(std::vector<RX_Packet_ptr>& packets, size_t max_count)
+{
+    RX& rx = m_impl->rx;
+
+    packets.clear();
+
+    Clock::time_point now = Clock::now();
+    RX::Packet_ptr packet;
+    while (packets.size() < max_count && rx.ready_packet_queue.pop(packet))
+    {
+        rx.queue_latency.add(now - packet->release_tp);
+        packets.push_back(std::move(packet));
+    }
+
+    return packets.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+Comms::RX_Stats Comms::get_rx_stats() const
+{
+    RX_Stats stats;
+    if (!m_impl)
+        return stats;
+
+    RX const& rx = m_impl->rx;
+    stats.packet_count = rx.packet_count;
+    stats.released_packet_count = rx.released_packet_count;
+    stats.recovered_block_count = rx.recovered_block_count;
+    stats.recovered_packet_count = rx.recovered_packet_count;
+    stats.skipped_block_count = rx.skipped_block_count;
+    stats.salvaged_packet_count = rx.salvaged_packet_count;
+    stats.block_latency = rx.block_latency.get();
+    stats.decode_latency = rx.decode_latency.get();
+    stats.queue_latency = rx.queue_latency.get();
+    return stats;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<Comms::Interface_Stats> Comms::get_interface_stats() const
+{
+    if (!m_impl)
+        return {};
+
+    std::lock_guard<std::mutex> lg(m_impl->interface_stats_mutex);
+    return m_impl->interface_stats;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Comms::is_replaying() const
+{
+    return m_impl && m_impl->rx.is_replaying;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
 void Comms::process()
 {
     if (!m_impl)
@@ -1276,16 +2564,139 @@ void Comms::process()
     Clock::time_point now = Clock::now();
 
     RX& rx = m_impl->rx;
-    if (now - rx.last_block_tp > std::chrono::seconds(2))
+    Clock::time_point last_block_tp;
+    {
+        std::lock_guard<std::mutex> lg(rx.block_window_mutex); //the RX threads release the blocks with run_to_completion
+        last_block_tp = rx.last_block_tp;
+    }
+    if (now - last_block_tp > std::chrono::seconds(2))
         m_latched_input_dBm = 0;
 
     if (now - m_data_stats_last_tp >= std::chrono::seconds(1))
     {
         float d = std::chrono::duration<float>(now - m_data_stats_last_tp).count();
-        m_data_stats_rate = static_cast<size_t>(static_cast<float>(m_data_stats_data_accumulated) / d);
-        m_data_stats_data_accumulated = 0;
+        m_data_stats_rate = static_cast<size_t>(static_cast<float>(m_data_stats_data_accumulated.exchange(0)) / d);
         m_data_stats_last_tp = now;
+
+        std::vector<Interface_Stats> interface_stats;
+        for (PCap* pcap: rx.pcaps)
+        {
+            PCap::Stats_Accumulator& acc = pcap->stats;
+            Interface_Stats stats;
+            stats.interface = pcap->interface;
+            stats.packet_count = acc.packet_count.exchange(0);
+            stats.unique_count = acc.unique_count.exchange(0);
+            stats.duplicate_count = acc.duplicate_count.exchange(0);
+            stats.bad_fcs_count = acc.bad_fcs_count.exchange(0);
+
+            int min_input_dBm = acc.min_input_dBm.exchange(std::numeric_limits<int>::max());
+            int max_input_dBm = acc.max_input_dBm.exchange(std::numeric_limits<int>::lowest());
+            int64_t input_dBm_sum = acc.input_dBm_sum.exchange(0);
+            size_t input_dBm_count = acc.input_dBm_count.exchange(0);
+            if (input_dBm_count > 0 && min_input_dBm <= max_input_dBm)
+            {
+                stats.min_input_dBm = min_input_dBm;
+                stats.max_input_dBm = max_input_dBm;
+                stats.avg_input_dBm = static_cast<int>(input_dBm_sum / static_cast<int64_t>(input_dBm_count));
+            }
+
+            int64_t arrival_delta_ns_sum = acc.arrival_delta_ns_sum.exchange(0);
+            size_t arrival_delta_count = acc.arrival_delta_count.exchange(0);
+            stats.arrival_delta_count = arrival_delta_count;
+            if (arrival_delta_count > 0)
+                stats.avg_arrival_delta = std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds(arrival_delta_ns_sum / static_cast<int64_t>(arrival_delta_count)));
+
+            interface_stats.push_back(std::move(stats));
+        }
+
+        std::lock_guard<std::mutex> lg(m_impl->interface_stats_mutex);
+        m_impl->interface_stats = std::move(interface_stats);
+    }
+
+    if (now - m_impl->last_pool_stats_tp >= std::chrono::seconds(10))
+    {
+        //the pools should stop growing once the working set is allocated
+        auto rx_stats = rx.packet_pool.get_stats();
+        auto tx_stats = m_impl->tx.packet_pool.get_stats();
+        LOGI("Packet pools: RX {} allocated, {} new, {} reused, {} returned; TX {} allocated, {} new, {} reused, {} returned", 
+            rx_stats.allocated, rx_stats.new_count, rx_stats.reused_count, rx_stats.returned_count,
+            tx_stats.allocated, tx_stats.new_count, tx_stats.reused_count, tx_stats.returned_count);
+        m_impl->last_pool_stats_tp = now;
+
+        for (PCap* pcap: rx.pcaps)
+        {
+            if (!pcap->capture)
+                continue;
+            //the write cost is what the capture adds to the RX thread of the interface
+            Capture_Writer::Stats stats = pcap->capture->get_stats();
+            LOGI("Capture {}: {} frames, {} dropped, {} KB saved, {} ns/frame on the RX thread", 
+                pcap->interface, stats.frame_count, stats.dropped_count, stats.saved_size / 1024, 
+                stats.frame_count > 0 ? stats.write_ns / (stats.frame_count + stats.dropped_count) : 0);
+        }
     }
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+int Comms::radiotap_benchmark()
+{
+    //the header of an adapter reporting the signal of each antenna: tsft, flags, rate, channel, dBm, rx flags and 
+    //  a second bitmap with the dBm and index of the antenna
+    std::array<uint8_t, 36> header = {};
+    uint32_t present[2] = 
+    {
+        (1u << IEEE80211_RADIOTAP_TSFT) | (1u << IEEE80211_RADIOTAP_FLAGS) | (1u << IEEE80211_RADIOTAP_RATE) | 
+            (1u << IEEE80211_RADIOTAP_CHANNEL) | (1u << IEEE80211_RADIOTAP_DBM_ANTSIGNAL) | (1u << IEEE80211_RADIOTAP_RX_FLAGS) | 
+            (1u << IEEE80211_RADIOTAP_RADIOTAP_NAMESPACE) | (1u << IEEE80211_RADIOTAP_EXT),
+        (1u << IEEE80211_RADIOTAP_DBM_ANTSIGNAL) | (1u << IEEE80211_RADIOTAP_ANTENNA)
+    };
+    uint16_t length = static_cast<uint16_t>(header.size());
+    memcpy(header.data() + 2, &length, sizeof(length));
+    memcpy(header.data() + 4, present, sizeof(present));
+    header[24] = IEEE80211_RADIOTAP_F_FCS; //flags
+    header[25] = 12; //rate, 6Mbps
+    uint16_t channel[2] = { 2462, 0x00c0 };
+    memcpy(header.data() + 26, channel, sizeof(channel));
+    header[30] = static_cast<uint8_t>(-42); //dBm
+    header[34] = static_cast<uint8_t>(-45); //dBm of antenna 1
+    header[35] = 1;
+
+    constexpr size_t COUNT = 10000000;
+
+    //both paths have to read the same values
+    Radiotap_Layout layout;
+    Penumbra_Radiotap_Header iterator_prh, layout_prh;
+    if (!parse_radiotap_iterator(header.data(), header.size(), iterator_prh, &layout) || 
+        !parse_radiotap_layout(layout, header.data(), header.size(), layout_prh) ||
+        memcmp(&iterator_prh, &layout_prh, sizeof(Penumbra_Radiotap_Header)) != 0)
+    {
+        LOGE("Radiotap layout mismatch");
+        return -1;
+    }
+
+    int32_t sum = 0; //keeps the parsing from being optimized away
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        Penumbra_Radiotap_Header prh;
+        parse_radiotap_iterator(header.data(), header.size(), prh, nullptr);
+        sum += prh.input_dBm + prh.radiotap_flags;
+    }
+    Clock::duration iterator_d = Clock::now() - start;
+
+    start = Clock::now();
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        Penumbra_Radiotap_Header prh;
+        parse_radiotap_layout(layout, header.data(), header.size(), prh);
+        sum += prh.input_dBm + prh.radiotap_flags;
+    }
+    Clock::duration layout_d = Clock::now() - start;
+
+    float iterator_ns = std::chrono::duration<float, std::nano>(iterator_d).count() / COUNT;
+    float layout_ns = std::chrono::duration<float, std::nano>(layout_d).count() / COUNT;
+    LOGI("Radiotap parse: iterator {} ns/frame, learned layout {} ns/frame, {}x ({})", iterator_ns, layout_ns, iterator_ns / layout_ns, sum != 0);
+    return 0;
+}
@@ -4,10 +4,11 @@
 #include <string>
 #include <atomic>
 #include <thread>
+#include <mutex>
 #include <functional>
 #include "Clock.h"
-
-struct fec_t;
+#include "Pool.h"
+#include "fec_codec.h"
 
 class Comms
 {
@@ -18,6 +19,18 @@ public:
     struct TX_Descriptor
     {
         std::string interface;
+
+        //How the packets are injected:
+        //PCap - pcap_inject, one packet per call, under the mutex shared with the RX of the interface
+        //Packet_Socket - a separate AF_PACKET socket, all the ready packets in one sendmmsg. Falls back to pcap if the socket cannot be created
+        enum class Backend : uint8_t
+        {
+            PCap,
+            Packet_Socket
+        };
+        Backend backend = Backend::PCap;
+
+        Fec_Codec::Codec codec = Fec_Codec::Codec::Vandermonde;
         uint32_t coding_k = 12;
         uint32_t coding_n = 20;
         size_t mtu = 1200;
@@ -25,49 +38,168 @@ public:
 
     struct RX_Descriptor
     {
+        //The interfaces named file:<path> replay a pcap capture instead of a live adapter. The captures are merged in timestamp order
         std::vector<std::string> interfaces;
-        Clock::duration max_latency = std::chrono::milliseconds(500);
+        Clock::duration max_latency = std::chrono::milliseconds(500); //a block is released with whatever packets it has this long after its first packet arrived
         Clock::duration reset_duration = std::chrono::milliseconds(1000);
+        Fec_Codec::Codec codec = Fec_Codec::Codec::Vandermonde;
         uint32_t coding_k = 12;
         uint32_t coding_n = 20;
         size_t mtu = 1200;
+
+        //How the frames are read from the interfaces:
+        //PCap - pcap_next_ex, one frame per call
+        //Packet_Ring - a TPACKET_V3 mmap ring per interface, the frames are parsed in place one ring block at a time. Falls back to pcap if the ring cannot be created
+        enum class Backend : uint8_t
+        {
+            PCap,
+            Packet_Ring
+        };
+        Backend backend = Backend::PCap;
+
+        //false - one RX thread per interface, each waiting on its own fd
+        //true - a single RX thread epolls all the interfaces, so the packets of the adapters are merged without the threads contending on the block queue
+        bool single_rx_thread = false;
+
+        //0 - decode the fec blocks in process(), one at a time
+        //otherwise - decode them in parallel on this many worker threads. The packets are still released in block order
+        size_t fec_worker_count = 0;
+
+        //false - the RX threads only store the packets, process() recovers and releases the blocks
+        //true - the thread that completes a block (an RX thread or a fec worker) recovers and releases it right away, 
+        //  so the packets reach receive() without waiting for the next process()
+        bool run_to_completion = false;
+
+        //false - the frames with a bad FCS are dropped
+        //true - they are kept for a short while, and the bad copies of the same packet received by the adapters are combined 
+        //  (byte-wise vote of three copies, or every mix of two at the bytes where they differ) until a rebuild matches the FCS.
+        //  Needs adapters that deliver the bad frames with their FCS
+        bool salvage_bad_fcs = false;
+
+        //empty - off
+        //otherwise - every raw frame received on each live interface is saved to <capture_dir>/<interface>_<date>.pcap, by a 
+        //  writer thread per interface. The RX threads only copy the frames, a slow disk drops frames from the capture instead
+        std::string capture_dir;
+
+        //true - the captures of the file: interfaces are replayed at their recorded timestamps
+        //false - as fast as the RX path takes them, in the same order
+        bool replay_realtime = true;
     };
 
     bool init(RX_Descriptor const& rx_descriptor, TX_Descriptor const& tx_descriptor);
 
     void process();
 
+    //Sleeps until there is work for process() or receive(): packets were received or released, or the front block
+    //  reached its deadline. Returns after the timeout otherwise
+    void wait(Clock::duration timeout);
+
     void send(void const* data, size_t size, bool flush);
     //std::function<void(void const* data, size_t size)> on_data_received;
     bool receive(void* data, size_t& size);
 
+    //A received payload, shared with the block it came from. Release it (reset or destroy the pointer) once done.
+    //The data is read only, the block might still need it to recover other packets
+    struct RX_Packet
+    {
+        uint32_t index = 0;
+        std::vector<uint8_t> data;
+
+        Clock::time_point rx_tp; //stored in its block, or recovered
+        Clock::time_point release_tp; //released to receive()
+    };
+    using RX_Packet_ptr = Pool<RX_Packet>::Ptr;
+
+    //Replaces the content of packets with up to max_count received packets, without copying their data.
+    //Returns the packet count
+    size_t receive_batch(std::vector<RX_Packet_ptr>& packets, size_t max_count);
+
     size_t get_data_rate() const;
     int get_input_dBm() const;
 
+    //RX totals since init
+    struct RX_Stats
+    {
+        size_t packet_count = 0; //unique packets stored, primary and fec
+        size_t released_packet_count = 0; //primary packets released to receive(), in order
+        size_t recovered_block_count = 0;
+        size_t recovered_packet_count = 0;
+        size_t skipped_block_count = 0; //given up before they were complete, their missing packets are lost
+        size_t salvaged_packet_count = 0; //rebuilt from bad FCS copies
+
+        struct Latency
+        {
+            Clock::duration avg = Clock::duration::zero();
+            Clock::duration max = Clock::duration::zero();
+        };
+        Latency block_latency; //a packet stored or recovered -> released in order
+        Latency decode_latency; //the fec recovery of a block
+        Latency queue_latency; //released -> taken by receive()
+    };
+    RX_Stats get_rx_stats() const;
+
+    //How each RX interface did over the last second, to compare the adapters and their antennas
+    struct Interface_Stats
+    {
+        std::string interface;
+        size_t packet_count = 0; //frames of ours with a good FCS
+        size_t unique_count = 0; //packets this interface delivered first
+        size_t duplicate_count = 0; //packets another interface delivered first, or that were not needed anymore
+        size_t bad_fcs_count = 0;
+
+        //0 if the adapter doesn't report the signal
+        int min_input_dBm = 0;
+        int avg_input_dBm = 0;
+        int max_input_dBm = 0;
+
+        //how long after the first copy this interface delivered its duplicates
+        Clock::duration avg_arrival_delta = Clock::duration::zero();
+        size_t arrival_delta_count = 0;
+    };
+    std::vector<Interface_Stats> get_interface_stats() const;
+
+    //true while the file: interfaces still have frames to replay
+    bool is_replaying() const;
+
     static std::vector<std::string> enumerate_interfaces();
 
+    //Times the parsing of a radiotap header with the iterator and with the learned layout. Returns 0 if both read the same fields
+    static int radiotap_benchmark();
+
     struct PCap;
     struct RX;
     struct TX;
 
 private:
     bool prepare_pcap(std::string const& interface, PCap& pcap);
+    bool prepare_pcap_file(std::string const& path, PCap& pcap);
 
     bool prepare_filter(PCap& pcap);
+    void prepare_capture(PCap& pcap);
+    bool prepare_ring(PCap& pcap);
     void prepare_radiotap_header(size_t rate_hz);
     void prepare_tx_packet_header(uint8_t* buffer);
+    bool parse_rx_frame(PCap& pcap, uint8_t const* data, size_t size, uint8_t const*& payload, size_t& payload_size);
+    void store_rx_packet(PCap& pcap, uint8_t const* payload, size_t size);
+    void salvage_rx_frame(PCap& pcap, uint8_t const* frame, size_t size);
+    void process_rx_frame(PCap& pcap, uint8_t const* data, size_t size);
     bool process_rx_packet(PCap& pcap);
+    bool process_rx_ring(PCap& pcap);
     void process_rx_packets();
+    void process_rx_blocks(std::unique_lock<std::mutex>& lg);
 
     void tx_thread_proc();
     void rx_thread_proc(size_t index);
+    void rx_epoll_thread_proc();
+    void rx_replay_thread_proc();
+    void fec_worker_thread_proc(size_t index);
 
     TX_Descriptor m_tx_descriptor;
     RX_Descriptor m_rx_descriptor;
 
     struct Impl;
     std::unique_ptr<Impl> m_impl;
-    bool m_exit = false;
+    std::atomic_bool m_exit = {false};
 
     size_t m_packet_header_offset = 0;
     size_t m_payload_offset = 0;
@@ -76,6 +208,6 @@ private:
     std::atomic_int m_latched_input_dBm = {0};
 
     size_t m_data_stats_rate = 0;
-    size_t m_data_stats_data_accumulated = 0;
+    std::atomic<size_t> m_data_stats_data_accumulated = {0};
     Clock::time_point m_data_stats_last_tp = Clock::now();
 };
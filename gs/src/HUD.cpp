@@ -1,6 +1,8 @@
 #include "HUD.h"
 #include "IHAL.h"
+#include "Comms.h"
 #include "imgui.h"
+#include <cstdio>
 
 static void AddShadowText(ImDrawList& drawList, const ImVec2& pos, ImU32 col, const char* text)
 {
@@ -8,8 +10,9 @@ static void AddShadowText(ImDrawList& drawList, const ImVec2& pos, ImU32 col, co
     drawList.AddText(pos, col, text);
 }
 
-HUD::HUD(IHAL& hal)
+HUD::HUD(IHAL& hal, Comms& comms)
     : m_hal(hal)
+    , m_comms(comms)
 {
 
 }
@@ -28,5 +31,32 @@ void HUD::draw()
                  ImGuiWindowFlags_NoScrollbar |
                  ImGuiWindowFlags_NoInputs);
 
+    draw_interface_stats();
+
     ImGui::End();
 }
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void HUD::draw_interface_stats()
+{
+    ImDrawList& draw_list = *ImGui::GetWindowDrawList();
+    ImVec2 display_size(m_hal.get_display_size());
+    float line_height = ImGui::GetTextLineHeightWithSpacing();
+
+    std::vector<Comms::Interface_Stats> stats = m_comms.get_interface_stats();
+    ImVec2 pos(line_height, display_size.y - line_height * (stats.size() + 1));
+    for (Comms::Interface_Stats const& s: stats)
+    {
+        //an adapter that delivers nothing first only burns CPU
+        ImU32 color = s.unique_count > 0 ? IM_COL32(255, 255, 255, 255) : IM_COL32(255, 128, 0, 255);
+
+        char text[256];
+        snprintf(text, sizeof(text), "%s: %zu pk/s, %zu first, %zu dup (+%.1fms), %zu bad FCS, %d/%d/%d dBm",
+                 s.interface.c_str(), s.packet_count, s.unique_count, s.duplicate_count,
+                 std::chrono::duration<float, std::milli>(s.avg_arrival_delta).count(), s.bad_fcs_count,
+                 s.min_input_dBm, s.avg_input_dBm, s.max_input_dBm);
+        AddShadowText(draw_list, pos, color, text);
+        pos.y += line_height;
+    }
+}
@@ -1,16 +1,20 @@
 #pragma once
 
 class IHAL;
+class Comms;
 
 class HUD
 {
 public:
-    HUD(IHAL& hal);
+    HUD(IHAL& hal, Comms& comms);
 
     void draw();
 
 private:
 
+    void draw_interface_stats(); //a line per adapter, to place the antennas
+
     IHAL& m_hal;
+    Comms& m_comms;
 };
 
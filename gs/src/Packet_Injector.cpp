@@ -0,0 +1,87 @@
+#include "Packet_Injector.h"
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include "Log.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+Packet_Injector::~Packet_Injector()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Packet_Injector::init(std::string const& interface)
+{
+    m_interface = interface;
+
+    //protocol 0 - nothing is received on this socket
+    m_fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (m_fd < 0)
+    {
+        LOGE("Unable to open packet socket for {}: {}", interface, strerror(errno));
+        return false;
+    }
+
+    sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = 0;
+    addr.sll_ifindex = if_nametoindex(interface.c_str());
+    if (addr.sll_ifindex == 0)
+    {
+        LOGE("Unknown interface {}", interface);
+        return false;
+    }
+    if (bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+    {
+        LOGE("Unable to bind the packet socket to {}: {}", interface, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+size_t Packet_Injector::inject(Buffer const* buffers, size_t count)
+{
+    m_iovecs.resize(count);
+    m_messages.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        m_iovecs[i].iov_base = const_cast<void*>(buffers[i].data);
+        m_iovecs[i].iov_len = buffers[i].size;
+
+        memset(&m_messages[i], 0, sizeof(mmsghdr));
+        m_messages[i].msg_hdr.msg_iov = &m_iovecs[i];
+        m_messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t sent = 0;
+    while (sent < count)
+    {
+        int r = sendmmsg(m_fd, m_messages.data() + sent, static_cast<unsigned>(count - sent), 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            LOGW("Trouble injecting packets on {}: {} / {}: {}", m_interface, sent, count, strerror(errno));
+            break;
+        }
+
+        for (size_t i = sent; i < sent + r; i++)
+        {
+            if (m_messages[i].msg_len != buffers[i].size)
+                LOGW("Incomplete packet sent: {} / {}", m_messages[i].msg_len, buffers[i].size);
+        }
+        sent += r;
+    }
+    return sent;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+//An AF_PACKET socket used only to inject frames, with sendmmsg so a batch of frames costs one syscall.
+//It doesn't receive anything and has no lock shared with the RX of the same interface.
+class Packet_Injector
+{
+public:
+    Packet_Injector() = default;
+    ~Packet_Injector();
+
+    Packet_Injector(Packet_Injector const&) = delete;
+    Packet_Injector& operator=(Packet_Injector const&) = delete;
+
+    bool init(std::string const& interface);
+
+    struct Buffer
+    {
+        void const* data = nullptr;
+        size_t size = 0;
+    };
+
+    //Sends the frames in order, as one sendmmsg if the socket has room for them.
+    //Returns how many were sent, less than count on error
+    size_t inject(Buffer const* buffers, size_t count);
+
+private:
+    int m_fd = -1;
+    std::string m_interface;
+    std::vector<iovec> m_iovecs;
+    std::vector<mmsghdr> m_messages;
+};
@@ -0,0 +1,148 @@
+#include "Packet_Ring.h"
+#include <cstring>
+#include <cassert>
+#include <cerrno>
+#include <atomic>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include "Log.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+Packet_Ring::~Packet_Ring()
+{
+    if (m_ring)
+        munmap(m_ring, m_ring_size);
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Packet_Ring::init(std::string const& interface, Descriptor const& descriptor, sock_fprog const* filter)
+{
+    m_fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (m_fd < 0)
+    {
+        LOGE("Unable to open packet socket for {}: {}", interface, strerror(errno));
+        return false;
+    }
+
+    //attach the filter before binding so no unfiltered frames get in the ring
+    if (filter && setsockopt(m_fd, SOL_SOCKET, SO_ATTACH_FILTER, filter, sizeof(*filter)) < 0)
+    {
+        LOGE("Unable to attach filter on {}: {}", interface, strerror(errno));
+        return false;
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(m_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+    {
+        LOGE("TPACKET_V3 not supported on {}: {}", interface, strerror(errno));
+        return false;
+    }
+
+    tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = descriptor.block_size;
+    req.tp_block_nr = descriptor.block_count;
+    req.tp_frame_size = descriptor.frame_size;
+    req.tp_frame_nr = (descriptor.block_size * descriptor.block_count) / descriptor.frame_size;
+    req.tp_retire_blk_tov = descriptor.block_timeout_ms;
+    if (setsockopt(m_fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+    {
+        LOGE("Unable to create the RX ring on {}: {}", interface, strerror(errno));
+        return false;
+    }
+
+    m_block_size = descriptor.block_size;
+    m_block_count = descriptor.block_count;
+    m_ring_size = m_block_size * m_block_count;
+    void* ring = mmap(nullptr, m_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, m_fd, 0);
+    if (ring == MAP_FAILED)
+        ring = mmap(nullptr, m_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0); //MAP_LOCKED needs CAP_IPC_LOCK or enough RLIMIT_MEMLOCK
+    if (ring == MAP_FAILED)
+    {
+        LOGE("Unable to map the RX ring of {}: {}", interface, strerror(errno));
+        return false;
+    }
+    m_ring = reinterpret_cast<uint8_t*>(ring);
+
+    sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = if_nametoindex(interface.c_str());
+    if (addr.sll_ifindex == 0)
+    {
+        LOGE("Unknown interface {}", interface);
+        return false;
+    }
+    if (bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+    {
+        LOGE("Unable to bind the packet socket to {}: {}", interface, strerror(errno));
+        return false;
+    }
+
+    LOGI("RX ring on {}: {} blocks of {} KB", interface, m_block_count, m_block_size / 1024);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+int Packet_Ring::get_fd() const
+{
+    return m_fd;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Packet_Ring::acquire_block(std::vector<Frame>& frames)
+{
+    frames.clear();
+    if (!m_ring)
+        return false;
+
+    assert(!m_block_acquired);
+
+    tpacket_block_desc& block = *reinterpret_cast<tpacket_block_desc*>(m_ring + m_block_index * m_block_size);
+    uint32_t status = reinterpret_cast<std::atomic<uint32_t>&>(block.hdr.bh1.block_status).load(std::memory_order_acquire);
+    if ((status & TP_STATUS_USER) == 0)
+        return false;
+
+    uint8_t* ptr = reinterpret_cast<uint8_t*>(&block) + block.hdr.bh1.offset_to_first_pkt;
+    for (uint32_t i = 0; i < block.hdr.bh1.num_pkts; i++)
+    {
+        tpacket3_hdr const& header = *reinterpret_cast<tpacket3_hdr const*>(ptr);
+
+        //the sockaddr_ll follows the header. Skip what we inject ourselves, same as PCAP_D_IN
+        sockaddr_ll const& addr = *reinterpret_cast<sockaddr_ll const*>(ptr + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+        if (addr.sll_pkttype != PACKET_OUTGOING)
+            frames.push_back({ ptr + header.tp_mac, header.tp_snaplen, header.tp_sec, header.tp_nsec });
+
+        ptr += header.tp_next_offset;
+    }
+
+    m_block_acquired = true;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Packet_Ring::release_block()
+{
+    if (!m_block_acquired)
+        return;
+
+    tpacket_block_desc& block = *reinterpret_cast<tpacket_block_desc*>(m_ring + m_block_index * m_block_size);
+    reinterpret_cast<std::atomic<uint32_t>&>(block.hdr.bh1.block_status).store(TP_STATUS_KERNEL, std::memory_order_release);
+
+    m_block_index = (m_block_index + 1) % m_block_count;
+    m_block_acquired = false;
+}
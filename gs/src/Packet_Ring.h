@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct sock_fprog;
+
+//An AF_PACKET socket with a TPACKET_V3 RX ring.
+//The kernel fills whole blocks of frames in the mmap'ed ring and hands them over when they are full or after a short
+//  timeout, so the frames of a block are read in place with a single poll/select wakeup and no syscall per frame.
+class Packet_Ring
+{
+public:
+    Packet_Ring() = default;
+    ~Packet_Ring();
+
+    Packet_Ring(Packet_Ring const&) = delete;
+    Packet_Ring& operator=(Packet_Ring const&) = delete;
+
+    struct Descriptor
+    {
+        size_t block_size = 64 * 1024;
+        size_t block_count = 32;
+        size_t frame_size = 2048; //only a hint for the kernel, frames are packed in the blocks
+        uint32_t block_timeout_ms = 1; //a block is handed over after this long even if not full
+    };
+
+    //filter can be null
+    bool init(std::string const& interface, Descriptor const& descriptor, sock_fprog const* filter);
+
+    //to select/epoll on, readable when a block is ready
+    int get_fd() const;
+
+    struct Frame
+    {
+        uint8_t const* data = nullptr;
+        size_t size = 0;
+        uint32_t ts_sec = 0; //when the kernel received it
+        uint32_t ts_nsec = 0;
+    };
+
+    //Returns the incoming frames of the next ready block, false if there is none.
+    //The frames stay valid until release_block() gives the block back to the kernel.
+    bool acquire_block(std::vector<Frame>& frames);
+    void release_block();
+
+private:
+    int m_fd = -1;
+    uint8_t* m_ring = nullptr;
+    size_t m_ring_size = 0;
+    size_t m_block_size = 0;
+    size_t m_block_count = 0;
+    size_t m_block_index = 0;
+    bool m_block_acquired = false;
+};
@@ -6,10 +6,10 @@
 #include <mutex>
 #include <memory>
 #include <thread>
-#include <condition_variable>
 #include "fmt/format.h"
 #include "Clock.h"
 #include "Pool.h"
+#include "SPSC_Queue.h"
 #include "IHAL.h"
 #include <SDL2/SDL.h>
 #include "main.h"
@@ -51,9 +51,15 @@ struct Video_Decoder::Impl
 
     Pool<Input> input_pool;
 
-    std::mutex input_queue_mutex;
-    std::deque<Input_ptr> input_queue;
-    std::condition_variable input_queue_cv;
+    //One queue per decoder thread, all fed by the thread calling decode_data()
+    struct Thread_Input
+    {
+        static constexpr size_t QUEUE_CAPACITY = 16;
+        SPSC_Queue<Input_ptr> queue;
+        std::atomic_bool is_busy = {false};
+    };
+    std::vector<std::unique_ptr<Thread_Input>> thread_inputs;
+    size_t next_thread_input = 0;
 
     ///
 
@@ -72,11 +78,9 @@ Video_Decoder::Video_Decoder()
 
 Video_Decoder::~Video_Decoder()
 {
-    {
-        std::unique_lock<std::mutex> lg(m_impl->input_queue_mutex);
-        m_exit = true;
-    }
-    m_impl->input_queue_cv.notify_all();
+    m_exit = true;
+    for (auto& thread_input: m_impl->thread_inputs)
+        thread_input->queue.notify();
 
     for (auto& t: m_impl->threads)
         if (t.joinable())
@@ -96,15 +100,25 @@ bool Video_Decoder::init(IHAL& hal)
     m_impl->window = (SDL_Window*)hal.get_window();
     assert(m_impl->window != nullptr);
 
-    m_impl->output_pool.on_acquire = [this](Output& output) 
-    {
-    };
-
 #ifdef TEST_DISPLAY_LATENCY
-    for (size_t i = 0; i < 1; i++)
+    size_t thread_count = 1;
 #else
-    for (size_t i = 0; i < 4; i++)
+    size_t thread_count = 4;
 #endif
+
+    //all the queues exist before the threads start using them
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        auto thread_input = std::make_unique<Impl::Thread_Input>();
+        if (!thread_input->queue.init(Impl::Thread_Input::QUEUE_CAPACITY, true))
+        {
+            LOGE("Unable to create the decoder input queue");
+            return false;
+        }
+        m_impl->thread_inputs.push_back(std::move(thread_input));
+    }
+
+    for (size_t i = 0; i < thread_count; i++)
     {
         SDL_GLContext context = SDL_GL_CreateContext(m_impl->window);
         assert(context != nullptr);
@@ -124,6 +138,29 @@ ImVec2 Video_Decoder::get_video_resolution() const
     return m_resolution;
 }
 
+//Hands the input to an idle decoder thread if there is one so it starts right away, round robin otherwise
+static void push_input(Video_Decoder::Impl& impl, Input_ptr&& input)
+{
+    size_t count = impl.thread_inputs.size();
+    if (count == 0)
+        return;
+
+    size_t index = impl.next_thread_input % count;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t idx = (impl.next_thread_input + i) % count;
+        if (!impl.thread_inputs[idx]->is_busy)
+        {
+            index = idx;
+            break;
+        }
+    }
+    impl.next_thread_input = index + 1;
+
+    if (!impl.thread_inputs[index]->queue.push(std::move(input)))
+        LOGW("Decoder {} input queue full, dropping frame", index);
+}
+
 bool Video_Decoder::decode_data(void const* data, size_t size)
 {
     if (!data || size == 0)
@@ -133,12 +170,7 @@ bool Video_Decoder::decode_data(void const* data, size_t size)
     input->data.resize(size);
     memcpy(input->data.data(), data, size);
 
-    {
-        std::unique_lock<std::mutex> lg(m_impl->input_queue_mutex);
-        m_impl->input_queue.push_back(input);
-    }
-
-    m_impl->input_queue_cv.notify_all();
+    push_input(*m_impl, std::move(input));
 
     return true;
 }
@@ -148,12 +180,7 @@ void Video_Decoder::inject_test_data(uint32_t value)
     Input_ptr input = m_impl->input_pool.acquire();
     input->test_value = value;
 
-    {
-        std::unique_lock<std::mutex> lg(m_impl->input_queue_mutex);
-        m_impl->input_queue.push_back(input);
-    }
-
-    m_impl->input_queue_cv.notify_all();
+    push_input(*m_impl, std::move(input));
 }
 
 Clock::time_point s_start = Clock::now();
@@ -163,25 +190,22 @@ void Video_Decoder::decoder_thread_proc(size_t thread_index)
     LOGI("SDL window: {}", (size_t)m_impl->window);
     SDLCHK(SDL_GL_MakeCurrent(m_impl->window, m_impl->contexts[thread_index]));
 
+    Impl::Thread_Input& thread_input = *m_impl->thread_inputs[thread_index];
+
     while (!m_exit)
     {
+        //only the latest input is decoded, the older ones are stale
         Input_ptr input;
-        {
-            std::unique_lock<std::mutex> lg(m_impl->input_queue_mutex);
-            if (m_impl->input_queue.empty())
-                m_impl->input_queue_cv.wait(lg, [this] { return m_impl->input_queue.empty() == false || m_exit == true; });
-
-            if (m_exit)
-                break;
+        for (Input_ptr i; thread_input.queue.pop(i);)
+            input = std::move(i);
 
-            if (!m_impl->input_queue.empty())
-            {
-                input = m_impl->input_queue.back();
-                m_impl->input_queue.clear();
-            }
-            else
-                continue;
+        if (!input)
+        {
+            thread_input.is_busy = false;
+            thread_input.queue.wait();
+            continue;
         }
+        thread_input.is_busy = true;
 #ifdef TEST_DISPLAY_LATENCY
         uint32_t width = 800;
         uint32_t height = 600;
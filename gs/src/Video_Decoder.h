@@ -1,6 +1,8 @@
 #pragma once
 
 #include <memory>
+#include <array>
+#include <atomic>
 #include "imgui.h"
 
 class IHAL;
@@ -28,7 +30,7 @@ private:
     void decoder_thread_proc(size_t thread_index);
 
     IHAL* m_hal = nullptr;
-    bool m_exit = false;
+    std::atomic_bool m_exit = {false};
     ImVec2 m_resolution;
     std::array<uint32_t, 3> m_textures;
     std::unique_ptr<Impl> m_impl;
@@ -18,6 +18,10 @@
 #include "Log.h"
 #include "Video_Decoder.h" 
 #include "crc.h"
+#include "fec.h"
+#include "fec_fft.h"
+#include "fec_code.h"
+#include "fec_codec.h"
 #include "packets.h"
 #include <thread>
 #include "imgui_impl_opengl3.h"
@@ -52,6 +56,8 @@ void __assert_fail(const char* __assertion, const char* __file, unsigned int __l
 
 static std::thread s_comms_thread;
 
+static constexpr size_t MAX_RX_BATCH_SIZE = 64;
+
 static std::mutex s_ground2air_config_packet_mutex;
 static Ground2Air_Config_Packet s_ground2air_config_packet;
 
@@ -78,14 +84,9 @@ static void comms_thread_proc()
     uint32_t video_frame_index = 0;
     uint8_t video_next_part_index = 0;
 
-    struct RX_Data
-    {
-        std::array<uint8_t, AIR2GROUND_MTU> data;
-        size_t size;
-        int16_t rssi = 0;
-    };
-
-    RX_Data rx_data;
+    //received in batches, straight from the comms packets
+    std::vector<Comms::RX_Packet_ptr> rx_packets;
+    rx_packets.reserve(MAX_RX_BATCH_SIZE);
 
     while (true)
     {
@@ -155,50 +156,57 @@ static void comms_thread_proc()
 
         //pump the comms to avoid packages accumulating
         s_comms.process();
-        s_comms.receive(rx_data.data.data(), rx_data.size);
+        s_comms.receive_batch(rx_packets, MAX_RX_BATCH_SIZE);
+        rx_packets.clear();
 #else
         //receive new packets
-        do
+        s_comms.process();
+        if (s_comms.receive_batch(rx_packets, MAX_RX_BATCH_SIZE) == 0)
         {
-            s_comms.process();
-            if (!s_comms.receive(rx_data.data.data(), rx_data.size))
-            {
-                std::this_thread::yield();
-                break;
-            }
+            //sleep until packets arrive or it's time to send the config again
+            Clock::duration timeout = std::chrono::milliseconds(500) - (Clock::now() - last_comms_sent_tp);
+            s_comms.wait(std::min<Clock::duration>(timeout, std::chrono::milliseconds(50)));
+            continue;
+        }
+
+        int16_t rssi = (int16_t)s_comms.get_input_dBm();
 
-            rx_data.rssi = (int16_t)s_comms.get_input_dBm();
+        for (Comms::RX_Packet_ptr const& rx_packet: rx_packets)
+        {
+            //the packet data is shared with the comms, read it in place
+            uint8_t const* rx_data = rx_packet->data.data();
+            size_t rx_size = rx_packet->data.size();
 
             //filter bad packets
-            Air2Ground_Header& air2ground_header = *(Air2Ground_Header*)rx_data.data.data();
+            Air2Ground_Header const& air2ground_header = *(Air2Ground_Header const*)rx_data;
             if (air2ground_header.type != Air2Ground_Header::Type::Video)
             {
                 LOGE("Unknown air packet: {}", air2ground_header.type);
-                break;
+                continue;
             }
 
             uint32_t video_packet_size = air2ground_header.size;
-            if (video_packet_size > rx_data.size)
+            if (video_packet_size > rx_size)
             {
-                LOGE("Video frame {}: data too big: {} > {}", video_frame_index, video_packet_size, rx_data.size);
-                break;
+                LOGE("Video frame {}: data too big: {} > {}", video_frame_index, video_packet_size, rx_size);
+                continue;
             }
 
             if (video_packet_size < sizeof(Air2Ground_Video_Packet))
             {
                 LOGE("Video frame {}: data too small: {} > {}", video_frame_index, video_packet_size, sizeof(Air2Ground_Video_Packet));
-                break;
+                continue;
             }
 
             size_t payload_size = video_packet_size - sizeof(Air2Ground_Video_Packet);
-            Air2Ground_Video_Packet& air2ground_video_packet = *(Air2Ground_Video_Packet*)rx_data.data.data();
+            Air2Ground_Video_Packet air2ground_video_packet = *(Air2Ground_Video_Packet const*)rx_data; //a copy, so the crc can be cleared
             uint8_t crc = air2ground_video_packet.crc;
             air2ground_video_packet.crc = 0;
-            uint8_t computed_crc = crc8(0, rx_data.data.data(), sizeof(Air2Ground_Video_Packet));
+            uint8_t computed_crc = crc8(0, &air2ground_video_packet, sizeof(Air2Ground_Video_Packet));
             if (crc != computed_crc)
             {
                 LOGE("Video frame {}, {} {}: crc mismatch: {} != {}", air2ground_video_packet.frame_index, (int)air2ground_video_packet.part_index, payload_size, crc, computed_crc);
-                break;
+                continue;
             }
 
             if (air2ground_video_packet.pong == last_sent_ping)
@@ -211,8 +219,8 @@ static void comms_thread_proc()
                 ping_count++;
             }
 
-            total_data += rx_data.size;
-            min_rssi = std::min(min_rssi, rx_data.rssi);
+            total_data += rx_size;
+            min_rssi = std::min(min_rssi, rssi);
             //LOGI("OK Video frame {}, {} {} - CRC OK {}. {}", air2ground_video_packet.frame_index, (int)air2ground_video_packet.part_index, payload_size, crc, rx_queue.size());
 
             if ((air2ground_video_packet.frame_index + 200 < video_frame_index) ||                 //frame from the distant past? TX was restarted
@@ -231,9 +239,7 @@ static void comms_thread_proc()
             if (air2ground_video_packet.frame_index == video_frame_index && air2ground_video_packet.part_index == video_next_part_index)
             {
                 video_next_part_index++;
-                size_t offset = video_frame.size();
-                video_frame.resize(offset + payload_size);
-                memcpy(video_frame.data() + offset, rx_data.data.data() + sizeof(Air2Ground_Video_Packet), payload_size);
+                video_frame.insert(video_frame.end(), rx_data + sizeof(Air2Ground_Video_Packet), rx_data + sizeof(Air2Ground_Video_Packet) + payload_size);
 
                 if (video_next_part_index > 0 && air2ground_video_packet.last_part != 0)
                 {
@@ -243,8 +249,9 @@ static void comms_thread_proc()
                     video_frame.clear();
                 }
             }
-        } 
-        while (false);
+        }
+
+        rx_packets.clear(); //give the packets back to the comms
 #endif
     }
 }
@@ -285,7 +292,7 @@ void ImageRotated(ImTextureID tex_id, ImVec2 center, ImVec2 size, float angle, f
 
 int run()
 {
-    HUD hud(*s_hal);
+    HUD hud(*s_hal, s_comms);
 
     ImVec2 display_size = s_hal->get_display_size();
     ImGuiStyle& style = ImGui::GetStyle();
@@ -387,7 +394,7 @@ int run()
         // ImDrawList* draw_list = ImGui::GetWindowDrawList();
         // draw_list->AddRectFilled(ImVec2(0, 0), display_size, s_test_latency_gpio_value == 0 ? 0x0 : 0xFFFFFFFF, 0.0f);
 
-        //hud.draw();
+        hud.draw();
         ImGui::Begin("HAL");
         {
             {
@@ -462,9 +469,141 @@ int run()
     return 0;
 }
 
+//Replays captures through a Comms of its own and reports the throughput, the recovered blocks and the latency of each stage
+static int run_replay(Comms::RX_Descriptor const& rx_descriptor)
+{
+    if (rx_descriptor.interfaces.empty())
+    {
+        LOGE("Usage: --replay [--fast] capture.pcap...");
+        return -1;
+    }
+
+    Comms comms;
+    if (!comms.init(rx_descriptor, Comms::TX_Descriptor()))
+        return -1;
+
+    auto to_us = [](Clock::duration d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); };
+    auto log_stats = [&to_us](Comms::RX_Stats const& stats, size_t packets, float d)
+    {
+        LOGI("{} packets/s, {} stored, {} released, {} blocks recovered ({} packets), {} blocks skipped, {} packets salvaged",
+            static_cast<size_t>(packets / std::max(d, 0.001f)), stats.packet_count, stats.released_packet_count,
+            stats.recovered_block_count, stats.recovered_packet_count, stats.skipped_block_count, stats.salvaged_packet_count);
+        LOGI("Latency (avg/max us): block {}/{}, decode {}/{}, queue {}/{}",
+            to_us(stats.block_latency.avg), to_us(stats.block_latency.max),
+            to_us(stats.decode_latency.avg), to_us(stats.decode_latency.max),
+            to_us(stats.queue_latency.avg), to_us(stats.queue_latency.max));
+    };
+
+    std::vector<Comms::RX_Packet_ptr> rx_packets;
+    size_t packet_count = 0;
+    size_t last_packet_count = 0;
+    Clock::time_point start_tp = Clock::now();
+    Clock::time_point last_stats_tp = start_tp;
+    while (true)
+    {
+        bool is_replaying = comms.is_replaying(); //before draining, so nothing replayed after this is missed
+
+        comms.process();
+        size_t count = 0;
+        while ((count = comms.receive_batch(rx_packets, MAX_RX_BATCH_SIZE)) > 0)
+            packet_count += count;
+        rx_packets.clear();
+
+        Clock::time_point now = Clock::now();
+        if (now - last_stats_tp >= std::chrono::seconds(1))
+        {
+            log_stats(comms.get_rx_stats(), packet_count - last_packet_count, std::chrono::duration<float>(now - last_stats_tp).count());
+            last_packet_count = packet_count;
+            last_stats_tp = now;
+        }
+
+        if (!is_replaying)
+            break;
+
+        comms.wait(std::chrono::milliseconds(50));
+    }
+
+    //give the last blocks their deadline, then release whatever is left
+    std::this_thread::sleep_for(rx_descriptor.max_latency);
+    comms.process();
+    while (size_t count = comms.receive_batch(rx_packets, MAX_RX_BATCH_SIZE))
+        packet_count += count;
+    rx_packets.clear();
+
+    float d = std::chrono::duration<float>(Clock::now() - start_tp).count();
+    LOGI("Replay done in {}s", d);
+    log_stats(comms.get_rx_stats(), packet_count, d);
+    return 0;
+}
+
 int main(int argc, const char* argv[])
 {
-    init_crc8_table();
+    if (argc > 1 && strcmp(argv[1], "--fec-bench") == 0)
+    {
+        //the codes used in production: 2/3, 4/7, 12/20 for the video and 2/6 for the uplink
+        int result = 0;
+        result |= rtos_queue_stress_test(200000); //the queues between the codec tasks
+
+        result |= fec_benchmark(2, 3, AIR2GROUND_MTU);
+        result |= fec_benchmark(4, 7, AIR2GROUND_MTU);
+        result |= fec_benchmark(12, 20, AIR2GROUND_MTU);
+        result |= fec_benchmark(2, 6, GROUND2AIR_DATA_MAX_SIZE);
+
+        //the compile time specialized encoders of the same codes
+        result |= fec_code_benchmark(2, 3, AIR2GROUND_MTU);
+        result |= fec_code_benchmark(4, 7, AIR2GROUND_MTU);
+        result |= fec_code_benchmark(12, 20, AIR2GROUND_MTU);
+        result |= fec_code_benchmark(2, 6, GROUND2AIR_DATA_MAX_SIZE);
+
+        //the whole air encoder -> ground decoder path, over a lossy link
+        result |= fec_codec_benchmark(2, 3, AIR2GROUND_MTU, 5);
+        result |= fec_codec_benchmark(4, 7, AIR2GROUND_MTU, 10);
+        result |= fec_codec_benchmark(12, 20, AIR2GROUND_MTU, 10);
+        result |= fec_codec_benchmark(2, 6, GROUND2AIR_DATA_MAX_SIZE, 20);
+        //the video frames close their blocks early, so the shortened blocks have to decode too
+        result |= fec_codec_benchmark(4, 7, AIR2GROUND_MTU, 10, Fec_Codec::Codec::Vandermonde, true);
+        result |= fec_codec_benchmark(12, 20, AIR2GROUND_MTU, 10, Fec_Codec::Codec::Vandermonde, true);
+
+        //the FFT codec, for the big blocks that survive long interference bursts
+        result |= fec_fft_benchmark(12, 20, AIR2GROUND_MTU);
+        result |= fec_fft_benchmark(64, 80, AIR2GROUND_MTU);
+        result |= fec_fft_benchmark(200, 255, AIR2GROUND_MTU);
+        result |= fec_codec_benchmark(64, 80, AIR2GROUND_MTU, 10, Fec_Codec::Codec::FFT);
+        result |= fec_codec_benchmark(200, 255, AIR2GROUND_MTU, 10, Fec_Codec::Codec::FFT);
+        result |= fec_codec_benchmark(64, 80, AIR2GROUND_MTU, 10, Fec_Codec::Codec::FFT, true);
+        return result;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--radiotap-bench") == 0)
+        return Comms::radiotap_benchmark();
+
+    Comms::RX_Descriptor rx_descriptor;
+    rx_descriptor.codec = (Fec_Codec::Codec)s_ground2air_config_packet.fec_codec_type;
+    rx_descriptor.coding_k = s_ground2air_config_packet.fec_codec_k;
+    rx_descriptor.coding_n = s_ground2air_config_packet.fec_codec_n;
+    rx_descriptor.mtu = s_ground2air_config_packet.fec_codec_mtu;
+    rx_descriptor.interfaces = {"wlan1", "wlan2"};
+    rx_descriptor.max_latency = std::chrono::milliseconds(100); //partial blocks are released after this, a few video frames at most
+    rx_descriptor.backend = Comms::RX_Descriptor::Backend::Packet_Ring;
+    rx_descriptor.single_rx_thread = true;
+    rx_descriptor.run_to_completion = true;
+    rx_descriptor.fec_worker_count = std::thread::hardware_concurrency() > 2 ? 2 : 0; //keep the decoding on the comms thread on small CPUs
+    //rx_descriptor.salvage_bad_fcs = true; //only with adapters that pass the bad frames and their FCS up
+    //rx_descriptor.capture_dir = "/home/pi/captures"; //saves the raw frames of each adapter, to look into breakups or to --replay them
+
+    //--replay [--fast] capture.pcap... runs the RX path on recorded captures, without the HAL, the decoder or the TX
+    if (argc > 1 && strcmp(argv[1], "--replay") == 0)
+    {
+        rx_descriptor.interfaces.clear();
+        for (int i = 2; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--fast") == 0)
+                rx_descriptor.replay_realtime = false;
+            else
+                rx_descriptor.interfaces.push_back(std::string("file:") + argv[i]);
+        }
+        return run_replay(rx_descriptor);
+    }
 
     s_hal.reset(new PI_HAL());
     if (!s_hal->init())
@@ -474,16 +613,12 @@ int main(int argc, const char* argv[])
     gpioSetMode(17, PI_OUTPUT);
 #endif
 
-    Comms::RX_Descriptor rx_descriptor;
-    rx_descriptor.coding_k = s_ground2air_config_packet.fec_codec_k;
-    rx_descriptor.coding_n = s_ground2air_config_packet.fec_codec_n;
-    rx_descriptor.mtu = s_ground2air_config_packet.fec_codec_mtu;
-    rx_descriptor.interfaces = {"wlan1", "wlan2"};
     Comms::TX_Descriptor tx_descriptor;
     tx_descriptor.coding_k = 2;
     tx_descriptor.coding_n = 6;
     tx_descriptor.mtu = GROUND2AIR_DATA_MAX_SIZE;
     tx_descriptor.interface = "wlan1";
+    tx_descriptor.backend = Comms::TX_Descriptor::Backend::Packet_Socket;
     if (!s_comms.init(rx_descriptor, tx_descriptor))
         return -1;
 
@@ -1,71 +1,379 @@
 #pragma once
 
-#include <deque>
-#include <map>
+#include <array>
 #include <vector>
 #include <atomic>
 #include <mutex>
 #include <memory>
-#include <functional>
+#include <utility>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 
-template<class T> struct Pool
+//Object pool handing out intrusive refcounted pointers.
+//The items are allocated in chunks that never move and are never freed while the pool lives. The free ones are kept
+//  in a lock-free list indexed by item index (with an ABA tag), and every thread keeps a small cache of free items
+//  in front of it so most acquire/release pairs touch no shared cache line at all.
+//The caches hold a reference to the pool storage, so a thread can outlive the pool (or the other way around) safely.
+//The Ptrs themselves must not outlive the pool.
+//acquire() hands out the item as it was last released, so its buffers keep their capacity. The caller resets what it uses.
+template<class T> class Pool
 {
-    std::function<void(T&)> on_acquire;
-    std::function<void(T&)> on_release;
+public:
+    class Ptr;
 
-    typedef std::shared_ptr<T> Ptr;
     Pool();
+
+    Pool(Pool const&) = delete;
+    Pool& operator=(Pool const&) = delete;
+
     Ptr acquire();
 
+    //Acquires count items, calls prepare(T&) on each and releases them, so the expected working set is allocated
+    //  (and has its buffers reserved) before the hot path starts
+    template<class F> void prewarm(size_t count, F&& prepare);
+
+    struct Stats
+    {
+        size_t allocated = 0; //items ever allocated
+        size_t new_count = 0; //acquired for the first time
+        size_t reused_count = 0; //acquired after being used before
+        size_t returned_count = 0; //released back into the pool
+    };
+    Stats get_stats() const; //each thread publishes its counts in batches, so these lag a little
+
 private:
-    std::function<void(T*)> m_garbage_collector;
-    std::mutex m_mutex;
-    std::vector<std::unique_ptr<T>> m_items;
+    struct Node
+    {
+        T item;
+        std::atomic<uint32_t> ref_count = { 0 };
+        std::atomic<uint32_t> next_free = { 0 }; //index + 1 of the next free node, 0 for the end of the list
+        uint32_t index = 0;
+        bool was_used = false;
+        Pool* pool = nullptr;
+    };
+
+    //chunk i has FIRST_CHUNK_SIZE << i nodes
+    static constexpr uint32_t FIRST_CHUNK_SIZE = 32;
+    static constexpr size_t MAX_CHUNK_COUNT = 24;
+
+    struct Storage
+    {
+        ~Storage();
+
+        Node* get_node(uint32_t index) const;
+        Node* pop();
+        void push(Node* first, Node* last); //first..last are already linked through next_free
+
+        std::array<std::atomic<Node*>, MAX_CHUNK_COUNT> chunks = {};
+        size_t chunk_count = 0; //guarded by grow_mutex
+        std::mutex grow_mutex;
+
+        alignas(64) std::atomic<uint64_t> free_head = { 0 }; //ABA tag << 32 | (index + 1)
 
-    int x_reused = 0;
-    int x_new = 0;
-    int x_returned = 0;
+        alignas(64) std::atomic<size_t> allocated = { 0 };
+        std::atomic<size_t> new_count = { 0 };
+        std::atomic<size_t> reused_count = { 0 };
+        std::atomic<size_t> returned_count = { 0 };
+    };
+
+    struct Thread_Cache
+    {
+        ~Thread_Cache();
+        void flush(size_t count);
+        void publish_stats();
+
+        static constexpr size_t CAPACITY = 32;
+        std::shared_ptr<Storage> storage;
+        std::array<Node*, CAPACITY> nodes;
+        size_t count = 0;
+
+        //counted here and published every STATS_BATCH operations, so the stats don't cost an atomic RMW each
+        static constexpr size_t STATS_BATCH = 64;
+        size_t new_count = 0;
+        size_t reused_count = 0;
+        size_t returned_count = 0;
+    };
+    static inline thread_local Thread_Cache s_thread_cache;
+    static inline thread_local bool s_is_thread_cache_destroyed = false; //trivial, so still readable at thread exit
+
+    Node* grow();
+    void release(Node* node);
+    Thread_Cache* get_thread_cache(); //nullptr if the thread is exiting
+
+    std::shared_ptr<Storage> m_storage;
 };
 
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template<class T> class Pool<T>::Ptr
+{
+public:
+    Ptr() = default;
+    Ptr(std::nullptr_t) {}
+    Ptr(Ptr const& other) : m_node(other.m_node)
+    {
+        if (m_node)
+            m_node->ref_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    Ptr(Ptr&& other) noexcept : m_node(other.m_node)
+    {
+        other.m_node = nullptr;
+    }
+    ~Ptr()
+    {
+        reset();
+    }
+
+    Ptr& operator=(Ptr const& other)
+    {
+        Ptr(other).swap(*this);
+        return *this;
+    }
+    Ptr& operator=(Ptr&& other) noexcept
+    {
+        Ptr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    void reset()
+    {
+        //a sole owner cannot race with anyone, so skip the atomic RMW in the common case
+        if (m_node && (m_node->ref_count.load(std::memory_order_acquire) == 1 || 
+                       m_node->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1))
+            m_node->pool->release(m_node);
+        m_node = nullptr;
+    }
+    void swap(Ptr& other) noexcept
+    {
+        std::swap(m_node, other.m_node);
+    }
+
+    T* get() const { return m_node ? &m_node->item : nullptr; }
+    T& operator*() const { return m_node->item; }
+    T* operator->() const { return &m_node->item; }
+    explicit operator bool() const { return m_node != nullptr; }
+
+private:
+    friend class Pool<T>;
+    explicit Ptr(Node* node) : m_node(node) {}
+
+    Node* m_node = nullptr;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template<class T> Pool<T>::Storage::~Storage()
+{
+    for (size_t i = 0; i < chunk_count; i++)
+        delete[] chunks[i].load(std::memory_order_relaxed);
+}
+
+template<class T> auto Pool<T>::Storage::get_node(uint32_t index) const -> Node*
+{
+    //chunk c starts at FIRST_CHUNK_SIZE * (2^c - 1)
+    uint32_t v = index / FIRST_CHUNK_SIZE + 1;
+    uint32_t chunk = 31 - __builtin_clz(v);
+    uint32_t offset = index - FIRST_CHUNK_SIZE * ((1u << chunk) - 1);
+    return &chunks[chunk].load(std::memory_order_relaxed)[offset];
+}
+
+template<class T> auto Pool<T>::Storage::pop() -> Node*
+{
+    uint64_t head = free_head.load(std::memory_order_acquire);
+    while (true)
+    {
+        uint32_t index = static_cast<uint32_t>(head);
+        if (index == 0)
+            return nullptr;
+
+        Node* node = get_node(index - 1);
+        uint64_t tag = (head >> 32) + 1;
+        //next_free might be changing if another thread pops the node first, the tag makes the CAS fail in that case
+        uint64_t new_head = (tag << 32) | node->next_free.load(std::memory_order_relaxed);
+        if (free_head.compare_exchange_weak(head, new_head, std::memory_order_acquire, std::memory_order_acquire))
+            return node;
+    }
+}
+
+template<class T> void Pool<T>::Storage::push(Node* first, Node* last)
+{
+    uint64_t head = free_head.load(std::memory_order_relaxed);
+    while (true)
+    {
+        last->next_free.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        uint64_t tag = (head >> 32) + 1;
+        uint64_t new_head = (tag << 32) | (first->index + 1);
+        if (free_head.compare_exchange_weak(head, new_head, std::memory_order_release, std::memory_order_relaxed))
+            return;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template<class T> Pool<T>::Thread_Cache::~Thread_Cache()
+{
+    flush(count);
+    publish_stats();
+    s_is_thread_cache_destroyed = true;
+}
+
+template<class T> void Pool<T>::Thread_Cache::flush(size_t flush_count)
+{
+    assert(flush_count <= count);
+    if (flush_count == 0)
+        return;
+
+    //link the nodes and give them back with a single CAS
+    size_t first = count - flush_count;
+    for (size_t i = first; i + 1 < count; i++)
+        nodes[i]->next_free.store(nodes[i + 1]->index + 1, std::memory_order_relaxed);
+    storage->push(nodes[first], nodes[count - 1]);
+    count = first;
+}
+
+template<class T> void Pool<T>::Thread_Cache::publish_stats()
+{
+    if (!storage)
+        return;
+    storage->new_count.fetch_add(new_count, std::memory_order_relaxed);
+    storage->reused_count.fetch_add(reused_count, std::memory_order_relaxed);
+    storage->returned_count.fetch_add(returned_count, std::memory_order_relaxed);
+    new_count = 0;
+    reused_count = 0;
+    returned_count = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
 
 template<class T> Pool<T>::Pool()
+    : m_storage(std::make_shared<Storage>())
+{
+}
+
+template<class T> auto Pool<T>::get_thread_cache() -> Thread_Cache*
+{
+    //static pools can die after the thread locals of the main thread
+    if (s_is_thread_cache_destroyed)
+        return nullptr;
+
+    Thread_Cache& cache = s_thread_cache;
+    if (cache.storage != m_storage)
+    {
+        //used with another pool of the same type before. Rare, so just hand all its nodes back
+        if (cache.storage)
+        {
+            cache.flush(cache.count);
+            cache.publish_stats();
+        }
+        cache.storage = m_storage;
+    }
+    return &cache;
+}
+
+template<class T> auto Pool<T>::grow() -> Node*
 {
-    m_garbage_collector = [this](T* t)
+    Storage& storage = *m_storage;
+    std::lock_guard<std::mutex> lg(storage.grow_mutex);
+
+    //another thread might have grown the pool already
+    Node* node = storage.pop();
+    if (node)
+        return node;
+
+    size_t chunk = storage.chunk_count;
+    if (chunk >= MAX_CHUNK_COUNT)
+        return nullptr;
+
+    uint32_t size = FIRST_CHUNK_SIZE << chunk;
+    uint32_t first_index = FIRST_CHUNK_SIZE * ((1u << chunk) - 1);
+    Node* nodes = new Node[size];
+    for (uint32_t i = 0; i < size; i++)
     {
-        x_returned++;
-        if (on_release)
-            on_release(*t);
+        nodes[i].index = first_index + i;
+        nodes[i].pool = this;
+        nodes[i].next_free.store(first_index + i + 2, std::memory_order_relaxed);
+    }
+    storage.chunks[chunk].store(nodes, std::memory_order_relaxed);
+    storage.chunk_count++;
+    storage.allocated += size;
 
-        std::lock_guard<std::mutex> lg(m_mutex);
-        m_items.emplace_back(static_cast<T*>(t)); //will create a unique pointer from the raw one
-//        printf("%d// new:%d reused:%d returned:%d\n", this, x_new, x_reused, x_returned);
-    };
+    //keep the first one, the rest go in the free list
+    if (size > 1)
+        storage.push(&nodes[1], &nodes[size - 1]);
+    return &nodes[0];
 }
 
 template<class T> auto Pool<T>::acquire() -> Ptr
 {
-    //this will be called when the last shared_ptr to T dies. We can safetly return the object to pur pool
+    Thread_Cache* cache = get_thread_cache();
 
-    std::lock_guard<std::mutex> lg(m_mutex);
-    T* item = nullptr;
-    if (!m_items.empty())
+    Node* node = nullptr;
+    if (cache && cache->count > 0)
+        node = cache->nodes[--cache->count];
+    else
     {
-        x_reused++;
-        item = m_items.back().release(); //release the raw ptr from the control of the unique ptr
-        m_items.pop_back();
-//        printf("%d// new:%d reused:%d returned:%d\n", this, x_new, x_reused, x_returned);
+        node = m_storage->pop();
+        if (!node)
+            node = grow();
     }
+    assert(node);
+
+    bool is_new = !node->was_used;
+    node->was_used = true;
+    if (!cache)
+        (is_new ? m_storage->new_count : m_storage->reused_count).fetch_add(1, std::memory_order_relaxed);
     else
     {
-        x_new++;
-        item = new T;
-//        printf("%d// new:%d reused:%d returned:%d\n", this, x_new, x_reused, x_returned);
+        (is_new ? cache->new_count : cache->reused_count)++;
+        if (cache->new_count + cache->reused_count + cache->returned_count >= Thread_Cache::STATS_BATCH)
+            cache->publish_stats();
+    }
+
+    node->ref_count.store(1, std::memory_order_relaxed);
+    return Ptr(node);
+}
+
+template<class T> void Pool<T>::release(Node* node)
+{
+    //this is called when the last Ptr to the item dies. We can safely return the item to our pool
+    Thread_Cache* cache = get_thread_cache();
+    if (!cache)
+    {
+        m_storage->returned_count.fetch_add(1, std::memory_order_relaxed);
+        m_storage->push(node, node);
+        return;
     }
-    assert(item);
 
-    if (on_acquire)
-        on_acquire(static_cast<T&>(*item));
+    if (++cache->returned_count + cache->new_count + cache->reused_count >= Thread_Cache::STATS_BATCH)
+        cache->publish_stats();
+    if (cache->count >= Thread_Cache::CAPACITY)
+        cache->flush(Thread_Cache::CAPACITY / 2);
+    cache->nodes[cache->count++] = node;
+}
 
-    return Ptr(item, [this](T* item) { m_garbage_collector(item); });
+template<class T> template<class F> void Pool<T>::prewarm(size_t count, F&& prepare)
+{
+    std::vector<Ptr> items;
+    items.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        items.push_back(acquire());
+        prepare(*items.back());
+    }
+    items.clear();
+
+    Thread_Cache* cache = get_thread_cache();
+    if (cache)
+        cache->publish_stats();
+}
+
+template<class T> auto Pool<T>::get_stats() const -> Stats
+{
+    Stats stats;
+    stats.allocated = m_storage->allocated.load(std::memory_order_relaxed);
+    stats.new_count = m_storage->new_count.load(std::memory_order_relaxed);
+    stats.reused_count = m_storage->reused_count.load(std::memory_order_relaxed);
+    stats.returned_count = m_storage->returned_count.load(std::memory_order_relaxed);
+    return stats;
 }
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <utility>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+//Bounded lock-free queue between exactly one producer thread and one consumer thread.
+//The producer only writes m_tail and the consumer only writes m_head, each on its own cache line and each side keeps
+//  a cached copy of the other index so the shared line is read only when the queue looks full/empty.
+//With the wakeup enabled the consumer can block in wait() (or poll get_wakeup_fd()) until something is pushed.
+//The producer signals the eventfd only when the consumer is actually waiting, so a busy queue costs no syscalls.
+template<class T> class SPSC_Queue
+{
+public:
+    SPSC_Queue() = default;
+    ~SPSC_Queue();
+
+    SPSC_Queue(SPSC_Queue const&) = delete;
+    SPSC_Queue& operator=(SPSC_Queue const&) = delete;
+
+    //The capacity is rounded up to a power of 2. Call before the threads start using the queue
+    bool init(size_t capacity, bool wakeup);
+
+    //Producer side. Return false if the queue is full, the item is left untouched
+    bool push(T&& item);
+    bool push(T const& item);
+
+    //Consumer side. Returns false if the queue is empty
+    bool pop(T& item);
+    bool empty() const;
+
+    //Consumer side. Blocks until something is pushed or notify() is called. Needs the wakeup
+    void wait();
+
+    //Any thread. Wakes up the consumer, for example to have it check an exit flag
+    void notify();
+
+    //readable when the consumer should wake up, -1 without the wakeup
+    int get_wakeup_fd() const;
+
+private:
+    template<class U> bool push_item(U&& item);
+
+    std::vector<T> m_items;
+    size_t m_mask = 0;
+    int m_wakeup_fd = -1;
+
+    //written by the consumer
+    alignas(64) std::atomic<size_t> m_head = { 0 };
+    std::atomic<bool> m_is_waiting = { false };
+    size_t m_cached_tail = 0;
+
+    //written by the producer
+    alignas(64) std::atomic<size_t> m_tail = { 0 };
+    size_t m_cached_head = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template<class T> SPSC_Queue<T>::~SPSC_Queue()
+{
+    if (m_wakeup_fd >= 0)
+        close(m_wakeup_fd);
+}
+
+template<class T> bool SPSC_Queue<T>::init(size_t capacity, bool wakeup)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    m_items.clear();
+    m_items.resize(size);
+    m_mask = size - 1;
+
+    if (wakeup && m_wakeup_fd < 0)
+    {
+        m_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_wakeup_fd < 0)
+            return false;
+    }
+    return true;
+}
+
+template<class T> template<class U> bool SPSC_Queue<T>::push_item(U&& item)
+{
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_cached_head > m_mask)
+    {
+        m_cached_head = m_head.load(std::memory_order_acquire);
+        if (tail - m_cached_head > m_mask)
+            return false;
+    }
+
+    m_items[tail & m_mask] = std::forward<U>(item);
+    m_tail.store(tail + 1, std::memory_order_release);
+
+    if (m_wakeup_fd >= 0)
+    {
+        //pairs with the fence in wait(): either the consumer sees the new tail or we see it waiting
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_is_waiting.load(std::memory_order_relaxed))
+            notify();
+    }
+    return true;
+}
+
+template<class T> bool SPSC_Queue<T>::push(T&& item)
+{
+    return push_item(std::move(item));
+}
+
+template<class T> bool SPSC_Queue<T>::push(T const& item)
+{
+    return push_item(item);
+}
+
+template<class T> bool SPSC_Queue<T>::pop(T& item)
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_cached_tail)
+    {
+        m_cached_tail = m_tail.load(std::memory_order_acquire);
+        if (head == m_cached_tail)
+            return false;
+    }
+
+    T& slot = m_items[head & m_mask];
+    item = std::move(slot);
+    slot = T(); //don't keep pooled items alive in the ring
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+template<class T> bool SPSC_Queue<T>::empty() const
+{
+    return m_head.load(std::memory_order_relaxed) == m_tail.load(std::memory_order_acquire);
+}
+
+template<class T> void SPSC_Queue<T>::wait()
+{
+    assert(m_wakeup_fd >= 0);
+
+    m_is_waiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (empty())
+    {
+        pollfd pfd = { m_wakeup_fd, POLLIN, 0 };
+        poll(&pfd, 1, -1);
+    }
+    m_is_waiting.store(false, std::memory_order_relaxed);
+
+    uint64_t value;
+    while (read(m_wakeup_fd, &value, sizeof(value)) > 0) {}
+}
+
+template<class T> void SPSC_Queue<T>::notify()
+{
+    if (m_wakeup_fd < 0)
+        return;
+    uint64_t value = 1;
+    ssize_t r = write(m_wakeup_fd, &value, sizeof(value));
+    (void)r;
+}
+
+template<class T> int SPSC_Queue<T>::get_wakeup_fd() const
+{
+    return m_wakeup_fd;
+}